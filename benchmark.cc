@@ -0,0 +1,733 @@
+// PQ-Tree benchmark.  Builds random workloads in the same way as the fuzz
+// test, a random ordering of the leaves and random consecutive runs of it as
+// reductions, and reports how many reductions per second each tree
+// implementation sustains.  On Linux it also reports last level cache misses
+// per reduction through perf_event_open, where the kernel allows it.
+//
+// Run with --allocations to instead count the heap allocations PQTree::Reduce
+// makes once a tree is warm.  This fails unless there are none.  Run with
+// --traversal to only compare walking a tree before and after Compact(),
+// --skipping to only compare the ways of skipping reductions that fail,
+// --laminar to only compare the ways of reducing by nested sets,
+// --preprocessing to only compare ReduceAll() with ReduceAllPreprocessed(),
+// or --common-intervals to only time CommonIntervals.
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <new>
+#include <set>
+#include <vector>
+#include "commonintervals.h"
+#include "compactpqtree.h"
+#include "pqtree.h"
+#include "smallpqtree.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+int TREES = 2000;     // Number of trees built for each workload.
+int REDUCTIONS = 40;  // Number of reductions applied to each tree.
+
+int LARGE_TREE_SIZE = 20000;    // Leaves in the storage engine workload.
+int LARGE_REDUCTIONS = 4000;    // Reductions in the storage engine workload.
+int LARGE_REDUCTION_SIZE = 64;  // Largest reduction in that workload.
+int NOISY_PERCENT = 30;         // Reductions spoilt in the skipping workload.
+int TWINS = 8;                  // Leaves in the same sets when preprocessing.
+
+int GENOMES = 100;            // Permutations in the common intervals benchmark.
+int GENOME_SIZE = 100000;     // Values in each of them.
+int INVERSIONS = 20;          // Runs reversed between one and the next.
+int INVERSION_SIZE = 1000;    // Longest run reversed.
+int QUADRATIC_SIZE = 2000;    // Values for comparing with brute force.
+
+int UNIVERSE_SIZE = 1000000;  // Leaves in the construction benchmark.
+int COPY_REDUCTIONS = 100;    // Reductions applied before copying that tree.
+int COPIES = 10;              // Copies made by each copying method.
+
+int TRAVERSAL_TREE_SIZE = 100000;  // Leaves in the traversal benchmark.
+int TRAVERSAL_REDUCTIONS = 1000;   // Reductions scattering that tree.
+int TRAVERSALS = 20;               // Walks of it timed.
+
+// Number of heap allocations made through operator new, which is replaced
+// below to count them.
+long long allocation_count = 0;
+
+void* operator new(size_t size) {
+  ++allocation_count;
+  void* block = malloc(size ? size : 1);
+  if (!block)
+    throw std::bad_alloc();
+  return block;
+}
+
+void operator delete(void* block) throw() {
+  free(block);
+}
+
+void operator delete(void* block, size_t) throw() {
+  free(block);
+}
+
+// Counts hardware cache misses of this process between Start() and Stop().
+class CacheMissCounter {
+ public:
+  CacheMissCounter() : fd_(-1) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+
+  ~CacheMissCounter() {
+#ifdef __linux__
+    if (fd_ >= 0)
+      close(fd_);
+#endif
+  }
+
+  void Start() {
+#ifdef __linux__
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  // Returns the number of cache misses since Start(), or -1 if the counter is
+  // not available.
+  long long Stop() {
+    long long count = -1;
+#ifdef __linux__
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    }
+#endif
+    return count;
+  }
+
+ private:
+  int fd_;
+};
+
+// A set of reductions to apply to a fresh tree over |leaf_count| leaves.
+struct Workload {
+  int leaf_count;
+  vector<list<set<int> > > reductions;
+};
+
+Workload MakeWorkload(int leaf_count) {
+  Workload workload;
+  workload.leaf_count = leaf_count;
+  vector<int> frontier;
+  for (int i = 0; i < leaf_count; ++i)
+    frontier.push_back(i);
+  for (int i = 0; i < TREES; ++i) {
+    random_shuffle(frontier.begin(), frontier.end());
+    list<set<int> > reductions;
+    for (int j = 0; j < REDUCTIONS; ++j) {
+      int start = rand() % (leaf_count - 2);
+      int size = min(rand() % (leaf_count / 4) + 2, leaf_count - start);
+      reductions.push_back(set<int>(frontier.begin() + start,
+                                    frontier.begin() + start + size));
+    }
+    workload.reductions.push_back(reductions);
+  }
+  return workload;
+}
+
+double Seconds(clock_t start) {
+  return double(clock() - start) / CLOCKS_PER_SEC;
+}
+
+void Report(const char* name, double seconds, double baseline) {
+  double count = double(TREES) * REDUCTIONS;
+  printf("  %-18s %12.0f reductions/s", name, count / seconds);
+  if (baseline > 0)
+    printf("  %6.1fx", baseline / seconds);
+  printf("\n");
+}
+
+double BenchmarkPQTree(const Workload& workload) {
+  set<int> leaves;
+  for (int i = 0; i < workload.leaf_count; ++i)
+    leaves.insert(i);
+  clock_t start = clock();
+  for (int i = 0; i < TREES; ++i) {
+    PQTree tree(leaves);
+    if (!tree.ReduceAll(workload.reductions[i]))
+      printf("PQTree reduction failed\n");
+  }
+  return Seconds(start);
+}
+
+template <int N>
+double BenchmarkSmallPQTree(const Workload& workload) {
+  // Convert the reductions up front, SmallPQTree::Reduce takes a bitmask.
+  vector<vector<typename SmallPQTree<N>::LeafSet> > masks(TREES);
+  for (int i = 0; i < TREES; ++i) {
+    const list<set<int> >& reductions = workload.reductions[i];
+    for (list<set<int> >::const_iterator S = reductions.begin();
+         S != reductions.end(); ++S)
+      masks[i].push_back(typename SmallPQTree<N>::LeafSet(*S));
+  }
+
+  clock_t start = clock();
+  for (int i = 0; i < TREES; ++i) {
+    SmallPQTree<N> tree(workload.leaf_count);
+    for (int j = 0; j < masks[i].size(); ++j)
+      if (!tree.Reduce(masks[i][j]))
+        printf("SmallPQTree reduction failed\n");
+  }
+  return Seconds(start);
+}
+
+template <int N>
+void BenchmarkSmallUniverse() {
+  printf("%d leaves:\n", N);
+  Workload workload = MakeWorkload(N);
+  double baseline = BenchmarkPQTree(workload);
+  Report("PQTree", baseline, 0);
+  char name[32];
+  sprintf(name, "SmallPQTree<%d>", N);
+  Report(name, BenchmarkSmallPQTree<N>(workload), baseline);
+}
+
+void ReportCacheMisses(long long misses, int reductions) {
+  if (misses < 0)
+    printf("  %-18s cache misses/reduction: n/a\n", "");
+  else
+    printf("  %-18s cache misses/reduction: %.1f\n", "",
+           double(misses) / reductions);
+}
+
+// Compares the pointer based PQTree with the struct-of-arrays CompactPQTree on
+// one large tree.
+void BenchmarkStorageEngines() {
+  printf("%d leaves, %d reductions:\n", LARGE_TREE_SIZE, LARGE_REDUCTIONS);
+  vector<int> frontier;
+  for (int i = 0; i < LARGE_TREE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  vector<vector<int> > reductions;
+  for (int i = 0; i < LARGE_REDUCTIONS; ++i) {
+    int start = rand() % (LARGE_TREE_SIZE - 2);
+    int size = min(rand() % (LARGE_REDUCTION_SIZE - 1) + 2,
+                   LARGE_TREE_SIZE - start);
+    reductions.push_back(vector<int>(frontier.begin() + start,
+                                     frontier.begin() + start + size));
+  }
+  vector<set<int> > reduction_sets;
+  for (int i = 0; i < reductions.size(); ++i)
+    reduction_sets.push_back(set<int>(reductions[i].begin(),
+                                      reductions[i].end()));
+  set<int> leaves(frontier.begin(), frontier.end());
+  CacheMissCounter counter;
+
+  PQTree tree(leaves);
+  clock_t start = clock();
+  counter.Start();
+  for (int i = 0; i < reduction_sets.size(); ++i)
+    if (!tree.Reduce(reduction_sets[i]))
+      printf("PQTree reduction failed\n");
+  long long misses = counter.Stop();
+  double seconds = Seconds(start);
+  printf("  %-18s %12.0f reductions/s  %zu bytes per leaf, %zu per P-node, "
+         "%zu per Q-node\n", "PQTree", LARGE_REDUCTIONS / seconds,
+         sizeof(PQLeaf), sizeof(PNode), sizeof(QNode));
+  ReportCacheMisses(misses, LARGE_REDUCTIONS);
+
+  CompactPQTree compact_tree(LARGE_TREE_SIZE);
+  start = clock();
+  counter.Start();
+  for (int i = 0; i < reductions.size(); ++i)
+    if (!compact_tree.Reduce(reductions[i]))
+      printf("CompactPQTree reduction failed\n");
+  misses = counter.Stop();
+  double compact_seconds = Seconds(start);
+  printf("  %-18s %12.0f reductions/s  %6.1fx  %.1f bytes per leaf\n",
+         "CompactPQTree", LARGE_REDUCTIONS / compact_seconds,
+         seconds / compact_seconds,
+         double(compact_tree.MemoryUsage()) / LARGE_TREE_SIZE);
+  ReportCacheMisses(misses, LARGE_REDUCTIONS);
+}
+
+// Compares building a large tree from a set with the bulk constructors.
+void BenchmarkConstruction() {
+  printf("Constructing %d leaves:\n", UNIVERSE_SIZE);
+  vector<int> leaves;
+  for (int i = 0; i < UNIVERSE_SIZE; ++i)
+    leaves.push_back(i);
+  set<int> leaf_set(leaves.begin(), leaves.end());
+
+  clock_t start = clock();
+  {
+    PQTree tree(leaf_set);
+  }
+  double baseline = Seconds(start);
+  printf("  %-18s %12.3f s\n", "PQTree(set)", baseline);
+
+  start = clock();
+  {
+    PQTree tree(&leaves[0], leaves.size());
+  }
+  double seconds = Seconds(start);
+  printf("  %-18s %12.3f s  %6.1fx\n", "PQTree(int*, n)", seconds,
+         baseline / seconds);
+
+  start = clock();
+  {
+    PQTree tree(UNIVERSE_SIZE);
+  }
+  seconds = Seconds(start);
+  printf("  %-18s %12.3f s  %6.1fx\n", "PQTree(n)", seconds,
+         baseline / seconds);
+}
+
+// Compares the copy constructor with Clone() on a large reduced tree.
+void BenchmarkCopies() {
+  printf("Copying %d leaves:\n", UNIVERSE_SIZE);
+  vector<int> frontier;
+  for (int i = 0; i < UNIVERSE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  PQTree tree(UNIVERSE_SIZE);
+  tree.SetRecordReductions(false);
+  for (int i = 0; i < COPY_REDUCTIONS; ++i) {
+    int start = rand() % (UNIVERSE_SIZE - 2);
+    int size = min(rand() % (LARGE_REDUCTION_SIZE - 1) + 2,
+                   UNIVERSE_SIZE - start);
+    if (!tree.Reduce(set<int>(frontier.begin() + start,
+                              frontier.begin() + start + size)))
+      printf("PQTree reduction failed\n");
+  }
+
+  clock_t start = clock();
+  for (int i = 0; i < COPIES; ++i)
+    PQTree copy(tree);
+  double baseline = Seconds(start) / COPIES;
+  printf("  %-18s %12.3f s/copy\n", "copy constructor", baseline);
+
+  start = clock();
+  for (int i = 0; i < COPIES; ++i)
+    delete tree.Clone();
+  double seconds = Seconds(start) / COPIES;
+  printf("  %-18s %12.3f s/copy  %6.1fx\n", "Clone()", seconds,
+         baseline / seconds);
+}
+
+// Times TRAVERSALS depth-first walks of |tree| from Root() through
+// PQNode::Children() and returns the seconds per walk.  Frontier() is not
+// timed, as it only rewalks what reductions changed since it last ran.
+double TimeTraversals(PQTree* tree) {
+  clock_t start = clock();
+  size_t leaves = 0;
+  vector<PQNode*> stack;
+  vector<PQNode*> children;
+  for (int i = 0; i < TRAVERSALS; ++i) {
+    stack.push_back(tree->Root());
+    while (!stack.empty()) {
+      PQNode* node = stack.back();
+      stack.pop_back();
+      if (node->Type() == PQNode::leaf) {
+        ++leaves;
+        continue;
+      }
+      children.clear();
+      node->Children(&children);
+      stack.insert(stack.end(), children.rbegin(), children.rend());
+    }
+  }
+  if (leaves != size_t(TRAVERSALS) * TRAVERSAL_TREE_SIZE)
+    printf("PQTree walk is missing leaves\n");
+  return Seconds(start) / TRAVERSALS;
+}
+
+// Compares walking a large tree scattered by many reductions before and after
+// PQTree::Compact().
+void BenchmarkTraversal() {
+  printf("Traversing %d leaves after %d reductions:\n", TRAVERSAL_TREE_SIZE,
+         TRAVERSAL_REDUCTIONS);
+  vector<int> frontier;
+  for (int i = 0; i < TRAVERSAL_TREE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  PQTree tree(TRAVERSAL_TREE_SIZE);
+  tree.SetRecordReductions(false);
+  for (int i = 0; i < TRAVERSAL_REDUCTIONS; ++i) {
+    int start = rand() % (TRAVERSAL_TREE_SIZE - 2);
+    int size = min(rand() % (LARGE_REDUCTION_SIZE - 1) + 2,
+                   TRAVERSAL_TREE_SIZE - start);
+    if (!tree.Reduce(set<int>(frontier.begin() + start,
+                              frontier.begin() + start + size)))
+      printf("PQTree reduction failed\n");
+  }
+
+  double fragmentation = tree.Fragmentation();
+  double baseline = TimeTraversals(&tree);
+  printf("  %-18s %12.4f s/walk      fragmentation %.2f\n", "scattered",
+         baseline, fragmentation);
+
+  clock_t start = clock();
+  tree.Compact();
+  double compact_seconds = Seconds(start);
+  fragmentation = tree.Fragmentation();
+  double seconds = TimeTraversals(&tree);
+  printf("  %-18s %12.4f s/walk      fragmentation %.2f  %6.1fx  "
+         "(Compact() %.3f s)\n", "compacted", seconds, fragmentation,
+         baseline / seconds, compact_seconds);
+}
+
+// Compares ReduceAllSkipping() with SafeReduce() one set at a time on a large
+// tree, where NOISY_PERCENT of the reductions have had a leaf swapped for a
+// random one, which almost always makes them fail, and with Reduce() on the
+// reductions which were not spoilt alone.
+void BenchmarkSkipping() {
+  printf("%d leaves, %d reductions, %d%% noisy:\n", LARGE_TREE_SIZE,
+         LARGE_REDUCTIONS, NOISY_PERCENT);
+  vector<int> frontier;
+  for (int i = 0; i < LARGE_TREE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  list<set<int> > reductions;
+  list<set<int> > clean_reductions;
+  for (int i = 0; i < LARGE_REDUCTIONS; ++i) {
+    int start = rand() % (LARGE_TREE_SIZE - 2);
+    int size = min(rand() % (LARGE_REDUCTION_SIZE - 1) + 2,
+                   LARGE_TREE_SIZE - start);
+    set<int> reduction(frontier.begin() + start,
+                       frontier.begin() + start + size);
+    if (rand() % 100 < NOISY_PERCENT) {
+      reduction.erase(frontier[start + rand() % size]);
+      reduction.insert(rand() % LARGE_TREE_SIZE);
+    } else {
+      clean_reductions.push_back(reduction);
+    }
+    reductions.push_back(reduction);
+  }
+
+  PQTree clean_tree(LARGE_TREE_SIZE);
+  clean_tree.SetRecordReductions(false);
+  clock_t start = clock();
+  if (!clean_tree.ReduceAll(clean_reductions))
+    printf("PQTree reduction failed\n");
+  double baseline = Seconds(start) / clean_reductions.size();
+  printf("  %-18s %12.0f reductions/s\n", "Reduce() clean", 1 / baseline);
+
+  PQTree tree(LARGE_TREE_SIZE);
+  tree.SetRecordReductions(false);
+  start = clock();
+  vector<bool> kept = tree.ReduceAllSkipping(reductions);
+  double seconds = Seconds(start) / reductions.size();
+  printf("  %-18s %12.0f reductions/s  %6.1fx  %zu of %zu kept\n",
+         "ReduceAllSkipping", 1 / seconds, baseline / seconds,
+         size_t(count(kept.begin(), kept.end(), true)), kept.size());
+
+  PQTree safe_tree(LARGE_TREE_SIZE);
+  safe_tree.SetRecordReductions(false);
+  start = clock();
+  for (list<set<int> >::iterator S = reductions.begin();
+       S != reductions.end(); ++S)
+    safe_tree.SafeReduce(*S);
+  seconds = Seconds(start) / reductions.size();
+  printf("  %-18s %12.0f reductions/s  %6.1fx\n", "SafeReduce()",
+         1 / seconds, baseline / seconds);
+}
+
+// Appends to |reductions| the runs of |frontier| from |begin| up to |end|
+// of a random hierarchy of runs, each split into 2 to 5 smaller ones.
+void AddNestedRuns(const vector<int>& frontier, int begin, int end,
+                   vector<set<int> >* reductions) {
+  if (end - begin < 2)
+    return;
+  reductions->push_back(set<int>(frontier.begin() + begin,
+                                 frontier.begin() + end));
+  int parts = min(rand() % 4 + 2, end - begin);
+  vector<int> cuts;
+  for (int i = 1; i < parts; ++i)
+    cuts.push_back(begin + 1 + rand() % (end - begin - 1));
+  cuts.push_back(begin);
+  cuts.push_back(end);
+  sort(cuts.begin(), cuts.end());
+  cuts.erase(unique(cuts.begin(), cuts.end()), cuts.end());
+  if (cuts.size() == 2)
+    return;
+  for (int i = 0; i + 1 < cuts.size(); ++i)
+    AddNestedRuns(frontier, cuts[i], cuts[i + 1], reductions);
+}
+
+// Compares reducing a large tree by a laminar family of sets, in which every
+// two sets are nested or disjoint, one set at a time with ReduceAll(), which
+// builds their hierarchy directly.
+void BenchmarkLaminar() {
+  vector<int> frontier;
+  for (int i = 0; i < LARGE_TREE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  vector<set<int> > nested;
+  AddNestedRuns(frontier, 0, LARGE_TREE_SIZE, &nested);
+  random_shuffle(nested.begin(), nested.end());
+  list<set<int> > reductions(nested.begin(), nested.end());
+  printf("%d leaves, %zu nested reductions:\n", LARGE_TREE_SIZE,
+         reductions.size());
+
+  PQTree tree(LARGE_TREE_SIZE);
+  clock_t start = clock();
+  for (list<set<int> >::iterator S = reductions.begin();
+       S != reductions.end(); ++S)
+    if (!tree.Reduce(*S))
+      printf("PQTree reduction failed\n");
+  double baseline = Seconds(start) / reductions.size();
+  printf("  %-18s %12.0f reductions/s\n", "Reduce()", 1 / baseline);
+
+  PQTree laminar_tree(LARGE_TREE_SIZE);
+  start = clock();
+  if (!laminar_tree.ReduceAll(reductions))
+    printf("PQTree reduction failed\n");
+  double seconds = Seconds(start) / reductions.size();
+  printf("  %-18s %12.0f reductions/s  %6.1fx\n", "ReduceAll()",
+         1 / seconds, baseline / seconds);
+}
+
+// Compares ReduceAll() with ReduceAllPreprocessed() on a large tree whose
+// leaves come in groups of TWINS in exactly the same sets, by reductions
+// half of which repeat an earlier one.
+void BenchmarkPreprocessing() {
+  printf("%d leaves in groups of %d, %d reductions, half repeated:\n",
+         LARGE_TREE_SIZE, TWINS, LARGE_REDUCTIONS);
+  vector<int> frontier;
+  for (int i = 0; i < LARGE_TREE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  vector<set<int> > distinct;
+  list<set<int> > reductions;
+  for (int i = 0; i < LARGE_REDUCTIONS; ++i) {
+    if (i % 2 && !distinct.empty()) {
+      reductions.push_back(distinct[rand() % distinct.size()]);
+      continue;
+    }
+    int groups = LARGE_TREE_SIZE / TWINS;
+    int start = rand() % (groups - 1);
+    int size = min(rand() % (LARGE_REDUCTION_SIZE / TWINS) + 2,
+                   groups - start);
+    distinct.push_back(set<int>(frontier.begin() + start * TWINS,
+                                frontier.begin() + (start + size) * TWINS));
+    reductions.push_back(distinct.back());
+  }
+
+  PQTree tree(LARGE_TREE_SIZE);
+  clock_t start = clock();
+  if (!tree.ReduceAll(reductions))
+    printf("PQTree reduction failed\n");
+  double baseline = Seconds(start);
+  printf("  %-18s %12.3f s\n", "ReduceAll()", baseline);
+
+  PQTree preprocessed_tree(LARGE_TREE_SIZE);
+  start = clock();
+  if (!preprocessed_tree.ReduceAllPreprocessed(reductions))
+    printf("PQTree reduction failed\n");
+  double seconds = Seconds(start);
+  printf("  %-18s %12.3f s  %6.1fx\n", "Preprocessed", seconds,
+         baseline / seconds);
+}
+
+// Turns |genome| into the next in a line of descent by reversing random runs
+// of it, the commonest rearrangement between related genomes.
+void Rearrange(vector<int>* genome) {
+  for (int i = 0; i < INVERSIONS; ++i) {
+    int size = min(rand() % INVERSION_SIZE + 2, int(genome->size()));
+    int start = rand() % (genome->size() - size + 1);
+    reverse(genome->begin() + start, genome->begin() + start + size);
+  }
+}
+
+// Returns the seconds CommonIntervals takes over GENOMES permutations of
+// |size| values in a line of descent, streamed one at a time, and with
+// |verbose| reports its parts.
+double TimeCommonIntervals(int size, bool verbose) {
+  vector<int> genome;
+  for (int i = 0; i < size; ++i)
+    genome.push_back(i);
+  random_shuffle(genome.begin(), genome.end());
+  CommonIntervals intervals;
+  double adding = 0;
+  for (int k = 0; k < GENOMES; ++k) {
+    if (k > 0)
+      Rearrange(&genome);
+    clock_t start = clock();
+    if (!intervals.AddPermutation(genome))
+      printf("CommonIntervals rejected a permutation\n");
+    adding += Seconds(start);
+  }
+  clock_t start = clock();
+  vector<pair<int, int> > irreducible;
+  intervals.Irreducible(&irreducible);
+  double decomposing = Seconds(start);
+  start = clock();
+  PQTree* tree = intervals.Tree();
+  double building = Seconds(start);
+  if (verbose) {
+    printf("  %-18s %12.3f s  %8.2f us/value/permutation\n",
+           "AddPermutation()", adding, 1e6 * adding / GENOMES / size);
+    printf("  %-18s %12.3f s  %8zu intervals\n", "Irreducible()",
+           decomposing, irreducible.size());
+    printf("  %-18s %12.3f s\n", "Tree()", building);
+  }
+  delete tree;
+  return adding + decomposing + building;
+}
+
+// Returns the seconds the quadratic algorithm takes over the same kind of
+// permutations as TimeCommonIntervals(): marking off, for each permutation,
+// every run of the first one which is not consecutive in it.
+double TimeQuadraticCommonIntervals(int size) {
+  vector<int> genome;
+  for (int i = 0; i < size; ++i)
+    genome.push_back(i);
+  random_shuffle(genome.begin(), genome.end());
+  vector<int> reference(genome);
+  vector<vector<bool> > common(size, vector<bool>(size, true));
+  vector<int> positions(size);
+  double seconds = 0;
+  for (int k = 1; k < GENOMES; ++k) {
+    Rearrange(&genome);
+    clock_t start = clock();
+    for (int i = 0; i < size; ++i)
+      positions[genome[i]] = i;
+    for (int x = 0; x < size; ++x) {
+      int low = positions[reference[x]], high = low;
+      for (int y = x + 1; y < size; ++y) {
+        low = min(low, positions[reference[y]]);
+        high = max(high, positions[reference[y]]);
+        if (high - low != y - x)
+          common[x][y] = false;
+      }
+    }
+    seconds += Seconds(start);
+  }
+  return seconds;
+}
+
+// Times CommonIntervals on GENOMES permutations of GENOME_SIZE values, and
+// compares it with the quadratic algorithm on QUADRATIC_SIZE values.
+void BenchmarkCommonIntervals() {
+  printf("%d permutations of %d values, %d inversions apart:\n", GENOMES,
+         GENOME_SIZE, INVERSIONS);
+  TimeCommonIntervals(GENOME_SIZE, true);
+  printf("%d permutations of %d values:\n", GENOMES, QUADRATIC_SIZE);
+  double baseline = TimeQuadraticCommonIntervals(QUADRATIC_SIZE);
+  printf("  %-18s %12.3f s\n", "quadratic", baseline);
+  double seconds = TimeCommonIntervals(QUADRATIC_SIZE, false);
+  printf("  %-18s %12.3f s  %6.1fx\n", "CommonIntervals", seconds,
+         baseline / seconds);
+}
+
+// Reduces one large tree twice by the same reductions, the first time to warm
+// up its node pool and scratch buffers, and counts the allocations made by the
+// second pass.  Returns false if there were any.
+bool CountAllocations() {
+  printf("%d leaves, %d reductions:\n", LARGE_TREE_SIZE, LARGE_REDUCTIONS);
+  vector<int> frontier;
+  for (int i = 0; i < LARGE_TREE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  vector<set<int> > reductions;
+  for (int i = 0; i < LARGE_REDUCTIONS; ++i) {
+    int start = rand() % (LARGE_TREE_SIZE - 2);
+    int size = min(rand() % (LARGE_REDUCTION_SIZE - 1) + 2,
+                   LARGE_TREE_SIZE - start);
+    reductions.push_back(set<int>(frontier.begin() + start,
+                                  frontier.begin() + start + size));
+  }
+
+  PQTree tree(set<int>(frontier.begin(), frontier.end()));
+  tree.SetRecordReductions(false);
+  long long before = allocation_count;
+  for (int i = 0; i < reductions.size(); ++i)
+    if (!tree.Reduce(reductions[i]))
+      printf("PQTree reduction failed\n");
+  printf("  %-18s %12.2f allocations/reduction\n", "warm-up",
+         double(allocation_count - before) / reductions.size());
+
+  before = allocation_count;
+  for (int i = 0; i < reductions.size(); ++i)
+    if (!tree.Reduce(reductions[i]))
+      printf("PQTree reduction failed\n");
+  long long allocations = allocation_count - before;
+  printf("  %-18s %12.2f allocations/reduction\n", "warm",
+         double(allocations) / reductions.size());
+  if (allocations != 0) {
+    printf("FAILED: a warm PQTree::Reduce allocated %lld times\n",
+           allocations);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--allocations") == 0)
+    return CountAllocations() ? 0 : 1;
+  if (argc > 1 && strcmp(argv[1], "--traversal") == 0) {
+    BenchmarkTraversal();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--skipping") == 0) {
+    BenchmarkSkipping();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--laminar") == 0) {
+    BenchmarkLaminar();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--preprocessing") == 0) {
+    BenchmarkPreprocessing();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--common-intervals") == 0) {
+    BenchmarkCommonIntervals();
+    return 0;
+  }
+  BenchmarkSmallUniverse<64>();
+  BenchmarkSmallUniverse<256>();
+  BenchmarkStorageEngines();
+  BenchmarkConstruction();
+  BenchmarkCopies();
+  BenchmarkTraversal();
+  BenchmarkSkipping();
+  BenchmarkLaminar();
+  BenchmarkPreprocessing();
+  BenchmarkCommonIntervals();
+  return 0;
+}
@@ -0,0 +1,371 @@
+// See commonintervals.h
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "commonintervals.h"
+
+#include <assert.h>
+#include <algorithm>
+
+namespace {
+
+// Returns the first index from |index| on that has not been passed over,
+// where |next| links each index passed over to a later one and every other
+// index to itself, halving the paths it follows.
+int FindActive(vector<int>* next, int index) {
+  vector<int>& links = *next;
+  while (links[index] != index) {
+    links[index] = links[links[index]];
+    index = links[index];
+  }
+  return index;
+}
+
+// Node kinds of the tree of strong intervals built by Decompose().
+enum { kLeaf, kPNode, kQNode };
+
+}  // namespace
+
+CommonIntervals::CommonIntervals()
+    : dense_positions_(true), position_base_(0), permutation_count_(0) {}
+
+bool CommonIntervals::AddPermutation(const vector<int>& permutation) {
+  int n = permutation.size();
+  if (permutation_count_ == 0) {
+    int min_value = 0, max_value = -1;
+    for (int i = 0; i < n; ++i) {
+      if (i == 0 || permutation[i] < min_value)
+        min_value = permutation[i];
+      if (i == 0 || permutation[i] > max_value)
+        max_value = permutation[i];
+    }
+    bool dense = double(max_value) - min_value < 2.0 * n;
+    vector<int> positions_by_value;
+    map<int, int> sparse_positions;
+    if (dense)
+      positions_by_value.resize(max_value - min_value + 1, -1);
+    for (int i = 0; i < n; ++i) {
+      if (dense) {
+        int& position = positions_by_value[permutation[i] - min_value];
+        if (position >= 0)
+          return false;
+        position = i;
+      } else if (!sparse_positions.insert(
+                     make_pair(permutation[i], i)).second) {
+        return false;
+      }
+    }
+    reference_ = permutation;
+    dense_positions_ = dense;
+    position_base_ = min_value;
+    positions_by_value_.swap(positions_by_value);
+    sparse_positions_.swap(sparse_positions);
+    // One permutation has every run as a common interval.
+    left_.assign(n, 0);
+    right_.assign(n, n - 1);
+    permutation_count_ = 1;
+    return true;
+  }
+
+  if (n != reference_.size())
+    return false;
+  positions_.assign(n, -1);
+  for (int i = 0; i < n; ++i) {
+    int x = ReferencePosition(permutation[i]);
+    if (x < 0 || positions_[x] >= 0)
+      return false;
+    positions_[x] = i;
+  }
+
+  // The run x .. y is consecutive in the permutation when no value before x
+  // in the reference lies between its values in the permutation, which
+  // bounds y for each x, and likewise no value after y, which bounds x for
+  // each y and is the first bound for the reference read backwards.
+  RightBounds(positions_, &bounds_);
+  for (int x = 0; x < n; ++x)
+    right_[x] = min(right_[x], bounds_[x]);
+  reversed_.assign(positions_.rbegin(), positions_.rend());
+  RightBounds(reversed_, &bounds_);
+  for (int y = 0; y < n; ++y)
+    left_[y] = max(left_[y], n - 1 - bounds_[n - 1 - y]);
+  ++permutation_count_;
+  return true;
+}
+
+void CommonIntervals::RightBounds(const vector<int>& positions,
+                                  vector<int>* bounds) {
+  int n = positions.size();
+  bounds->assign(n, n - 1);
+  order_.resize(n);
+  for (int x = 0; x < n; ++x)
+    order_[positions[x]] = x;
+
+  // Unlink the values from a list of all of them in order from the last
+  // position back, so that when the value at x goes its neighbours in the
+  // list are the nearest values on either side of it at positions before x,
+  // or -1 and n if there are none.  Those stay as its neighbours after.
+  below_.resize(n);
+  above_.resize(n);
+  for (int v = 0; v < n; ++v) {
+    below_[v] = v - 1;
+    above_[v] = v + 1;
+  }
+  for (int x = n - 1; x >= 0; --x) {
+    int v = positions[x];
+    if (below_[v] >= 0)
+      above_[below_[v]] = above_[v];
+    if (above_[v] < n)
+      below_[above_[v]] = below_[v];
+  }
+
+  // The run from x must stop before the first value after x beyond those
+  // neighbours.  Find it for the lower neighbours by passing over positions
+  // from the one holding the largest value down, answering each x once every
+  // value from its lower neighbour up has been passed over, and then the
+  // same way for the upper neighbours from the smallest value up.
+  for (int pass = 0; pass < 2; ++pass) {
+    const vector<int>& neighbours = pass == 0 ? below_ : above_;
+    heads_.assign(n, -1);
+    links_.resize(n);
+    for (int x = 0; x < n; ++x) {
+      int neighbour = neighbours[positions[x]];
+      if (neighbour >= 0 && neighbour < n) {
+        links_[x] = heads_[neighbour];
+        heads_[neighbour] = x;
+      }
+    }
+    next_.resize(n + 1);
+    for (int z = 0; z <= n; ++z)
+      next_[z] = z;
+    for (int i = 0; i < n; ++i) {
+      int v = pass == 0 ? n - 1 - i : i;
+      next_[order_[v]] = order_[v] + 1;
+      for (int x = heads_[v]; x >= 0; x = links_[x]) {
+        int stop = FindActive(&next_, x + 1);
+        (*bounds)[x] = min((*bounds)[x], stop - 1);
+      }
+    }
+  }
+}
+
+int CommonIntervals::ReferencePosition(int value) const {
+  if (dense_positions_) {
+    // Unsigned, so values below the base wrap around and fail the test.
+    unsigned int offset = unsigned(value) - unsigned(position_base_);
+    return offset < positions_by_value_.size() ?
+        positions_by_value_[offset] : -1;
+  }
+  map<int, int>::const_iterator it = sparse_positions_.find(value);
+  return it == sparse_positions_.end() ? -1 : it->second;
+}
+
+int CommonIntervals::PermutationCount() const {
+  return permutation_count_;
+}
+
+const vector<int>& CommonIntervals::Reference() const {
+  return reference_;
+}
+
+bool CommonIntervals::IsCommon(int begin, int end) const {
+  if (begin < 0 || end <= begin || end > reference_.size())
+    return false;
+  return left_[end - 1] <= begin && end - 1 <= right_[begin];
+}
+
+void CommonIntervals::Irreducible(vector<pair<int, int> >* intervals) const {
+  vector<int> nodes;
+  Decompose(&nodes, intervals);
+}
+
+PQTree* CommonIntervals::Tree() const {
+  vector<int> nodes;
+  Decompose(&nodes, NULL);
+  return PQTree::FromNodes(reference_, nodes);
+}
+
+void CommonIntervals::Decompose(vector<int>* nodes,
+                                vector<pair<int, int> >* intervals) const {
+  nodes->clear();
+  if (intervals)
+    intervals->clear();
+  int n = reference_.size();
+  if (n == 0)
+    return;
+
+  // The first x with x .. y common for each y: the first from |left_|[y] on
+  // whose |right_| reaches y, found by passing over each x once y has gone
+  // past |right_|[x].
+  vector<int> first(n);
+  vector<int> heads(n, -1);
+  vector<int> links(n);
+  vector<int> next(n + 1);
+  for (int x = 0; x < n; ++x) {
+    links[x] = heads[right_[x]];
+    heads[right_[x]] = x;
+  }
+  for (int z = 0; z <= n; ++z)
+    next[z] = z;
+  for (int y = 0; y < n; ++y) {
+    if (y > 0) {
+      for (int x = heads[y - 1]; x >= 0; x = links[x])
+        next[x] = x + 1;
+    }
+    first[y] = FindActive(&next, left_[y]);
+  }
+
+  // Build the tree of strong intervals from the left, keeping the roots of
+  // the trees built so far on a stack (the construction of the substitution
+  // decomposition of a permutation, which only relies on the closure of the
+  // common intervals under the union and intersection of overlapping ones).
+  // Each new leaf is merged with the stack while it extends the last
+  // children of a Q-Node on top, forms a common interval with the top, or
+  // ends a common interval reaching further left, which then becomes a
+  // P-Node over everything popped.  Each node's last leaf is |lasts|, and a
+  // Q-Node's last child starts at |tails|.
+  vector<int> begins, lasts, kinds, parents, tails, child_counts;
+  vector<int> stack;
+  for (int y = 0; y < n; ++y) {
+    int current = begins.size();
+    begins.push_back(y);
+    lasts.push_back(y);
+    kinds.push_back(kLeaf);
+    parents.push_back(-1);
+    tails.push_back(y);
+    child_counts.push_back(0);
+    while (!stack.empty()) {
+      int top = stack.back();
+      int node;
+      if (kinds[top] == kQNode && IsCommon(tails[top], y + 1)) {
+        node = top;
+      } else if (IsCommon(begins[top], y + 1)) {
+        node = begins.size();
+        begins.push_back(begins[top]);
+        lasts.push_back(y);
+        kinds.push_back(kQNode);
+        parents.push_back(-1);
+        tails.push_back(y);
+        child_counts.push_back(1);
+        parents[top] = node;
+      } else if (first[y] < begins[current]) {
+        node = begins.size();
+        begins.push_back(-1);
+        kinds.push_back(kPNode);
+        parents.push_back(-1);
+        child_counts.push_back(0);
+        do {
+          top = stack.back();
+          stack.pop_back();
+          parents[top] = node;
+          ++child_counts[node];
+        } while (!IsCommon(begins[top], y + 1) && !stack.empty());
+        assert(IsCommon(begins[top], y + 1));
+        begins[node] = begins[top];
+        lasts.push_back(y);
+        tails.push_back(begins[current]);
+        parents[current] = node;
+        ++child_counts[node];
+        current = node;
+        continue;
+      } else {
+        break;
+      }
+      stack.pop_back();
+      lasts[node] = y;
+      tails[node] = begins[current];
+      parents[current] = node;
+      ++child_counts[node];
+      current = node;
+    }
+    stack.push_back(current);
+  }
+  assert(stack.size() == 1);
+  int root = stack.back();
+
+  // A Q-Node with two children admits both of their orders, so it is really
+  // a P-Node.
+  int count = begins.size();
+  for (int i = 0; i < count; ++i) {
+    if (kinds[i] == kQNode && child_counts[i] == 2)
+      kinds[i] = kPNode;
+  }
+
+  // List the children of each node in order: in |children| from
+  // |child_begins|, filled by going through the nodes by first leaf.
+  vector<int> by_begin(count);
+  vector<int> offsets(n + 1, 0);
+  for (int i = 0; i < count; ++i)
+    ++offsets[begins[i] + 1];
+  for (int i = 0; i < n; ++i)
+    offsets[i + 1] += offsets[i];
+  for (int i = 0; i < count; ++i)
+    by_begin[offsets[begins[i]]++] = i;
+  vector<int> child_begins(count + 1, 0);
+  for (int i = 0; i < count; ++i)
+    child_begins[i + 1] = child_begins[i] + child_counts[i];
+  vector<int> filled(child_begins.begin(), child_begins.end() - 1);
+  vector<int> children(child_begins[count]);
+  for (int i = 0; i < count; ++i) {
+    int node = by_begin[i];
+    if (parents[node] >= 0)
+      children[filled[parents[node]]++] = node;
+  }
+
+  // Write the internal nodes out depth-first, and the irreducible intervals
+  // with them: every P-Node, and every two neighbouring children of a
+  // Q-Node, whose chains of overlapping unions make up all the rest.
+  vector<pair<int, int> > irreducible;
+  stack.clear();
+  stack.push_back(root);
+  while (!stack.empty()) {
+    int node = stack.back();
+    stack.pop_back();
+    if (kinds[node] == kLeaf)
+      continue;
+    nodes->push_back(begins[node]);
+    nodes->push_back(lasts[node] + 1);
+    nodes->push_back(kinds[node] == kQNode);
+    if (kinds[node] == kPNode)
+      irreducible.push_back(make_pair(begins[node], lasts[node] + 1));
+    for (int i = child_begins[node + 1] - 1; i >= child_begins[node]; --i) {
+      stack.push_back(children[i]);
+      if (kinds[node] == kQNode && i > child_begins[node]) {
+        irreducible.push_back(make_pair(begins[children[i - 1]],
+                                        lasts[children[i]] + 1));
+      }
+    }
+  }
+  if (!intervals)
+    return;
+
+  // Sort them by end and then stably by begin, each by counting.
+  for (int pass = 0; pass < 2; ++pass) {
+    offsets.assign(n + 2, 0);
+    for (int i = 0; i < irreducible.size(); ++i) {
+      int key = pass == 0 ? irreducible[i].second : irreducible[i].first;
+      ++offsets[key + 1];
+    }
+    for (int i = 0; i <= n; ++i)
+      offsets[i + 1] += offsets[i];
+    intervals->resize(irreducible.size());
+    for (int i = 0; i < irreducible.size(); ++i) {
+      int key = pass == 0 ? irreducible[i].second : irreducible[i].first;
+      (*intervals)[offsets[key]++] = irreducible[i];
+    }
+    if (pass == 0)
+      irreducible.swap(*intervals);
+  }
+}
@@ -0,0 +1,138 @@
+// Computes the common intervals of K permutations, the sets of values found
+// consecutively in all of them, such as clusters of genes kept together in K
+// genomes.
+//
+// The permutations are streamed through AddPermutation() one at a time and
+// none of them is kept, only O(n) state for n values.  The first one is the
+// reference: every common interval is a run of it, and is reported as the
+// positions [begin, end) of that run.  The family of common intervals is
+// held as a generator (Bergeron, Chauve, de Montgolfier and Raffinot,
+// "Computing common intervals of K permutations, with applications to
+// modular decomposition of graphs"): two arrays such that the run [x, y] is
+// a common interval exactly when |left_|[y] <= x and y <= |right_|[x].  The
+// run is consecutive in another permutation exactly when no value outside
+// the run lies between the run's values in that permutation, which breaks
+// into a bound on y for each x and a bound on x for each y, so each
+// permutation is folded in by tightening both arrays with the bounds it
+// imposes, in a few linear passes.
+//
+// The irreducible common intervals, those which are not the union of a chain
+// of smaller overlapping ones, generate all the others, and there are fewer
+// than n of them.  They come from the tree of strong common intervals, those
+// which overlap no other, which is built from the generator with a single
+// stack pass over the reference: its nodes are the strong intervals, and
+// those whose every run of children is a common interval are Q-Nodes.  The
+// same tree as a PQTree admits as frontiers exactly the orders in which
+// every common interval is consecutive.
+//
+// Usage:
+//
+//   CommonIntervals intervals;
+//   while (ReadGenome(&genome))
+//     intervals.AddPermutation(genome);
+//   vector<pair<int, int> > irreducible;
+//   intervals.Irreducible(&irreducible);
+//   PQTree* tree = intervals.Tree();
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMMONINTERVALS_H
+#define COMMONINTERVALS_H
+
+#include <map>
+#include <utility>
+#include <vector>
+#include "pqtree.h"
+
+using namespace std;
+
+class CommonIntervals {
+ public:
+  CommonIntervals();
+
+  // Adds a permutation.  The first one must have distinct values and becomes
+  // the reference; every later one must be a permutation of the same values.
+  // Returns false, adding nothing, if it is not.  Takes time linear in the
+  // number of values, up to the inverse Ackermann factor of union-find, when
+  // they span at most twice as many integers as there are values, and an
+  // extra logarithmic factor for sparser values.
+  bool AddPermutation(const vector<int>& permutation);
+
+  // Returns the number of permutations added.
+  int PermutationCount() const;
+
+  // Returns the reference permutation, the first one added.
+  const vector<int>& Reference() const;
+
+  // Returns whether the run [|begin|, |end|) of the reference is a common
+  // interval, in constant time.
+  bool IsCommon(int begin, int end) const;
+
+  // Replaces the contents of |intervals| with the irreducible common
+  // intervals of at least two values as runs [begin, end) of the reference,
+  // ordered by begin and then by end.  Takes linear time.
+  void Irreducible(vector<pair<int, int> >* intervals) const;
+
+  // Returns a new PQTree, owned by the caller, over the values of the
+  // reference, whose frontiers are exactly the orders in which every common
+  // interval is consecutive.  Takes linear time.
+  PQTree* Tree() const;
+
+ private:
+  // Writes the tree of strong common intervals to |nodes| in the form
+  // PQTree::FromNodes() takes, and the irreducible common intervals to
+  // |intervals| unless it is NULL.
+  void Decompose(vector<int>* nodes, vector<pair<int, int> >* intervals) const;
+
+  // Sets |bounds|[x], for |positions| a permutation of 0 .. n - 1, to the
+  // last y such that no value of |positions| before x lies between two of
+  // its values at x .. y.  Those values are consecutive if and only if both
+  // y <= |bounds|[x] and the same holds of |positions| reversed.
+  void RightBounds(const vector<int>& positions, vector<int>* bounds);
+
+  // Returns the position of |value| in the reference, or -1 if it has none.
+  int ReferencePosition(int value) const;
+
+  // The reference, and the position in it of each value: dense offset by
+  // |position_base_| when the values span at most twice as many integers as
+  // there are values, like the leaf index of PQTree, and sparse otherwise.
+  vector<int> reference_;
+  bool dense_positions_;
+  int position_base_;
+  vector<int> positions_by_value_;
+  map<int, int> sparse_positions_;
+
+  // The generator: the run [x, y] is a common interval if and only if
+  // |left_|[y] <= x and y <= |right_|[x].
+  vector<int> left_;
+  vector<int> right_;
+  int permutation_count_;
+
+  // Scratch space reused for every permutation.  |positions_| holds the
+  // position in the permutation at hand of each value of the reference, by
+  // its position in the reference.
+  vector<int> positions_;
+  vector<int> reversed_;
+  vector<int> bounds_;
+  vector<int> order_;
+  vector<int> below_;
+  vector<int> above_;
+  vector<int> next_;
+  vector<int> heads_;
+  vector<int> links_;
+};
+
+#endif
@@ -0,0 +1,568 @@
+// See compactpqtree.h
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "compactpqtree.h"
+
+#include <assert.h>
+#include <cstdio>
+
+const CompactPQTree::Handle CompactPQTree::kNone;
+
+CompactPQTree::CompactPQTree(int leaf_count) {
+  leaf_count_ = leaf_count;
+  free_list_ = kNone;
+  invalid_ = false;
+  links_.resize(leaf_count);
+  flags_.resize(leaf_count, leaf);
+  root_ = NewNode(pnode);
+  links_[root_].parent = kNone;
+  for (Handle i = 0; i < leaf_count_; ++i) {
+    links_[i].pertinent_leaf_count = 0;
+    AppendChild(root_, i);
+  }
+  leaf_counts_[root_ - leaf_count_] = leaf_count;
+}
+
+CompactPQTree::NodeType CompactPQTree::Type(Handle node) const {
+  return NodeType(flags_[node] & kTypeMask);
+}
+
+CompactPQTree::NodeLabel CompactPQTree::Label(Handle node) const {
+  return NodeLabel((flags_[node] & kLabelMask) >> kLabelShift);
+}
+
+void CompactPQTree::SetLabel(Handle node, NodeLabel label) {
+  flags_[node] = (flags_[node] & ~kLabelMask) | (label << kLabelShift);
+}
+
+CompactPQTree::Handle& CompactPQTree::First(Handle node) {
+  return first_child_[node - leaf_count_];
+}
+
+CompactPQTree::Handle& CompactPQTree::Last(Handle node) {
+  return last_child_[node - leaf_count_];
+}
+
+CompactPQTree::Handle CompactPQTree::First(Handle node) const {
+  return first_child_[node - leaf_count_];
+}
+
+CompactPQTree::Handle CompactPQTree::Last(Handle node) const {
+  return last_child_[node - leaf_count_];
+}
+
+uint32_t CompactPQTree::LeafCountOf(Handle node) const {
+  return node < leaf_count_ ? 1 : leaf_counts_[node - leaf_count_];
+}
+
+CompactPQTree::Handle CompactPQTree::NewNode(NodeType type) {
+  Handle node = free_list_;
+  if (node != kNone) {
+    free_list_ = links_[node].next;
+  } else {
+    node = links_.size();
+    // Grow by an eighth rather than doubling, a tree rarely needs many more
+    // internal nodes than it already has.
+    if (links_.size() == links_.capacity()) {
+      size_t capacity = links_.size() + links_.size() / 8 + 16;
+      size_t internal_capacity = capacity - leaf_count_;
+      links_.reserve(capacity);
+      flags_.reserve(capacity);
+      first_child_.reserve(internal_capacity);
+      last_child_.reserve(internal_capacity);
+      leaf_counts_.reserve(internal_capacity);
+      pertinent_child_counts_.reserve(internal_capacity);
+    }
+    links_.push_back(Links());
+    flags_.push_back(0);
+    first_child_.push_back(kNone);
+    last_child_.push_back(kNone);
+    leaf_counts_.push_back(0);
+    pertinent_child_counts_.push_back(0);
+  }
+  Links& links = links_[node];
+  links.parent = links.prev = links.next = kNone;
+  links.pertinent_leaf_count = 0;
+  flags_[node] = type;
+  First(node) = Last(node) = kNone;
+  pertinent_child_counts_[node - leaf_count_] = 0;
+  return node;
+}
+
+void CompactPQTree::FreeNode(Handle node) {
+  assert(node >= leaf_count_);
+  links_[node].next = free_list_;
+  free_list_ = node;
+}
+
+CompactPQTree::Handle CompactPQTree::FindPertinentRoot(const int* leaves,
+                                                       int count) {
+  // First walk up from every leaf until reaching a node some other leaf has
+  // already walked through, counting the pertinent children of each node.
+  touched_.clear();
+  queue_.clear();
+  for (int i = 0; i < count; ++i) {
+    Handle node = leaves[i];
+    links_[node].pertinent_leaf_count = 1;
+    flags_[node] |= kTouched;
+    touched_.push_back(node);
+    queue_.push_back(node);
+    for (Handle parent = links_[node].parent; parent != kNone;
+         parent = links_[parent].parent) {
+      pertinent_child_counts_[parent - leaf_count_]++;
+      if (flags_[parent] & kTouched)
+        break;
+      flags_[parent] |= kTouched;
+      touched_.push_back(parent);
+    }
+  }
+
+  // Then sum the pertinent leaf counts bottom-up.  A node is queued once all
+  // of its pertinent children are done, and the first node holding the whole
+  // reduction set is the pertinent root.
+  for (size_t head = 0; head < queue_.size(); ++head) {
+    Handle node = queue_[head];
+    if (links_[node].pertinent_leaf_count == count)
+      return node;
+    Handle parent = links_[node].parent;
+    links_[parent].pertinent_leaf_count += links_[node].pertinent_leaf_count;
+    if (--pertinent_child_counts_[parent - leaf_count_] == 0)
+      queue_.push_back(parent);
+  }
+  assert(false);
+  return kNone;
+}
+
+void CompactPQTree::ClearPertinence() {
+  for (size_t i = 0; i < touched_.size(); ++i) {
+    Handle node = touched_[i];
+    links_[node].pertinent_leaf_count = 0;
+    flags_[node] &= ~kTouched;
+    if (node >= leaf_count_)
+      pertinent_child_counts_[node - leaf_count_] = 0;
+  }
+}
+
+CompactPQTree::NodeLabel CompactPQTree::UpdateLabel(Handle node) {
+  uint32_t pertinent = links_[node].pertinent_leaf_count;
+  NodeLabel label = partial;
+  if (pertinent == 0)
+    label = empty;
+  else if (pertinent == LeafCountOf(node))
+    label = full;
+  SetLabel(node, label);
+  return label;
+}
+
+void CompactPQTree::AppendChild(Handle parent, Handle child) {
+  Links& c = links_[child];
+  c.parent = parent;
+  c.prev = Last(parent);
+  c.next = kNone;
+  if (Last(parent) != kNone)
+    links_[Last(parent)].next = child;
+  else
+    First(parent) = child;
+  Last(parent) = child;
+}
+
+void CompactPQTree::PrependChild(Handle parent, Handle child) {
+  Links& c = links_[child];
+  c.parent = parent;
+  c.next = First(parent);
+  c.prev = kNone;
+  if (First(parent) != kNone)
+    links_[First(parent)].prev = child;
+  else
+    Last(parent) = child;
+  First(parent) = child;
+}
+
+void CompactPQTree::Unlink(Handle child) {
+  Links& c = links_[child];
+  if (c.prev != kNone)
+    links_[c.prev].next = c.next;
+  else
+    First(c.parent) = c.next;
+  if (c.next != kNone)
+    links_[c.next].prev = c.prev;
+  else
+    Last(c.parent) = c.prev;
+  c.parent = c.prev = c.next = kNone;
+}
+
+void CompactPQTree::ReplaceChild(Handle old_child, Handle new_child) {
+  Links& o = links_[old_child];
+  Links& n = links_[new_child];
+  n.parent = o.parent;
+  n.prev = o.prev;
+  n.next = o.next;
+  if (o.parent == kNone) {
+    root_ = new_child;
+  } else {
+    if (o.prev != kNone)
+      links_[o.prev].next = new_child;
+    else
+      First(o.parent) = new_child;
+    if (o.next != kNone)
+      links_[o.next].prev = new_child;
+    else
+      Last(o.parent) = new_child;
+  }
+  o.parent = o.prev = o.next = kNone;
+}
+
+void CompactPQTree::Reverse(Handle qnode) {
+  for (Handle c = First(qnode); c != kNone; c = links_[c].prev) {
+    Handle next = links_[c].next;
+    links_[c].next = links_[c].prev;
+    links_[c].prev = next;
+  }
+  Handle first = First(qnode);
+  First(qnode) = Last(qnode);
+  Last(qnode) = first;
+}
+
+void CompactPQTree::AppendToList(ChildList* list, Handle node) {
+  links_[node].next = kNone;
+  links_[node].prev = list->tail;
+  if (list->tail != kNone)
+    links_[list->tail].next = node;
+  else
+    list->head = node;
+  list->tail = node;
+  list->count++;
+}
+
+CompactPQTree::Handle CompactPQTree::Group(const ChildList& list) {
+  if (list.count == 0)
+    return kNone;
+  if (list.count == 1)
+    return list.head;
+  Handle group = NewNode(pnode);
+  First(group) = list.head;
+  Last(group) = list.tail;
+  uint32_t leaves = 0;
+  for (Handle c = list.head; c != kNone; c = links_[c].next) {
+    links_[c].parent = group;
+    leaves += LeafCountOf(c);
+  }
+  leaf_counts_[group - leaf_count_] = leaves;
+  return group;
+}
+
+void CompactPQTree::SpliceChildren(Handle from, bool reversed) {
+  if (reversed)
+    Reverse(from);
+  Handle parent = links_[from].parent;
+  Handle before = links_[from].prev;
+  Handle after = links_[from].next;
+  Handle head = First(from);
+  Handle tail = Last(from);
+  for (Handle c = head; c != kNone; c = links_[c].next)
+    links_[c].parent = parent;
+  links_[head].prev = before;
+  links_[tail].next = after;
+  if (before != kNone)
+    links_[before].next = head;
+  else
+    First(parent) = head;
+  if (after != kNone)
+    links_[after].prev = tail;
+  else
+    Last(parent) = tail;
+  FreeNode(from);
+}
+
+bool CompactPQTree::MatchesPartialPattern(Handle qnode, bool reversed) const {
+  // 0: reading empty children, 1: reading full children.
+  int state = 0;
+  for (Handle c = reversed ? Last(qnode) : First(qnode); c != kNone;
+       c = reversed ? links_[c].prev : links_[c].next) {
+    NodeLabel label = Label(c);
+    if (label == empty) {
+      if (state != 0)
+        return false;
+    } else if (label == partial) {
+      if (state != 0)
+        return false;
+      state = 1;
+    } else {
+      state = 1;
+    }
+  }
+  return true;
+}
+
+CompactPQTree::Handle CompactPQTree::MakePartial(Handle node) {
+  if (Type(node) == qnode) {
+    Handle partial_child = kNone;
+    for (Handle c = First(node); c != kNone; c = links_[c].next) {
+      if (UpdateLabel(c) == partial) {
+        if (partial_child != kNone)
+          return kNone;
+        partial_child = c;
+      }
+    }
+
+    // Templates Q1/Q2: the pertinent children must sit at one end.
+    if (!MatchesPartialPattern(node, false)) {
+      if (!MatchesPartialPattern(node, true))
+        return kNone;
+      Reverse(node);
+    }
+    if (partial_child != kNone) {
+      Handle merged = MakePartial(partial_child);
+      if (merged == kNone)
+        return kNone;
+      SpliceChildren(merged, false);
+    }
+    return node;
+  }
+
+  // Templates P3/P5: gather the empty children on one end of a Q-Node and the
+  // full children on the other, merging in the partial child if there is one.
+  ChildList empties = {kNone, kNone, 0};
+  ChildList fulls = {kNone, kNone, 0};
+  Handle partial_child = kNone;
+  for (Handle c = First(node); c != kNone;) {
+    Handle next = links_[c].next;
+    NodeLabel label = UpdateLabel(c);
+    if (label == empty) {
+      AppendToList(&empties, c);
+    } else if (label == full) {
+      AppendToList(&fulls, c);
+    } else {
+      if (partial_child != kNone)
+        return kNone;
+      partial_child = c;
+    }
+    c = next;
+  }
+  First(node) = Last(node) = partial_child;
+
+  Handle merged;
+  if (partial_child != kNone) {
+    links_[partial_child].prev = links_[partial_child].next = kNone;
+    merged = MakePartial(partial_child);
+    if (merged == kNone)
+      return kNone;
+  } else {
+    merged = NewNode(qnode);
+  }
+  First(node) = Last(node) = kNone;
+  ReplaceChild(node, merged);
+  leaf_counts_[merged - leaf_count_] = leaf_counts_[node - leaf_count_];
+
+  Handle empty_group;
+  if (empties.count > 1) {
+    // Reuse |node| as the P-Node holding the empty children.
+    empty_group = node;
+    First(node) = empties.head;
+    Last(node) = empties.tail;
+    uint32_t leaves = 0;
+    for (Handle c = empties.head; c != kNone; c = links_[c].next) {
+      links_[c].parent = node;
+      leaves += LeafCountOf(c);
+    }
+    leaf_counts_[node - leaf_count_] = leaves;
+  } else {
+    empty_group = empties.head;
+    FreeNode(node);
+  }
+  if (empty_group != kNone)
+    PrependChild(merged, empty_group);
+  Handle full_group = Group(fulls);
+  if (full_group != kNone)
+    AppendChild(merged, full_group);
+  return merged;
+}
+
+CompactPQTree::Handle CompactPQTree::ReduceRoot(Handle node) {
+  if (Type(node) == pnode) {
+    Handle partials[2];
+    int partial_count = 0;
+    ChildList fulls = {kNone, kNone, 0};
+    for (Handle c = First(node); c != kNone;) {
+      Handle next = links_[c].next;
+      NodeLabel label = UpdateLabel(c);
+      if (label == full) {
+        Unlink(c);
+        AppendToList(&fulls, c);
+      } else if (label == partial) {
+        if (partial_count == 2)
+          return kNone;
+        partials[partial_count++] = c;
+      }
+      c = next;
+    }
+    for (int i = 0; i < partial_count; ++i) {
+      partials[i] = MakePartial(partials[i]);
+      if (partials[i] == kNone)
+        return kNone;
+    }
+
+    // Template P2: the full children move into a P-Node of their own.
+    Handle full_group = Group(fulls);
+    if (partial_count == 0) {
+      if (full_group != kNone)
+        AppendChild(node, full_group);
+      return node;
+    }
+
+    // Templates P4/P6: the full children go between the full ends of the
+    // partial children, all merged into a single Q-Node.
+    Handle merged = partials[0];
+    if (full_group != kNone) {
+      AppendChild(merged, full_group);
+      leaf_counts_[merged - leaf_count_] += LeafCountOf(full_group);
+    }
+    if (partial_count == 2) {
+      Unlink(partials[1]);
+      for (Handle c = Last(partials[1]); c != kNone;) {
+        Handle prev = links_[c].prev;
+        AppendChild(merged, c);
+        c = prev;
+      }
+      leaf_counts_[merged - leaf_count_] += LeafCountOf(partials[1]);
+      FreeNode(partials[1]);
+    }
+    if (First(node) == Last(node)) {
+      Unlink(merged);
+      ReplaceChild(node, merged);
+      FreeNode(node);
+      return merged;
+    }
+    return node;
+  }
+
+  // Templates Q1/Q2/Q3: the pertinent children must be consecutive with any
+  // partial children on the ends of that run.
+  Handle begin = kNone, end = kNone;
+  for (Handle c = First(node); c != kNone; c = links_[c].next) {
+    if (UpdateLabel(c) != empty) {
+      if (begin == kNone)
+        begin = c;
+      end = c;
+    }
+  }
+  for (Handle c = links_[begin].next; c != end; c = links_[c].next)
+    if (Label(c) != full)
+      return kNone;
+  if (Label(begin) == partial) {
+    Handle merged = MakePartial(begin);
+    if (merged == kNone)
+      return kNone;
+    SpliceChildren(merged, false);
+  }
+  if (end != begin && Label(end) == partial) {
+    Handle merged = MakePartial(end);
+    if (merged == kNone)
+      return kNone;
+    SpliceChildren(merged, true);
+  }
+  return node;
+}
+
+bool CompactPQTree::Reduce(const int* leaves, int count) {
+  if (count < 2)
+    return true;
+  if (invalid_)
+    return false;
+  for (int i = 0; i < count; ++i) {
+    assert(leaves[i] >= 0 && leaves[i] < leaf_count_);
+    if (leaves[i] < 0 || leaves[i] >= leaf_count_)
+      return false;
+  }
+
+  Handle root = FindPertinentRoot(leaves, count);
+  // A full pertinent root only matches templates L1, P1 and Q1, which leave
+  // the tree untouched.
+  bool reduced = LeafCountOf(root) == count || ReduceRoot(root) != kNone;
+  ClearPertinence();
+  if (!reduced)
+    invalid_ = true;
+  return reduced;
+}
+
+bool CompactPQTree::Reduce(const vector<int>& S) {
+  return S.empty() || Reduce(&S[0], S.size());
+}
+
+bool CompactPQTree::Reduce(const set<int>& S) {
+  vector<int> leaves(S.begin(), S.end());
+  return Reduce(leaves);
+}
+
+bool CompactPQTree::ReduceAll(const list<set<int> >& L) {
+  for (list<set<int> >::const_iterator S = L.begin(); S != L.end(); ++S)
+    if (!Reduce(*S))
+      return false;
+  return true;
+}
+
+list<int> CompactPQTree::Frontier() const {
+  list<int> out;
+  FindFrontier(root_, &out);
+  return out;
+}
+
+void CompactPQTree::FindFrontier(Handle node, list<int>* out) const {
+  if (node < leaf_count_) {
+    out->push_back(node);
+    return;
+  }
+  for (Handle c = First(node); c != kNone; c = links_[c].next)
+    FindFrontier(c, out);
+}
+
+string CompactPQTree::Print() const {
+  string out;
+  Print(root_, &out);
+  return out;
+}
+
+void CompactPQTree::Print(Handle node, string* out) const {
+  if (node < leaf_count_) {
+    char value_str[12];
+    sprintf(value_str, "%d", node);
+    *out += value_str;
+    return;
+  }
+  *out += Type(node) == pnode ? "(" : "[";
+  for (Handle c = First(node); c != kNone; c = links_[c].next) {
+    Print(c, out);
+    if (links_[c].next != kNone)
+      *out += " ";
+  }
+  *out += Type(node) == pnode ? ")" : "]";
+}
+
+int CompactPQTree::LeafCount() const {
+  return leaf_count_;
+}
+
+size_t CompactPQTree::MemoryUsage() const {
+  return links_.capacity() * sizeof(Links) +
+         flags_.capacity() * sizeof(unsigned char) +
+         first_child_.capacity() * sizeof(Handle) +
+         last_child_.capacity() * sizeof(Handle) +
+         leaf_counts_.capacity() * sizeof(uint32_t) +
+         pertinent_child_counts_.capacity() * sizeof(uint32_t) +
+         touched_.capacity() * sizeof(Handle) +
+         queue_.capacity() * sizeof(Handle);
+}
@@ -0,0 +1,176 @@
+// PQ-Tree with struct-of-arrays node storage.
+//
+// CompactPQTree admits exactly the same orderings as a PQTree reduced by the
+// same sets, but instead of heap allocated PQNodes linked by pointers, every
+// node is a 32-bit handle into a handful of parallel arrays.  Leaves are the
+// handles 0 .. n-1, so a leaf's handle is its value and no leaf index is
+// needed at all.  Internal nodes are the handles from n upwards and only they
+// pay for the child pointers and leaf counts.
+//
+// The fields a reduction walks for every pertinent node (parent, siblings and
+// the pertinent leaf count) are packed together in one 16 byte record, so
+// bubbling up from the leaves touches a single cache line per node.  The
+// whole tree costs 17 bytes per leaf plus 33 bytes per internal node.
+//
+// Unlike PQNode, every child keeps a valid parent handle, so rather than
+// Booth & Lueker's blocked node bookkeeping the pertinent subtree is found by
+// walking up from the leaves, and the templates are then applied top-down
+// from the pertinent root in the same way as SmallPQTree.
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPACTPQTREE_H
+#define COMPACTPQTREE_H
+
+#include <stdint.h>
+#include <list>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class CompactPQTree {
+ public:
+  // Constructs a tree over the leaves 0 .. |leaf_count| - 1, all children of a
+  // single root P-Node.
+  explicit CompactPQTree(int leaf_count);
+
+  // Reduces the tree so that |leaves| are consecutive in every frontier.  The
+  // leaves must be distinct.  Like PQTree::Reduce, the tree becomes invalid
+  // if the reduction fails, making all further reductions fail.
+  bool Reduce(const int* leaves, int count);
+  bool Reduce(const vector<int>& S);
+  bool Reduce(const set<int>& S);
+  bool ReduceAll(const list<set<int> >& L);
+
+  // Returns 1 possible frontier, or ordering preserving the reductions.
+  list<int> Frontier() const;
+
+  // Prints the tree in the same format as PQTree::Print().
+  string Print() const;
+
+  // Returns the number of leaves in the tree.
+  int LeafCount() const;
+
+  // Returns the number of bytes of node storage held by the tree, including
+  // the reduction scratch buffers.
+  size_t MemoryUsage() const;
+
+ private:
+  typedef uint32_t Handle;
+  static const Handle kNone = 0xffffffff;
+
+  enum NodeType {leaf, pnode, qnode};
+  enum NodeLabel {empty, full, partial};
+
+  // Layout of |flags_|.
+  enum {
+    kTypeMask = 0x03,
+    kLabelShift = 2,
+    kLabelMask = 0x0c,
+    // Set on nodes whose scratch fields are in use by the current reduction.
+    kTouched = 0x10
+  };
+
+  // The fields visited for every pertinent node of a reduction.  Children of
+  // both P-Nodes and Q-Nodes form a doubly linked list through |prev| and
+  // |next|, in order for Q-Nodes and arbitrary for P-Nodes.
+  struct Links {
+    Handle parent;
+    Handle prev, next;
+    // Number of leaves of the reduction set below this node.
+    uint32_t pertinent_leaf_count;
+  };
+
+  // A list of detached sibling nodes, linked through |prev| and |next|.
+  struct ChildList {
+    Handle head, tail;
+    int count;
+  };
+
+  // Accessors for the parallel arrays.
+  NodeType Type(Handle node) const;
+  NodeLabel Label(Handle node) const;
+  void SetLabel(Handle node, NodeLabel label);
+  Handle& First(Handle node);
+  Handle& Last(Handle node);
+  Handle First(Handle node) const;
+  Handle Last(Handle node) const;
+  uint32_t LeafCountOf(Handle node) const;
+
+  // Internal node allocation, reusing freed handles first.
+  Handle NewNode(NodeType type);
+  void FreeNode(Handle node);
+
+  // Computes the pertinent leaf count of every node up to the pertinent root
+  // and returns that root.
+  Handle FindPertinentRoot(const int* leaves, int count);
+
+  // Clears the scratch fields set by FindPertinentRoot().
+  void ClearPertinence();
+
+  // Computes and stores the label of |node| for the current reduction.
+  NodeLabel UpdateLabel(Handle node);
+
+  // Child list manipulation, see SmallPQTree.
+  void AppendChild(Handle parent, Handle child);
+  void PrependChild(Handle parent, Handle child);
+  void Unlink(Handle child);
+  void ReplaceChild(Handle old_child, Handle new_child);
+  void Reverse(Handle qnode);
+  void AppendToList(ChildList* list, Handle node);
+  Handle Group(const ChildList& list);
+  void SpliceChildren(Handle from, bool reversed);
+  bool MatchesPartialPattern(Handle qnode, bool reversed) const;
+
+  // The templates.  MakePartial() restructures a partial non-root node into a
+  // Q-Node running from empty to full children, ReduceRoot() handles the
+  // pertinent root.  Both return kNone if no template matches.
+  Handle MakePartial(Handle node);
+  Handle ReduceRoot(Handle node);
+
+  void FindFrontier(Handle node, list<int>* out) const;
+  void Print(Handle node, string* out) const;
+
+  // Number of leaves, which is also the first internal node handle.
+  Handle leaf_count_;
+
+  // Per node arrays, indexed by handle.
+  vector<Links> links_;
+  vector<unsigned char> flags_;
+
+  // Per internal node arrays, indexed by handle - |leaf_count_|.
+  vector<Handle> first_child_;
+  vector<Handle> last_child_;
+  vector<uint32_t> leaf_counts_;
+  vector<uint32_t> pertinent_child_counts_;
+
+  // Head of the free internal node list, chained through Links::next.
+  Handle free_list_;
+
+  Handle root_;
+
+  // Scratch buffers reused by every reduction: the nodes whose scratch fields
+  // were set, and the bottom-up processing queue.
+  vector<Handle> touched_;
+  vector<Handle> queue_;
+
+  // true if a reduction has failed, tree is useless.
+  bool invalid_;
+};
+
+#endif
@@ -0,0 +1,243 @@
+// See frontierenumerator.h
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "frontierenumerator.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+// Orders digits so that the nodes with fewer leaves come first.
+struct ByLeafCount {
+  explicit ByLeafCount(const vector<int>& leaf_counts)
+      : leaf_counts_(leaf_counts) {}
+  bool operator()(int a, int b) const {
+    return leaf_counts_[a] < leaf_counts_[b];
+  }
+  const vector<int>& leaf_counts_;
+};
+
+}  // namespace
+
+FrontierEnumerator::FrontierEnumerator(PQTree* tree) {
+  changed_begin_ = changed_end_ = 0;
+  changed_by_reversal_ = false;
+
+  // Walk the tree depth-first in frontier order, reserving each internal
+  // node's block of |children_| when it is reached and filling in each slot
+  // as the child it holds is reached.
+  vector<pair<PQNode*, int> > stack;
+  vector<PQNode*> children;
+  vector<bool> is_qnode;
+  stack.push_back(make_pair(tree->Root(), -1));
+  while (!stack.empty()) {
+    PQNode* node = stack.back().first;
+    int slot = stack.back().second;
+    stack.pop_back();
+    int index = leaf_counts_.size();
+    if (slot >= 0)
+      children_[slot] = index;
+    leaf_counts_.push_back(node->LeafCount());
+    starts_.push_back(frontier_.size());
+    child_begins_.push_back(children_.size());
+    is_qnode.push_back(node->Type() == PQNode::qnode);
+    if (node->Type() == PQNode::leaf) {
+      child_counts_.push_back(0);
+      frontier_.push_back(node->LeafValue());
+      continue;
+    }
+    children.clear();
+    node->Children(&children);
+    child_counts_.push_back(children.size());
+    children_.resize(children_.size() + children.size(), -1);
+    for (int i = children.size() - 1; i >= 0; --i)
+      stack.push_back(make_pair(children[i], child_begins_[index] + i));
+
+    if (children.size() >= 2)
+      digit_nodes_.push_back(index);
+  }
+
+  stable_sort(digit_nodes_.begin(), digit_nodes_.end(),
+              ByLeafCount(leaf_counts_));
+  for (int i = 0; i < digit_nodes_.size(); ++i) {
+    int node = digit_nodes_[i];
+    int k = child_counts_[node];
+    digit_is_qnode_.push_back(is_qnode[node]);
+    plain_begins_.push_back(plain_counters_.size());
+    if (is_qnode[node]) {
+      radices_.push_back(2);
+      continue;
+    }
+    const uint64_t saturated = ~uint64_t(0);
+    uint64_t radix = 1;
+    for (int j = 2; j <= k; ++j)
+      radix = radix > saturated / j ? saturated : radix * j;
+    radices_.push_back(radix);
+    plain_counters_.resize(plain_counters_.size() + k, 0);
+    plain_directions_.resize(plain_directions_.size() + k, 1);
+  }
+  counters_.assign(digit_nodes_.size(), 0);
+  directions_.assign(digit_nodes_.size(), 1);
+  for (int i = 0; i <= digit_nodes_.size(); ++i)
+    focus_.push_back(i);
+}
+
+const vector<int>& FrontierEnumerator::Frontier() const {
+  return frontier_;
+}
+
+bool FrontierEnumerator::Done() const {
+  return focus_[0] == digit_nodes_.size();
+}
+
+int FrontierEnumerator::ChangedBegin() const {
+  return changed_begin_;
+}
+
+int FrontierEnumerator::ChangedEnd() const {
+  return changed_end_;
+}
+
+bool FrontierEnumerator::ChangedByReversal() const {
+  return changed_by_reversal_;
+}
+
+bool FrontierEnumerator::Next() {
+  if (Done()) {
+    changed_begin_ = changed_end_ = 0;
+    changed_by_reversal_ = false;
+    return false;
+  }
+  int j = focus_[0];
+  focus_[0] = 0;
+  if (directions_[j] > 0)
+    ++counters_[j];
+  else
+    --counters_[j];
+
+  if (digit_is_qnode_[j])
+    ReverseChildren(digit_nodes_[j]);
+  else
+    PlainChange(j);
+
+  // The digit has been through all of its values since the last digit above
+  // it changed.  A P-Node starts its next run of plain changes afresh from
+  // wherever its children are now, which visits every arrangement again just
+  // as well.
+  if (counters_[j] == 0 || counters_[j] == radices_[j] - 1) {
+    directions_[j] = -directions_[j];
+    focus_[j] = focus_[j + 1];
+    focus_[j + 1] = j + 1;
+    if (!digit_is_qnode_[j]) {
+      int k = child_counts_[digit_nodes_[j]];
+      fill(plain_counters_.begin() + plain_begins_[j],
+           plain_counters_.begin() + plain_begins_[j] + k, 0);
+      fill(plain_directions_.begin() + plain_begins_[j],
+           plain_directions_.begin() + plain_begins_[j] + k, 1);
+    }
+  }
+  return true;
+}
+
+void FrontierEnumerator::PlainChange(int digit) {
+  int node = digit_nodes_[digit];
+  // Knuth's c_j and o_j for j = 1 .. k are at |base| + j.
+  int base = plain_begins_[digit] - 1;
+  int j = child_counts_[node];
+  int s = 0;
+  while (true) {
+    int c = plain_counters_[base + j];
+    int q = c + plain_directions_[base + j];
+    if (q == j) {
+      assert(j > 1);
+      ++s;
+    }
+    if (q < 0 || q == j) {
+      plain_directions_[base + j] = -plain_directions_[base + j];
+      --j;
+      continue;
+    }
+    SwapChildren(node, min(j - c, j - q) + s - 1);
+    plain_counters_[base + j] = q;
+    return;
+  }
+}
+
+void FrontierEnumerator::SwapChildren(int node, int position) {
+  int slot = child_begins_[node] + position;
+  int a = children_[slot];
+  int b = children_[slot + 1];
+  int begin = starts_[a];
+  int middle = begin + leaf_counts_[a];
+  int end = middle + leaf_counts_[b];
+  rotate(frontier_.begin() + begin, frontier_.begin() + middle,
+         frontier_.begin() + end);
+  ShiftSubtree(a, leaf_counts_[b]);
+  ShiftSubtree(b, -leaf_counts_[a]);
+  swap(children_[slot], children_[slot + 1]);
+  changed_begin_ = begin;
+  changed_end_ = end;
+  changed_by_reversal_ = false;
+}
+
+void FrontierEnumerator::ReverseChildren(int node) {
+  int begin = starts_[node];
+  int end = begin + leaf_counts_[node];
+  int first = child_begins_[node];
+  int last = first + child_counts_[node];
+  // Reversing the whole span reverses each child's leaves as well, so each
+  // child's block is reversed back once the new layout is known.
+  reverse(frontier_.begin() + begin, frontier_.begin() + end);
+  reverse(children_.begin() + first, children_.begin() + last);
+  LayOutSubtree(node);
+  for (int i = first; i < last; ++i) {
+    int child = children_[i];
+    reverse(frontier_.begin() + starts_[child],
+            frontier_.begin() + starts_[child] + leaf_counts_[child]);
+  }
+  changed_begin_ = begin;
+  changed_end_ = end;
+  changed_by_reversal_ = true;
+}
+
+void FrontierEnumerator::ShiftSubtree(int node, int offset) {
+  stack_.push_back(node);
+  while (!stack_.empty()) {
+    int current = stack_.back();
+    stack_.pop_back();
+    starts_[current] += offset;
+    for (int i = 0; i < child_counts_[current]; ++i)
+      stack_.push_back(children_[child_begins_[current] + i]);
+  }
+}
+
+void FrontierEnumerator::LayOutSubtree(int node) {
+  stack_.push_back(node);
+  while (!stack_.empty()) {
+    int current = stack_.back();
+    stack_.pop_back();
+    int start = starts_[current];
+    for (int i = 0; i < child_counts_[current]; ++i) {
+      int child = children_[child_begins_[current] + i];
+      starts_[child] = start;
+      start += leaf_counts_[child];
+      stack_.push_back(child);
+    }
+  }
+}
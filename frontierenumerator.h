@@ -0,0 +1,127 @@
+// Enumerates every frontier a PQTree admits.
+//
+// A FrontierEnumerator takes a snapshot of the shape of a PQTree and then
+// steps through all of its frontiers, one per call to Next(), starting with
+// the tree's own Frontier().  Consecutive frontiers differ by a single small
+// change: either two neighbouring children of a P-Node trade places, or the
+// children of a Q-Node are reversed.  Every frontier is visited exactly once.
+//
+// The arrangement of each P-Node's children runs through the plain changes
+// (Steinhaus-Johnson-Trotter) sequence, each Q-Node is a single bit, and the
+// nodes are combined with a mixed-radix reflected Gray code (Knuth, TAOCP
+// 7.2.1.1, algorithm H) in which the nodes with the fewest leaves change
+// most often.  Next() rewrites only the leaves below the nodes it rearranges,
+// so a step costs amortised time proportional to the length of the part of
+// the frontier that changed, which is reported along with the whole frontier.
+//
+// Usage, visiting at most |budget| frontiers:
+//
+//   FrontierEnumerator enumerator(&tree);
+//   for (int i = 0; i < budget; ++i) {
+//     Score(enumerator.Frontier());
+//     if (!enumerator.Next())
+//       break;
+//   }
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FRONTIERENUMERATOR_H
+#define FRONTIERENUMERATOR_H
+
+#include <stdint.h>
+#include <vector>
+#include "pqtree.h"
+
+using namespace std;
+
+class FrontierEnumerator {
+ public:
+  // Snapshots |tree|, which must be valid.  Later changes to the tree do not
+  // affect the enumerator.
+  explicit FrontierEnumerator(PQTree* tree);
+
+  // Returns the current frontier, valid until the next call to Next().
+  const vector<int>& Frontier() const;
+
+  // Moves on to the next frontier.  Returns false, leaving the frontier
+  // unchanged, once every frontier has been visited.
+  bool Next();
+
+  // Returns whether every frontier has been visited.
+  bool Done() const;
+
+  // The last Next() rearranged only the positions ChangedBegin() up to but
+  // not including ChangedEnd() of the frontier.  Both are 0 before the first
+  // Next() and after the last.
+  int ChangedBegin() const;
+  int ChangedEnd() const;
+
+  // Returns whether the last Next() reversed a Q-Node rather than swapping
+  // two children of a P-Node.
+  bool ChangedByReversal() const;
+
+ private:
+  // Swaps the children at |position| and |position| + 1 of |node|.
+  void SwapChildren(int node, int position);
+
+  // Reverses the order of the children of |node|.
+  void ReverseChildren(int node);
+
+  // Moves the leaves of |node| and every node below it by |offset|.
+  void ShiftSubtree(int node, int offset);
+
+  // Lays out the starts of the nodes below |node| from its own start.
+  void LayOutSubtree(int node);
+
+  // Takes one step of the plain changes sequence of the P-Node of |digit|.
+  void PlainChange(int digit);
+
+  // The snapshot of the tree.  Node i has |leaf_counts_[i]| leaves starting
+  // at position |starts_[i]| of |frontier_|, and if it is internal its
+  // children in frontier order are |children_[child_begins_[i]]| onwards,
+  // |child_counts_[i]| of them.  Leaves have no children.
+  vector<int> frontier_;
+  vector<int> leaf_counts_;
+  vector<int> starts_;
+  vector<int> child_begins_;
+  vector<int> child_counts_;
+  vector<int> children_;
+  vector<int> stack_;
+
+  // One digit of the Gray code per internal node with at least two children.
+  // |radices_| is k! for a P-Node with k children, saturating at 2^64 - 1,
+  // and 2 for a Q-Node.  |counters_|, |directions_| and |focus_| are
+  // algorithm H's a, o and f.
+  vector<int> digit_nodes_;
+  vector<bool> digit_is_qnode_;
+  vector<uint64_t> radices_;
+  vector<uint64_t> counters_;
+  vector<int> directions_;
+  vector<int> focus_;
+
+  // The plain changes state (c and o of Knuth's algorithm P) of the P-Node
+  // of digit i is at |plain_begins_[i]| onwards in |plain_counters_| and
+  // |plain_directions_|.
+  vector<int> plain_begins_;
+  vector<int> plain_counters_;
+  vector<int> plain_directions_;
+
+  int changed_begin_;
+  int changed_end_;
+  bool changed_by_reversal_;
+};
+
+#endif
@@ -1,7 +1,8 @@
 // PQ-Tree fuzz test.  We basically repeatedly create a random sequence of
 // integers, choose random consecutive subseries out of the original series as
 // a reduction, then apply the reductions to a PQ Tree.  For now, we are just
-// looking to see that the library doesn't crash or return false.
+// looking to see that the library doesn't crash or return false, and that
+// SmallPQTree and CompactPQTree agree with PQTree after every reduction.
 
 // This file is part of the PQ Tree library.
 //
@@ -19,15 +20,679 @@
 // with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
 
 
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <iostream>
+#include <list>
+#include <map>
 #include <set>
+#include <string>
 #include <vector>
+#include "commonintervals.h"
+#include "compactpqtree.h"
+#include "frontierenumerator.h"
 #include "pqtree.h"
+#include "smallpqtree.h"
 
-int ITERATIONS = 10000;  // Number of fuzztest iterations to run.
-int REDUCTIONS = 20;     // Number of reductions to apply on each run
-int TREE_SIZE = 10;      // Size of the PQ-Tree in each fuzztest.
+int ITERATIONS = 10000;     // Number of fuzztest iterations to run.
+int REDUCTIONS = 20;        // Number of reductions to apply on each run
+int TREE_SIZE = 10;         // Size of the PQ-Tree in each fuzztest.
+int WIDE_TREE_SIZE = 100;   // Leaves when fuzzing a multi-word SmallPQTree.
+
+// Reads the subtree printed by PQTree::Print() starting at |*pos| and returns
+// it in a canonical form: P-Node children are sorted and Q-Nodes are read in
+// whichever direction compares smaller.  Two trees admit the same frontiers
+// exactly when their canonical forms are equal.
+string CanonicalForm(const string& printed, size_t* pos) {
+  if (printed[*pos] != '(' && printed[*pos] != '[') {
+    size_t end = printed.find_first_of(" )]", *pos);
+    string leaf = printed.substr(*pos, end - *pos);
+    *pos = end;
+    return leaf;
+  }
+  char open = printed[(*pos)++];
+  vector<string> children;
+  while (printed[*pos] != ')' && printed[*pos] != ']') {
+    if (printed[*pos] == ' ')
+      ++(*pos);
+    children.push_back(CanonicalForm(printed, pos));
+  }
+  ++(*pos);
+
+  if (open == '(') {
+    sort(children.begin(), children.end());
+  } else {
+    vector<string> reversed(children.rbegin(), children.rend());
+    if (reversed < children)
+      children = reversed;
+  }
+  string out(1, open);
+  for (int i = 0; i < children.size(); ++i) {
+    if (i)
+      out += " ";
+    out += children[i];
+  }
+  out += open == '(' ? ")" : "]";
+  return out;
+}
+
+string CanonicalForm(const string& printed) {
+  size_t pos = 0;
+  return CanonicalForm(printed, &pos);
+}
+
+// Returns the number of frontiers admitted by the subtree printed by
+// PQTree::Print() starting at |*pos|.
+long long PrintedFrontierCount(const string& printed, size_t* pos) {
+  if (printed[*pos] != '(' && printed[*pos] != '[') {
+    *pos = printed.find_first_of(" )]", *pos);
+    return 1;
+  }
+  char open = printed[(*pos)++];
+  long long count = 1;
+  int children = 0;
+  while (printed[*pos] != ')' && printed[*pos] != ']') {
+    if (printed[*pos] == ' ')
+      ++(*pos);
+    count *= PrintedFrontierCount(printed, pos);
+    count *= open == '(' ? ++children : 1;
+  }
+  ++(*pos);
+  return open == '(' ? count : 2 * count;
+}
+
+// Returns the leaves of a tree printed by PQTree::Print() in the order they
+// are printed, which is the order of PQTree::Frontier().
+list<int> PrintedFrontier(const string& printed) {
+  list<int> out;
+  size_t pos = printed.find_first_not_of(" ()[]");
+  while (pos != string::npos) {
+    out.push_back(atoi(printed.c_str() + pos));
+    pos = printed.find_first_of(" )]", pos);
+    pos = printed.find_first_not_of(" ()[]", pos);
+  }
+  return out;
+}
+
+// Returns whether the leaves of every set in |reductions| are consecutive in
+// |frontier|.
+bool Admits(const vector<int>& frontier, const list<set<int> >& reductions) {
+  vector<int> position(TREE_SIZE + 1);
+  for (int i = 0; i < frontier.size(); ++i)
+    position[frontier[i]] = i;
+  for (list<set<int> >::const_iterator i = reductions.begin();
+       i != reductions.end(); ++i) {
+    int first = frontier.size();
+    int last = -1;
+    for (set<int>::const_iterator j = i->begin(); j != i->end(); ++j) {
+      first = min(first, position[*j]);
+      last = max(last, position[*j]);
+    }
+    if (!i->empty() && last - first + 1 != i->size())
+      return false;
+  }
+  return true;
+}
+
+// A generator for PQTree::SampleFrontier().
+int Random(int k) {
+  return rand() % k;
+}
+
+// Enumerates every frontier of |tree|, checking that each is admitted by the
+// reductions, that none repeats, that each step only changes the positions
+// it reports and that there are as many as the tree counts.  Then checks
+// that random samples of the tree are among them.
+bool CheckEnumeration(PQTree* tree) {
+  list<set<int> > reductions = tree->GetReductions();
+  FrontierEnumerator enumerator(tree);
+  list<int> first = tree->Frontier();
+  if (enumerator.Frontier() != vector<int>(first.begin(), first.end()))
+    return false;
+  set<vector<int> > seen;
+  vector<int> previous;
+  do {
+    const vector<int>& frontier = enumerator.Frontier();
+    if (!Admits(frontier, reductions) || !tree->Admits(frontier) ||
+        !seen.insert(frontier).second)
+      return false;
+    if (!previous.empty()) {
+      for (int i = 0; i < frontier.size(); ++i) {
+        if (frontier[i] != previous[i] && (i < enumerator.ChangedBegin() ||
+                                           i >= enumerator.ChangedEnd()))
+          return false;
+      }
+    }
+    previous = frontier;
+  } while (enumerator.Next());
+  if (!enumerator.Done() ||
+      atoll(tree->CountFrontiers().c_str()) != seen.size())
+    return false;
+  vector<vector<int> > samples;
+  tree->SampleFrontiers(Random, 10, &samples);
+  tree->SampleFrontier(Random, &previous);
+  samples.push_back(previous);
+  for (int i = 0; i < samples.size(); ++i) {
+    if (!seen.count(samples[i]))
+      return false;
+  }
+  return true;
+}
+
+// Enumerates the frontiers of |tree| into |frontiers|, leaving out |removed|.
+void EnumerateFrontiers(PQTree* tree, int removed,
+                        set<vector<int> >* frontiers) {
+  FrontierEnumerator enumerator(tree);
+  do {
+    vector<int> frontier = enumerator.Frontier();
+    frontier.erase(remove(frontier.begin(), frontier.end(), removed),
+                   frontier.end());
+    frontiers->insert(frontier);
+  } while (enumerator.Next());
+}
+
+// Returns whether replaying the reductions recorded on |tree| on a fresh tree
+// over the same leaves gives back a tree equivalent to |tree|.
+bool HistoryRebuilds(PQTree* tree) {
+  list<int> leaves = tree->Frontier();
+  PQTree rebuilt(leaves.begin(), leaves.end());
+  return rebuilt.ReduceAll(tree->GetReductions()) &&
+         PQTree::Equivalent(*tree, rebuilt);
+}
+
+// Removes a random leaf from a copy of |tree|, which must then admit exactly
+// the frontiers of |tree| with that leaf left out and be rebuilt by its
+// recorded reductions, and adds a new leaf to another copy, which must then
+// match a tree built with the extra leaf from the start.  The first copy is
+// also cloned, compacted and given its leaf back.
+bool CheckLeafChanges(PQTree* tree) {
+  int removed = rand() % TREE_SIZE;
+  PQTree* copy = tree->Clone();
+  if (!copy->RemoveLeaf(removed) || copy->RemoveLeaf(removed) ||
+      !CheckEnumeration(copy) || !HistoryRebuilds(copy)) {
+    delete copy;
+    return false;
+  }
+  set<vector<int> > expected, actual;
+  EnumerateFrontiers(tree, removed, &expected);
+  EnumerateFrontiers(copy, -1, &actual);
+  PQTree* clone = copy->Clone();
+  bool same = clone->Print() == copy->Print();
+  clone->Compact();
+  same = same && clone->Print() == copy->Print() && clone->Frontier().size() &&
+         clone->AddLeaf(removed) && !clone->AddLeaf(removed) &&
+         clone->Frontier() == PrintedFrontier(clone->Print());
+  delete clone;
+  delete copy;
+  if (!same || expected != actual)
+    return false;
+
+  copy = tree->Clone();
+  vector<int> leaves;
+  for (int i = 0; i <= TREE_SIZE; ++i)
+    leaves.push_back(i);
+  // Reductions of every leaf leave no trace in the tree, so the new leaf is
+  // not held to them.
+  PQTree fresh(leaves.begin(), leaves.end());
+  list<set<int> > reductions = tree->GetReductions();
+  for (list<set<int> >::iterator i = reductions.begin();
+       i != reductions.end(); ++i) {
+    if (i->size() < TREE_SIZE)
+      fresh.Reduce(*i);
+  }
+  same = copy->AddLeaf(TREE_SIZE) &&
+         CanonicalForm(copy->Print()) == CanonicalForm(fresh.Print()) &&
+         copy->CanonicalHash() == fresh.CanonicalHash() &&
+         PQTree::Equivalent(*copy, fresh) && !PQTree::Equivalent(*tree, fresh) &&
+         copy->CountFrontiers() == fresh.CountFrontiers() &&
+         copy->Frontier() == PrintedFrontier(copy->Print());
+  delete copy;
+  return same;
+}
+
+// Checks SmallPQTree with a bitmask of more than one word against PQTree on
+// WIDE_TREE_SIZE leaves, reducing by random runs of a random frontier, then
+// forcing a window of the frontier into a Q-Node, and then by a set which
+// must fail as it skips a leaf of that window, by a random set and by a set
+// with a value which is not a leaf, some beyond the bitmask, on copies of
+// both trees.  A failed reduction must leave both copies invalid.
+bool CheckWideSmallPQTree() {
+  vector<int> frontier;
+  for (int i = 0; i < WIDE_TREE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  PQTree tree(WIDE_TREE_SIZE);
+  SmallPQTree<128> small_tree(WIDE_TREE_SIZE);
+  list<set<int> > reductions;
+  for (int i = 0; i < REDUCTIONS; ++i) {
+    int start = rand() % (WIDE_TREE_SIZE - 2);
+    int size = min(rand() % 70 + 2, WIDE_TREE_SIZE - start);
+    reductions.push_back(set<int>(frontier.begin() + start,
+                                  frontier.begin() + start + size));
+  }
+  int window = rand() % (WIDE_TREE_SIZE - 3);
+  for (int i = window; i < window + 3; ++i)
+    reductions.push_back(set<int>(frontier.begin() + i,
+                                  frontier.begin() + i + 2));
+  for (list<set<int> >::iterator S = reductions.begin();
+       S != reductions.end(); ++S) {
+    if (!tree.Reduce(*S) || !small_tree.Reduce(*S) ||
+        CanonicalForm(tree.Print()) != CanonicalForm(small_tree.Print()))
+      return false;
+  }
+
+  vector<set<int> > attempts;
+  attempts.push_back(set<int>());
+  attempts.back().insert(frontier[window]);
+  attempts.back().insert(frontier[window + 2]);
+  attempts.push_back(set<int>());
+  while (attempts.back().size() < 3)
+    attempts.back().insert(rand() % WIDE_TREE_SIZE);
+  attempts.push_back(set<int>());
+  attempts.back().insert(frontier[0]);
+  attempts.back().insert(WIDE_TREE_SIZE + rand() % 100);
+  set<int> adjacent(frontier.begin() + window, frontier.begin() + window + 2);
+  for (int i = 0; i < attempts.size(); ++i) {
+    PQTree tree_copy(tree);
+    SmallPQTree<128> small_copy(small_tree);
+    bool reduced = tree_copy.Reduce(attempts[i]);
+    if (small_copy.Reduce(attempts[i]) != reduced || (i != 1 && reduced))
+      return false;
+    if (!reduced && (tree_copy.Reduce(adjacent) || small_copy.Reduce(adjacent)))
+      return false;
+    if (reduced &&
+        CanonicalForm(tree_copy.Print()) != CanonicalForm(small_copy.Print()))
+      return false;
+  }
+  return true;
+}
+
+// Checks that projecting |tree| onto a random subset of its leaves gives the
+// same tree as removing all the other leaves one by one, and that both are
+// rebuilt by their recorded reductions.
+bool CheckProjection(PQTree* tree) {
+  set<int> subset;
+  for (int i = 0; i < TREE_SIZE; ++i) {
+    if (rand() % 2)
+      subset.insert(i);
+  }
+  subset.insert(TREE_SIZE + rand() % 3);
+  PQTree* projected = tree->Project(subset);
+  PQTree* removed = tree->Clone();
+  for (int i = 0; i < TREE_SIZE; ++i) {
+    if (!subset.count(i))
+      removed->RemoveLeaf(i);
+  }
+  bool same = PQTree::Equivalent(*projected, *removed) &&
+              CanonicalForm(projected->Print()) ==
+                  CanonicalForm(removed->Print()) &&
+              projected->CountFrontiers() == removed->CountFrontiers() &&
+              projected->CanonicalHash() == removed->CanonicalHash() &&
+              HistoryRebuilds(projected) && HistoryRebuilds(removed) &&
+              projected->Frontier() == PrintedFrontier(projected->Print());
+  delete projected;
+  delete removed;
+  return same;
+}
+
+// Checks that ReduceAllSkipping() keeps exactly the sets SafeReduce() keeps
+// when tried one at a time in the same order, starting from a fresh tree, on
+// the reductions of |tree| mixed with noisy sets.  Some of those are runs of
+// the frontier with a leaf swapped for another, which often fail only after
+// Bubble(), and one has a value which is not a leaf.
+bool CheckSkipping(PQTree* tree) {
+  list<int> frontier_list = tree->Frontier();
+  vector<int> frontier(frontier_list.begin(), frontier_list.end());
+  vector<set<int> > sets;
+  list<set<int> > reductions = tree->GetReductions();
+  sets.insert(sets.end(), reductions.begin(), reductions.end());
+  for (int i = 0; i < 10; ++i) {
+    int start = rand() % (TREE_SIZE - 2);
+    int size = min(rand() % 6 + 2, TREE_SIZE - start);
+    set<int> noisy(frontier.begin() + start, frontier.begin() + start + size);
+    if (rand() % 2) {
+      noisy.erase(frontier[start + rand() % size]);
+      noisy.insert(rand() % TREE_SIZE);
+    }
+    sets.push_back(noisy);
+  }
+  set<int> outside;
+  outside.insert(rand() % TREE_SIZE);
+  outside.insert(TREE_SIZE);
+  sets.push_back(outside);
+  random_shuffle(sets.begin(), sets.end());
+
+  vector<double> weights;
+  vector<pair<double, int> > by_weight;
+  vector<pair<int, int> > by_size;
+  for (int i = 0; i < sets.size(); ++i) {
+    weights.push_back(rand() % 5);
+    by_weight.push_back(make_pair(-weights[i], i));
+    by_size.push_back(make_pair(sets[i].size(), i));
+  }
+  sort(by_weight.begin(), by_weight.end());
+  sort(by_size.begin(), by_size.end());
+  PQTree::ReductionOrder order = PQTree::ReductionOrder(rand() % 3);
+  vector<int> attempts;
+  for (int i = 0; i < sets.size(); ++i) {
+    if (order == PQTree::ascending_size)
+      attempts.push_back(by_size[i].second);
+    else if (order == PQTree::by_weight)
+      attempts.push_back(by_weight[i].second);
+    else
+      attempts.push_back(i);
+  }
+
+  PQTree skipping(TREE_SIZE);
+  vector<bool> kept = skipping.ReduceAllSkipping(
+      list<set<int> >(sets.begin(), sets.end()), order, weights);
+  PQTree safe(TREE_SIZE);
+  for (int i = 0; i < attempts.size(); ++i) {
+    const set<int>& S = sets[attempts[i]];
+    if (kept[attempts[i]] != safe.SafeReduce(S))
+      return false;
+  }
+  return PQTree::Equivalent(skipping, safe) &&
+         CanonicalForm(skipping.Print()) == CanonicalForm(safe.Print()) &&
+         skipping.CountFrontiers() == safe.CountFrontiers() &&
+         skipping.GetReductions() == safe.GetReductions() &&
+         Admits(skipping.FrontierArray(), skipping.GetReductions());
+}
+
+// Checks that ReduceAll(), which builds the hierarchy of a laminar prefix of
+// its sets directly, agrees with reducing by each set in turn.  The sets are
+// runs of a random frontier kept only while they are nested in or apart from
+// the runs before, followed by any runs and sometimes by a random set, which
+// may fail, at times for holding a value which is not a leaf.
+bool CheckLaminar() {
+  vector<int> frontier;
+  for (int i = 0; i < TREE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  vector<pair<int, int> > runs;
+  list<set<int> > reductions;
+  for (int i = 0; i < 12; ++i) {
+    int start = rand() % TREE_SIZE;
+    int end = start + 1 + rand() % (TREE_SIZE - start);
+    bool laminar = true;
+    for (int j = 0; j < runs.size(); ++j) {
+      bool apart = end <= runs[j].first || runs[j].second <= start;
+      bool nested = (runs[j].first <= start && end <= runs[j].second) ||
+                    (start <= runs[j].first && runs[j].second <= end);
+      laminar = laminar && (apart || nested);
+    }
+    if (!laminar)
+      continue;
+    runs.push_back(make_pair(start, end));
+    reductions.push_back(set<int>(frontier.begin() + start,
+                                  frontier.begin() + end));
+  }
+  for (int i = rand() % 4; i > 0; --i) {
+    int start = rand() % (TREE_SIZE - 2);
+    int size = min(rand() % 6 + 2, TREE_SIZE - start);
+    reductions.push_back(set<int>(frontier.begin() + start,
+                                  frontier.begin() + start + size));
+  }
+  if (rand() % 4 == 0) {
+    set<int> random;
+    while (random.size() < 3)
+      random.insert(rand() % TREE_SIZE);
+    if (rand() % 2)
+      random.insert(TREE_SIZE);
+    reductions.push_back(random);
+  }
+
+  PQTree laminar(TREE_SIZE);
+  PQTree stepped(TREE_SIZE);
+  bool reduced = laminar.ReduceAll(reductions);
+  bool stepped_reduced = true;
+  for (list<set<int> >::iterator S = reductions.begin();
+       S != reductions.end() && stepped_reduced; ++S)
+    stepped_reduced = stepped.Reduce(*S);
+  if (reduced != stepped_reduced ||
+      laminar.GetReductions() != stepped.GetReductions())
+    return false;
+  if (!reduced)
+    return true;
+  return PQTree::Equivalent(laminar, stepped) &&
+         CanonicalForm(laminar.Print()) == CanonicalForm(stepped.Print()) &&
+         laminar.CountFrontiers() == stepped.CountFrontiers() &&
+         laminar.CanonicalHash() == stepped.CanonicalHash() &&
+         laminar.Frontier() == PrintedFrontier(laminar.Print()) &&
+         Admits(laminar.FrontierArray(), reductions);
+}
+
+// Checks ReduceAllPreprocessed() against ReduceAll() of the same sets, on a
+// fresh tree with each class of twins, leaves in exactly the same sets, added
+// as a set, and on a reduced tree as they are.  The sets are runs of a random
+// frontier, with duplicates and trivial sets among them, and sometimes a
+// random set which may fail.
+bool CheckPreprocessing() {
+  vector<int> frontier;
+  for (int i = 0; i < TREE_SIZE; ++i)
+    frontier.push_back(i);
+  random_shuffle(frontier.begin(), frontier.end());
+  list<set<int> > reductions;
+  for (int i = rand() % 5 + 1; i > 0; --i) {
+    int start = rand() % TREE_SIZE;
+    int end = start + 1 + rand() % (TREE_SIZE - start);
+    reductions.push_back(set<int>(frontier.begin() + start,
+                                  frontier.begin() + end));
+    if (rand() % 3 == 0)
+      reductions.push_back(reductions.back());
+    if (rand() % 6 == 0)
+      reductions.push_back(set<int>());
+  }
+  if (rand() % 4 == 0) {
+    set<int> random;
+    while (random.size() < 3)
+      random.insert(rand() % TREE_SIZE);
+    reductions.push_back(random);
+  }
+
+  // The sets kept, and the sets each leaf is in.
+  list<set<int> > kept;
+  set<set<int> > seen;
+  vector<vector<int> > memberships(TREE_SIZE);
+  for (list<set<int> >::iterator S = reductions.begin();
+       S != reductions.end(); ++S) {
+    if (S->size() < 2 || S->size() == TREE_SIZE || seen.count(*S))
+      continue;
+    seen.insert(*S);
+    kept.push_back(*S);
+    for (set<int>::iterator i = S->begin(); i != S->end(); ++i)
+      memberships[*i].push_back(kept.size());
+  }
+  map<vector<int>, set<int> > classes;
+  for (int i = 0; i < TREE_SIZE; ++i) {
+    if (!memberships[i].empty())
+      classes[memberships[i]].insert(i);
+  }
+
+  PQTree preprocessed(TREE_SIZE);
+  PQTree expected(TREE_SIZE);
+  bool reduced_first = rand() % 4 == 0;
+  if (reduced_first) {
+    set<int> first(frontier.begin(), frontier.begin() + 2);
+    preprocessed.Reduce(first);
+    expected.Reduce(first);
+    kept.push_front(first);
+  }
+  bool reduced = preprocessed.ReduceAllPreprocessed(reductions);
+  if (reduced != expected.ReduceAll(reductions))
+    return false;
+  if (!reduced)
+    return true;
+  set<set<int> > twin_classes;
+  for (map<vector<int>, set<int> >::iterator i = classes.begin();
+       i != classes.end() && !reduced_first; ++i) {
+    if (!expected.Reduce(i->second))
+      return false;
+    if (i->second.size() > 1)
+      twin_classes.insert(i->second);
+  }
+  // The twin classes are recorded after the sets kept, so that the recorded
+  // sets rebuild the same tree.
+  list<set<int> > recorded = preprocessed.GetReductions();
+  list<set<int> >::iterator classes_begin = recorded.begin();
+  advance(classes_begin, min(kept.size(), recorded.size()));
+  PQTree rebuilt(TREE_SIZE);
+  if (list<set<int> >(recorded.begin(), classes_begin) != kept ||
+      set<set<int> >(classes_begin, recorded.end()) != twin_classes ||
+      distance(classes_begin, recorded.end()) != twin_classes.size() ||
+      !rebuilt.ReduceAll(recorded) ||
+      !PQTree::Equivalent(preprocessed, rebuilt))
+    return false;
+  return PQTree::Equivalent(preprocessed, expected) &&
+         CanonicalForm(preprocessed.Print()) ==
+             CanonicalForm(expected.Print()) &&
+         preprocessed.CountFrontiers() == expected.CountFrontiers() &&
+         preprocessed.CanonicalHash() == expected.CanonicalHash() &&
+         preprocessed.Frontier() == PrintedFrontier(preprocessed.Print()) &&
+         Admits(preprocessed.FrontierArray(), reductions);
+}
+
+// Checks CommonIntervals against brute force on a few permutations of
+// TREE_SIZE values, each after the first made from the one before by
+// reversing and moving random runs, or sometimes drawn afresh.  Every run of
+// the reference must be reported common exactly when it is consecutive in
+// all of them, the irreducible intervals must be those common runs which no
+// two smaller overlapping ones make up, and the tree must be the one reduced
+// by every common run.
+bool CheckCommonIntervals() {
+  // Spread the values out sometimes, so that they are indexed sparsely.
+  int spread = rand() % 3 == 0 ? 1000 : 1;
+  vector<int> permutation;
+  for (int i = 0; i < TREE_SIZE; ++i)
+    permutation.push_back(i * spread - 3);
+  random_shuffle(permutation.begin(), permutation.end());
+  CommonIntervals intervals;
+  vector<vector<int> > permutations;
+  for (int k = rand() % 4 + 1; k > 0; --k) {
+    if (!permutations.empty() && rand() % 5 == 0) {
+      random_shuffle(permutation.begin(), permutation.end());
+    } else if (!permutations.empty()) {
+      for (int j = rand() % 3; j >= 0; --j) {
+        int start = rand() % TREE_SIZE;
+        int end = start + 1 + rand() % (TREE_SIZE - start);
+        if (rand() % 2)
+          reverse(permutation.begin() + start, permutation.begin() + end);
+        else
+          rotate(permutation.begin(), permutation.begin() + start,
+                 permutation.begin() + end);
+      }
+    }
+    if (!intervals.AddPermutation(permutation))
+      return false;
+    permutations.push_back(permutation);
+  }
+  vector<int> duplicated(permutation);
+  duplicated[0] = duplicated[1];
+  if (intervals.AddPermutation(duplicated) ||
+      intervals.PermutationCount() != permutations.size())
+    return false;
+
+  // common[x][y] tells whether the reference from x to y is common.
+  const vector<int>& reference = intervals.Reference();
+  if (reference != permutations[0])
+    return false;
+  vector<vector<bool> > common(TREE_SIZE, vector<bool>(TREE_SIZE, true));
+  for (int k = 1; k < permutations.size(); ++k) {
+    map<int, int> positions;
+    for (int i = 0; i < TREE_SIZE; ++i)
+      positions[permutations[k][i]] = i;
+    for (int x = 0; x < TREE_SIZE; ++x) {
+      int low = positions[reference[x]], high = low;
+      for (int y = x; y < TREE_SIZE; ++y) {
+        low = min(low, positions[reference[y]]);
+        high = max(high, positions[reference[y]]);
+        if (high - low != y - x)
+          common[x][y] = false;
+      }
+    }
+  }
+  vector<pair<int, int> > irreducible;
+  list<set<int> > runs;
+  for (int x = 0; x < TREE_SIZE; ++x) {
+    for (int y = x; y < TREE_SIZE; ++y) {
+      if (intervals.IsCommon(x, y + 1) != common[x][y])
+        return false;
+      if (!common[x][y] || x == y)
+        continue;
+      runs.push_back(set<int>(reference.begin() + x,
+                              reference.begin() + y + 1));
+      bool reducible = false;
+      for (int a = x + 1; a < y; ++a)
+        for (int b = a; b < y; ++b)
+          reducible = reducible || (common[x][b] && common[a][y]);
+      if (!reducible)
+        irreducible.push_back(make_pair(x, y + 1));
+    }
+  }
+  vector<pair<int, int> > found;
+  intervals.Irreducible(&found);
+  if (found != irreducible)
+    return false;
+
+  PQTree expected(reference.begin(), reference.end());
+  if (!expected.ReduceAll(runs))
+    return false;
+  PQTree* tree = intervals.Tree();
+  list<int> frontier = tree->Frontier();
+  bool agrees =
+      PQTree::Equivalent(*tree, expected) &&
+      CanonicalForm(tree->Print()) == CanonicalForm(expected.Print()) &&
+      tree->CountFrontiers() == expected.CountFrontiers() &&
+      tree->CanonicalHash() == expected.CanonicalHash() &&
+      vector<int>(frontier.begin(), frontier.end()) == reference &&
+      frontier == PrintedFrontier(tree->Print());
+  for (int k = 0; k < permutations.size(); ++k)
+    agrees = agrees && tree->Admits(permutations[k]);
+  delete tree;
+  return agrees;
+}
+
+// Checks that the reductions ExplainConflict() names for sets that |tree|
+// rejects do conflict with those sets, with conflict explanation turned on
+// either from the start or halfway through replaying the reductions.
+bool CheckConflicts(PQTree* tree) {
+  list<set<int> > reductions = tree->GetReductions();
+  vector<set<int> > history(reductions.begin(), reductions.end());
+  PQTree explained(TREE_SIZE);
+  bool from_start = rand() % 2;
+  explained.SetExplainConflicts(from_start);
+  for (int i = 0; i < history.size(); ++i) {
+    if (i == history.size() / 2)
+      explained.SetExplainConflicts(true);
+    explained.Reduce(history[i]);
+  }
+  vector<int> conflict;
+  if (explained.ExplainConflict(&conflict))
+    return false;
+
+  for (int i = 0; i < 10; ++i) {
+    set<int> rejected;
+    int size = rand() % 5 + 2;
+    while (rejected.size() < size)
+      rejected.insert(rand() % TREE_SIZE);
+    // SafeReduce() keeps the explanation along with the tree.
+    if (explained.SafeReduce(rejected)) {
+      history.push_back(rejected);
+      continue;
+    }
+    if (!explained.ExplainConflict(&conflict))
+      return false;
+    PQTree replayed(TREE_SIZE);
+    for (int j = 0; j < conflict.size(); ++j) {
+      if (!replayed.Reduce(history[conflict[j]]))
+        return false;
+    }
+    if (replayed.Reduce(rejected))
+      return false;
+  }
+  return true;
+}
 
 bool fuzztest() {
   for (int i = 0; i < ITERATIONS; ++i) {
@@ -40,6 +705,10 @@ bool fuzztest() {
       frontier.push_back(j);
     }
     PQTree tree(items);
+    SmallPQTree<16> small_tree(TREE_SIZE);
+    CompactPQTree compact_tree(TREE_SIZE);
+    // Cloned from |tree| halfway through and reduced alongside it from then on.
+    PQTree* clone = NULL;
 
     // We pick a random ordering of the items.
     random_shuffle(frontier.begin(), frontier.end());
@@ -58,11 +727,178 @@ bool fuzztest() {
         cout << frontier[k] << " ";
       }
       cout << endl;
+      PQTree before(tree);
       if (!tree.Reduce(reduction)) {
         return false;
       }
+      // Equivalent() and the canonical hashes, which are only asked for
+      // after every other reduction so that some reductions forget hashes
+      // that were never recomputed, must agree with the canonical forms
+      // printed.
+      bool equivalent =
+          CanonicalForm(before.Print()) == CanonicalForm(tree.Print());
+      if (PQTree::Equivalent(before, tree) != equivalent ||
+          (j % 2 && (before.CanonicalHash() == tree.CanonicalHash()) !=
+                    equivalent)) {
+        cout << "Equivalent disagrees: " << before.Print() << endl;
+        return false;
+      }
       cout << tree.Print() << endl;
+
+      if (!small_tree.Reduce(reduction) ||
+          CanonicalForm(tree.Print()) != CanonicalForm(small_tree.Print())) {
+        cout << "SmallPQTree disagrees: " << small_tree.Print() << endl;
+        return false;
+      }
+      if (!compact_tree.Reduce(reduction) ||
+          CanonicalForm(tree.Print()) != CanonicalForm(compact_tree.Print())) {
+        cout << "CompactPQTree disagrees: " << compact_tree.Print() << endl;
+        return false;
+      }
+      if (clone && (!clone->Reduce(reduction) ||
+          CanonicalForm(tree.Print()) != CanonicalForm(clone->Print()) ||
+          clone->CanonicalHash() != tree.CanonicalHash())) {
+        cout << "Clone disagrees: " << clone->Print() << endl;
+        return false;
+      }
+      // The cached frontier and the frontier count must match a walk of the
+      // tree, and Rank() and Select() must agree with the frontier.
+      list<int> ordering = tree.Frontier();
+      if (ordering != PrintedFrontier(tree.Print())) {
+        cout << "Frontier cache is stale" << endl;
+        return false;
+      }
+      size_t pos = 0;
+      long long frontier_count = PrintedFrontierCount(tree.Print(), &pos);
+      if (atoll(tree.CountFrontiers().c_str()) != frontier_count ||
+          fabs(tree.LogFrontierCount() - log(double(frontier_count))) > 1e-6) {
+        cout << "Frontier count disagrees: " << tree.CountFrontiers() << endl;
+        return false;
+      }
+      int position = 0;
+      int previous = -1;
+      for (list<int>::iterator k = ordering.begin(); k != ordering.end();
+           ++k, ++position) {
+        if (tree.Rank(*k) != position || tree.Select(position) != *k ||
+            (position && !tree.IsAdjacent(*k, previous))) {
+          cout << "Rank disagrees at " << position << ": " << *k << endl;
+          return false;
+        }
+        previous = *k;
+      }
+      // The tree must admit its own frontier, and agree with the reductions
+      // about the frontier with two random neighbours swapped.
+      vector<int> candidate(ordering.begin(), ordering.end());
+      int swapped = rand() % (TREE_SIZE - 1);
+      swap(candidate[swapped], candidate[swapped + 1]);
+      vector<vector<int> > candidates(1, candidate);
+      candidates.push_back(vector<int>(ordering.begin(), ordering.end()));
+      vector<bool> admitted;
+      tree.Admits(candidates, &admitted);
+      if (!admitted[1] || tree.Admits(candidate) != admitted[0] ||
+          admitted[0] != Admits(candidate, tree.GetReductions())) {
+        cout << "Admits disagrees: " << candidate[swapped] << " "
+             << candidate[swapped + 1] << endl;
+        return false;
+      }
+      if (j == REDUCTIONS / 2)
+        clone = tree.Clone();
+      // Compacting only moves nodes, so the tree must print the same.
+      if (j % 5 == 4) {
+        string before = tree.Print();
+        tree.Compact();
+        if (tree.Print() != before) {
+          cout << "Compact changed the tree: " << tree.Print() << endl;
+          return false;
+        }
+      }
+    }
+    // The hashes kept up to date through the reductions must match those of
+    // a tree hashed from scratch.
+    PQTree fresh(items);
+    fresh.ReduceAll(tree.GetReductions());
+    if (fresh.CanonicalHash() != tree.CanonicalHash()) {
+      cout << "CanonicalHash disagrees: " << tree.Print() << endl;
+      return false;
+    }
+    // Splitting the reductions between three trees and intersecting them
+    // must give back the same tree.
+    vector<PQTree*> shards;
+    for (int k = 0; k < 3; ++k)
+      shards.push_back(new PQTree(items));
+    list<set<int> > reductions = tree.GetReductions();
+    int shard = 0;
+    for (list<set<int> >::iterator k = reductions.begin();
+         k != reductions.end(); ++k)
+      shards[shard++ % 3]->Reduce(*k);
+    PQTree pair(*shards[0]);
+    bool intersected = PQTree::Intersect(&pair, *shards[1]) &&
+                       PQTree::Intersect(&pair, *shards[2]) &&
+                       PQTree::Equivalent(pair, tree) &&
+                       PQTree::IntersectAll(shards) &&
+                       PQTree::Equivalent(*shards[0], tree);
+    for (int k = 0; k < 3; ++k)
+      delete shards[k];
+    // A tree with a leaf |tree| lacks, whether that leaf hangs below the root
+    // or is tied to another leaf, must leave a copy of |tree| invalid.
+    PQTree loose(tree), tied(items), loose_target(tree), tied_target(tree);
+    set<int> tie;
+    tie.insert(0);
+    tie.insert(TREE_SIZE);
+    loose.AddLeaf(TREE_SIZE);
+    tied.AddLeaf(TREE_SIZE);
+    tied.Reduce(tie);
+    intersected = intersected &&
+                  !PQTree::Intersect(&loose_target, loose) &&
+                  !PQTree::Intersect(&tied_target, tied) &&
+                  !PQTree::Equivalent(loose_target, tree) &&
+                  !PQTree::Equivalent(tied_target, tree);
+    if (!intersected) {
+      cout << "Intersect disagrees: " << tree.Print() << endl;
+      return false;
+    }
+    // Small enough trees have every frontier enumerated.
+    if (atoll(tree.CountFrontiers().c_str()) <= 1000 &&
+        !CheckEnumeration(&tree)) {
+      cout << "FrontierEnumerator disagrees: " << tree.Print() << endl;
+      return false;
+    }
+    if (atoll(tree.CountFrontiers().c_str()) <= 1000 &&
+        !CheckLeafChanges(&tree)) {
+      cout << "Leaf changes disagree: " << tree.Print() << endl;
+      return false;
+    }
+    if (!CheckProjection(&tree)) {
+      cout << "Project disagrees: " << tree.Print() << endl;
+      return false;
+    }
+    if (!CheckConflicts(&tree)) {
+      cout << "ExplainConflict disagrees: " << tree.Print() << endl;
+      return false;
+    }
+    if (!CheckSkipping(&tree)) {
+      cout << "ReduceAllSkipping disagrees: " << tree.Print() << endl;
+      return false;
+    }
+    if (!CheckLaminar()) {
+      cout << "Laminar ReduceAll disagrees" << endl;
+      return false;
+    }
+    if (!CheckPreprocessing()) {
+      cout << "ReduceAllPreprocessed disagrees" << endl;
+      return false;
+    }
+    // The wide trees are ten times the size, so they are checked a tenth as
+    // often.
+    if (i % 10 == 0 && !CheckWideSmallPQTree()) {
+      cout << "Wide SmallPQTree disagrees" << endl;
+      return false;
+    }
+    if (!CheckCommonIntervals()) {
+      cout << "CommonIntervals disagrees" << endl;
+      return false;
     }
+    delete clone;
   }
   return true;
 }
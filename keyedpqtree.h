@@ -0,0 +1,149 @@
+// PQ-Tree over arbitrary leaf keys.
+//
+// PQTree identifies its leaves by int.  KeyedPQTree<Key> lets client code use
+// any ordered key type (64-bit entity ids, strings, ...) by interning every
+// key into a dense id space 0 .. n-1 once, at construction.  The underlying
+// PQTree only ever sees dense ids, so clients that already hold dense ids can
+// reduce and read frontiers without touching the dictionary at all.
+//
+// Usage:
+//   set<string> genes;  // "a", "b", "c", ...
+//   KeyedPQTree<string> tree(genes);
+//   tree.Reduce(some_genes);          // translates keys to ids
+//   tree.ReduceIds(some_ids);         // hot path, no translation
+//   list<string> order = tree.Frontier();
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef KEYEDPQTREE_H
+#define KEYEDPQTREE_H
+
+#include <assert.h>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include "pqtree.h"
+
+using namespace std;
+
+// Interns keys into dense ids, handing out 0, 1, 2, ... in order of first
+// appearance.
+template <class Key>
+class LeafDictionary {
+ public:
+  // Returns the dense id of |key|, assigning it the next free id if it has
+  // not been seen before.
+  int Intern(const Key& key) {
+    typename map<Key, int>::iterator it = ids_.find(key);
+    if (it != ids_.end())
+      return it->second;
+    int id = keys_.size();
+    ids_[key] = id;
+    keys_.push_back(key);
+    return id;
+  }
+
+  // Returns the dense id of |key|, or -1 if it was never interned.
+  int Find(const Key& key) const {
+    typename map<Key, int>::const_iterator it = ids_.find(key);
+    return it == ids_.end() ? -1 : it->second;
+  }
+
+  // Returns the key which was interned as |id|.
+  const Key& KeyOf(int id) const {
+    assert(id >= 0 && id < keys_.size());
+    return keys_[id];
+  }
+
+  // Returns the number of interned keys.
+  int Size() const {
+    return keys_.size();
+  }
+
+ private:
+  map<Key, int> ids_;
+  vector<Key> keys_;
+};
+
+template <class Key>
+class KeyedPQTree {
+ public:
+  // Constructs a tree over |leaves|.  Only reductions using elements of that
+  // set will succeed.
+  explicit KeyedPQTree(const set<Key>& leaves)
+      : tree_(InternAll(leaves, &dictionary_)) {}
+
+  // Reduces the tree by a set of keys.  Returns false without touching the
+  // tree if any key is not a leaf of the tree, otherwise behaves like
+  // PQTree::Reduce.
+  bool Reduce(const set<Key>& S) {
+    set<int> ids;
+    for (typename set<Key>::const_iterator i = S.begin(); i != S.end(); ++i) {
+      int id = dictionary_.Find(*i);
+      if (id < 0)
+        return false;
+      ids.insert(id);
+    }
+    return tree_.Reduce(ids);
+  }
+
+  // Reduces the tree by a set of dense ids, skipping the dictionary.
+  bool ReduceIds(const set<int>& S) {
+    return tree_.Reduce(S);
+  }
+
+  // Returns 1 possible frontier as original keys.
+  list<Key> Frontier() {
+    list<int> ids = tree_.Frontier();
+    list<Key> out;
+    for (list<int>::iterator i = ids.begin(); i != ids.end(); ++i)
+      out.push_back(dictionary_.KeyOf(*i));
+    return out;
+  }
+
+  // Returns 1 possible frontier as dense ids.
+  list<int> FrontierIds() {
+    return tree_.Frontier();
+  }
+
+  // The dictionary translating between keys and dense ids.
+  const LeafDictionary<Key>& Dictionary() const {
+    return dictionary_;
+  }
+
+  // The underlying tree, whose leaves are dense ids.
+  PQTree& Tree() {
+    return tree_;
+  }
+
+ private:
+  // Interns |leaves| into |dictionary| and returns their dense ids.
+  static set<int> InternAll(const set<Key>& leaves,
+                            LeafDictionary<Key>* dictionary) {
+    set<int> ids;
+    for (typename set<Key>::const_iterator i = leaves.begin();
+         i != leaves.end(); ++i)
+      ids.insert(dictionary->Intern(*i));
+    return ids;
+  }
+
+  // Must be declared before |tree_|, which is built from it.
+  LeafDictionary<Key> dictionary_;
+  PQTree tree_;
+};
+
+#endif
@@ -16,6 +16,7 @@
 // with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <assert.h>
+#include <algorithm>
 #include <list>
 #include <map>
 #include <set>
@@ -27,106 +28,252 @@
 
 using namespace std;
 
-PQNode::PQNode_types PQNode::Type() {
-  return type_;
+int PQNode::LeafValue() {
+  return AsLeaf()->leaf_value_;
 }
 
-int PQNode::LeafValue() {
-  assert(type_ == leaf);
-  return leaf_value_;
+int PQNode::LeafCount() const {
+  if (Type() == leaf)
+    return 1;
+  return static_cast<const PQInternalNode*>(this)->leaf_count_;
 }
 
 void PQNode::Children(vector<PQNode*> *children) {
   assert(children->empty());
-  if (type_ == pnode) {
-    for (list<PQNode*>::const_iterator i = circular_link_.begin();
-         i != circular_link_.end(); ++i)
+  if (Type() == pnode) {
+    PNode* pnode = AsPNode();
+    for (PQNodeList::const_iterator i = pnode->circular_link_.begin();
+         i != pnode->circular_link_.end(); ++i)
       children->push_back(*i);
-  } else if (type_ == qnode) {
-    for(QNodeChildrenIterator qit(this); !qit.IsDone(); qit.Next())
+  } else if (Type() == qnode) {
+    for(QNodeChildrenIterator qit(AsQNode()); !qit.IsDone(); qit.Next())
       children->push_back(qit.Current());
   }
 }
 
-int PQNode::ChildCount() {
+namespace {
+
+// The finaliser of splitmix64, which spreads every input bit over the output.
+uint64_t Mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+}  // namespace
+
+uint64_t PQNode::CanonicalHash() {
+  if (Type() == leaf)
+    return Mix(unsigned(AsLeaf()->leaf_value_));
+  if (AsInternal()->hash_)
+    return AsInternal()->hash_;
+
+  // Hash the nodes whose hashes were forgotten below this one in postorder,
+  // through an explicit stack of nodes paired with whether their children
+  // have been hashed yet.  A node none of whose children need hashing is
+  // hashed straight away from the children listed when it was first met;
+  // the others list their children again once they are popped.
+  vector<pair<PQInternalNode*, bool> > pending;
+  vector<PQNode*> children;
+  vector<uint64_t> hashes;
+  pending.push_back(make_pair(AsInternal(), false));
+  while (!pending.empty()) {
+    PQInternalNode* node = pending.back().first;
+    bool children_hashed = pending.back().second;
+    children.clear();
+    node->Children(&children);
+    if (!children_hashed) {
+      pending.back().second = true;
+      int forgotten = 0;
+      for (int i = 0; i < children.size(); ++i) {
+        if (children[i]->Type() != leaf && !children[i]->AsInternal()->hash_) {
+          pending.push_back(make_pair(children[i]->AsInternal(), false));
+          ++forgotten;
+        }
+      }
+      if (forgotten)
+        continue;
+    }
+    pending.pop_back();
+
+    // A P-Node adds its children's hashes up, in any order.  A Q-Node hashes
+    // its children in both directions and combines the two results the same
+    // way whichever comes first.
+    uint64_t hash;
+    if (node->Type() == pnode) {
+      uint64_t sum = 0;
+      for (int i = 0; i < children.size(); ++i)
+        sum += Mix(children[i]->CanonicalHash());
+      hash = Mix(sum + 0x9e3779b97f4a7c15ULL);
+    } else {
+      hashes.clear();
+      for (int i = 0; i < children.size(); ++i)
+        hashes.push_back(children[i]->CanonicalHash());
+      uint64_t forward = 0, backward = 0;
+      for (int i = 0; i < hashes.size(); ++i) {
+        forward = Mix(forward + hashes[i]);
+        backward = Mix(backward + hashes[hashes.size() - 1 - i]);
+      }
+      hash = Mix(min(forward, backward) +
+                 Mix(max(forward, backward) + 0x632be59bd9b4e019ULL));
+    }
+    node->hash_ = hash ? hash : 1;
+  }
+  return AsInternal()->hash_;
+}
+
+PQLeaf* PQNode::AsLeaf() {
+  assert(Type() == leaf);
+  return static_cast<PQLeaf*>(this);
+}
+
+PQInternalNode* PQNode::AsInternal() {
+  assert(Type() != leaf);
+  return static_cast<PQInternalNode*>(this);
+}
+
+PNode* PQNode::AsPNode() {
+  assert(Type() == pnode);
+  return static_cast<PNode*>(this);
+}
+
+QNode* PQNode::AsQNode() {
+  assert(Type() == qnode);
+  return static_cast<QNode*>(this);
+}
+
+const PQLeaf* PQNode::AsLeaf() const {
+  assert(Type() == leaf);
+  return static_cast<const PQLeaf*>(this);
+}
+
+const PNode* PQNode::AsPNode() const {
+  assert(Type() == pnode);
+  return static_cast<const PNode*>(this);
+}
+
+const QNode* PQNode::AsQNode() const {
+  assert(Type() == qnode);
+  return static_cast<const QNode*>(this);
+}
+
+void* PQNode::operator new(size_t size, PQNodePool* pool) {
+  return pool->Allocate(size);
+}
+
+void PQNode::operator delete(void*, PQNodePool*) {
+  // Only called if a constructor throws, so the size is not known.  The block
+  // is reclaimed when the pool is destroyed.
+}
+
+void PQNode::Delete(PQNode* node, PQNodePool* pool) {
+  if (!node)
+    return;
+  if (node->Type() == leaf) {
+    node->AsLeaf()->~PQLeaf();
+    pool->Free(node, sizeof(PQLeaf));
+  } else if (node->Type() == pnode) {
+    node->AsPNode()->~PNode();
+    pool->Free(node, sizeof(PNode));
+  } else {
+    node->AsQNode()->~QNode();
+    pool->Free(node, sizeof(QNode));
+  }
+}
+
+PQNode* PQNode::DeepCopy(PQNodePool* pool) const {
+  if (Type() == leaf)
+    return new (pool) PQLeaf(*AsLeaf());
+  if (Type() == pnode)
+    return new (pool) PNode(*AsPNode(), pool);
+  return new (pool) QNode(*AsQNode(), pool);
+}
+
+PQNodePool* PQInternalNode::Pool() const {
+  return full_children_.get_allocator().Pool();
+}
+
+int PNode::ChildCount() {
   return circular_link_.size();
 }
 
-PQNode* PQNode::CopyAsChild(const PQNode& to_copy) {
-  PQNode* temp = new PQNode(to_copy);
+PQNode* PQInternalNode::CopyAsChild(const PQNode& to_copy) {
+  PQNode* temp = to_copy.DeepCopy(Pool());
   temp->parent_ = this;
   return temp;
 }
 
 PQNode::PQNode(const PQNode& to_copy) {
-  Copy(to_copy);
+  flags_ = to_copy.flags_;
+  pertinent_leaf_count = to_copy.pertinent_leaf_count;
+
+  // Make sure that these are unset initially
+  parent_ = NULL;
+  ClearImmediateSiblings();
 }
 
-void PQNode::Copy(const PQNode& to_copy) {
+void PQNode::CopyScalars(const PQNode& to_copy) {
   // Copy the easy stuff
-  leaf_value_            = to_copy.leaf_value_;
+  assert(Type() == to_copy.Type());
   pertinent_leaf_count  = to_copy.pertinent_leaf_count;
-  pertinent_child_count = to_copy.pertinent_child_count;
-  type_                  = to_copy.type_;
-  mark_                  = to_copy.mark_;
-  label_                 = to_copy.label_;
-  pseudonode_            = to_copy.pseudonode_;
-  pseudochild_           = to_copy.pseudochild_;
+  flags_                 = to_copy.flags_;
+}
 
-  // Make sure that these are unset initially
-  parent_ = NULL;
-  partial_children_.clear();
-  full_children_.clear();
-  circular_link_.clear();
-  endmost_children_[0] = NULL;
-  endmost_children_[1] = NULL;
-  ClearImmediateSiblings();
-  ForgetChildren();
+PQInternalNode::PQInternalNode(const PQInternalNode& to_copy,
+                               PQNodePool* pool)
+    : PQNode(to_copy),
+      full_children_(less<PQNode*>(), PQNodeAllocator<PQNode*>(pool)),
+      partial_children_(less<PQNode*>(), PQNodeAllocator<PQNode*>(pool)) {
+  pertinent_child_count = to_copy.pertinent_child_count;
+  leaf_count_ = to_copy.leaf_count_;
+  hash_ = to_copy.hash_;
+  provenance_ = to_copy.provenance_;
+}
 
-  // Copy the nodes in circular link for pnodes.
-  // If it is not a pnode, it will be empty, so this will be a no-op.
-  for (list<PQNode*>::const_iterator i = to_copy.circular_link_.begin();
+PNode::PNode(const PNode& to_copy, PQNodePool* pool)
+    : PQInternalNode(to_copy, pool),
+      circular_link_(PQNodeAllocator<PQNode*>(pool)) {
+  // Copy the nodes in circular link.
+  for (PQNodeList::const_iterator i = to_copy.circular_link_.begin();
       i != to_copy.circular_link_.end(); i++)
     circular_link_.push_back(CopyAsChild(**i));
+}
 
-  // Copy the sibling chain for qnodes
-  if (type_ == qnode) {
-    PQNode *current, *last;
-    // Pointers to nodes we are going to copy
-    PQNode *curCopy, *lastCopy, *nextCopy;
-    endmost_children_[0] = CopyAsChild(*to_copy.endmost_children_[0]);
-    curCopy = to_copy.endmost_children_[0];
-    lastCopy = NULL;
-    last = endmost_children_[0];
-
-    // Get all the intermediate children
+QNode::QNode(const QNode& to_copy, PQNodePool* pool)
+    : PQInternalNode(to_copy, pool) {
+  pseudo_neighbors_[0] = NULL;
+  pseudo_neighbors_[1] = NULL;
+
+  // Copy the sibling chain
+  PQNode *current, *last;
+  // Pointers to nodes we are going to copy
+  PQNode *curCopy, *lastCopy, *nextCopy;
+  endmost_children_[0] = CopyAsChild(*to_copy.endmost_children_[0]);
+  curCopy = to_copy.endmost_children_[0];
+  lastCopy = NULL;
+  last = endmost_children_[0];
+  current = last;
+
+  // Get all the intermediate children
+  nextCopy = curCopy->QNextChild(lastCopy);
+  while (nextCopy != NULL) {
+    lastCopy = curCopy;
+    curCopy  = nextCopy;
+    current  = CopyAsChild(*curCopy);
+    current->AddImmediateSibling(last);
+    last->AddImmediateSibling(current);
+    last = current;
     nextCopy = curCopy->QNextChild(lastCopy);
-    while (nextCopy != NULL) {
-      lastCopy = curCopy;
-      curCopy  = nextCopy;
-      current  = CopyAsChild(*curCopy);
-      current->AddImmediateSibling(last);
-      last->AddImmediateSibling(current);
-      last = current;
-      nextCopy = curCopy->QNextChild(lastCopy);
-    }
-
-    // Now set our last endmost_children_ pointer to our last child
-    endmost_children_[1] = current;
   }
-}
 
-PQNode& PQNode::operator=(const PQNode& to_copy) {
-  // Check for self copy
-  if (&to_copy == this)
-    return *this;
-  Copy(to_copy);
-  // Return ourself for chaining.
-  return *this;
+  // Now set our last endmost_children_ pointer to our last child
+  endmost_children_[1] = current;
 }
 
 void PQNode::LabelAsFull() {
-  label_ = full;
+  SetLabel(full);
   if (parent_)
     parent_->full_children_.insert(this);
 }
@@ -143,30 +290,31 @@ PQNode* PQNode::QNextChild(PQNode *last) const {
   }
 }
 
-void PQNode::ReplaceChild(PQNode* old_child, PQNode* new_child) {
-  if (type_ == pnode) {
-    ReplaceCircularLink(old_child, new_child);
+void PQInternalNode::ReplaceChild(PQNode* old_child, PQNode* new_child) {
+  if (Type() == pnode) {
+    AsPNode()->ReplaceCircularLink(old_child, new_child);
   } else {  // qnode
     for (int i = 0; i < 2 && old_child->immediate_siblings_[i]; ++i) {
       PQNode *sibling = old_child->immediate_siblings_[i];
       sibling->ReplaceImmediateSibling(old_child, new_child);
     }
-    ReplaceEndmostChild(old_child, new_child);
+    AsQNode()->ReplaceEndmostChild(old_child, new_child);
   }
   new_child->parent_ = old_child->parent_;
-  if (new_child->label_ == partial)
+  if (new_child->Label() == partial)
     new_child->parent_->partial_children_.insert(new_child);
-  if (new_child->label_ == full)
+  if (new_child->Label() == full)
     new_child->parent_->full_children_.insert(new_child);
 }
 
 // Removes this node from a q-parent and puts toInsert in it's place
 void PQNode::SwapQ(PQNode *toInsert) {
-  toInsert->pseudochild_ = pseudochild_;
+  toInsert->SetPseudochild(IsPseudochild());
   toInsert->ClearImmediateSiblings();
+  QNode* parent = parent_->AsQNode();
   for (int i = 0; i < 2; ++i) {
-    if (parent_->endmost_children_[i] == this)
-      parent_->endmost_children_[i] = toInsert;
+    if (parent->endmost_children_[i] == this)
+      parent->endmost_children_[i] = toInsert;
     if (immediate_siblings_[i])
       immediate_siblings_[i]->ReplaceImmediateSibling(this, toInsert);
   }
@@ -182,79 +330,84 @@ PQNode* PQNode::Parent() const {
   return NULL;
 }
 
-PQNode::PQNode(int value) {
-  leaf_value_             = value;
-  type_                  = leaf;
+PQNode::PQNode(PQNode_types type) {
+  flags_                 = type;
   parent_                = NULL;
-  label_                 = empty;
-  mark_                  = unmarked;
-  pertinent_child_count  = 0;
   pertinent_leaf_count   = 0;
-  endmost_children_[0] = NULL;
-  endmost_children_[1] = NULL;
   ClearImmediateSiblings();
-  ForgetChildren();
 }
 
-PQNode::PQNode() {
-  pseudonode_ = false;
-  parent_ = NULL;
-  label_ = empty;
-  mark_ = unmarked;
+PQLeaf::PQLeaf(int value) : PQNode(leaf) {
+  leaf_value_ = value;
+}
+
+PQInternalNode::PQInternalNode(PQNode_types type, PQNodePool* pool)
+    : PQNode(type),
+      full_children_(less<PQNode*>(), PQNodeAllocator<PQNode*>(pool)),
+      partial_children_(less<PQNode*>(), PQNodeAllocator<PQNode*>(pool)) {
   pertinent_child_count = 0;
-  pertinent_leaf_count = 0;
-  endmost_children_[0] = NULL;
-  endmost_children_[1] = NULL;
-  ClearImmediateSiblings();
+  leaf_count_ = 0;
+  hash_ = 0;
+  provenance_ = -1;
+}
+
+PNode::PNode(PQNodePool* pool)
+    : PQInternalNode(pnode, pool),
+      circular_link_(PQNodeAllocator<PQNode*>(pool)) {
+}
+
+QNode::QNode(PQNodePool* pool) : PQInternalNode(qnode, pool) {
+  pseudo_neighbors_[0] = NULL;
+  pseudo_neighbors_[1] = NULL;
   ForgetChildren();
 }
 
-PQNode::~PQNode() {
-  if (type_ == qnode) {
-    PQNode *last     = NULL;
-    PQNode *current  = endmost_children_[0];
-    while(current) {
-      PQNode *next = current->QNextChild(last);
-      delete last;
-      last    = current;
-      current = next;
-    }
-    delete last;
-  } else if (type_ == pnode) {
-    for (list<PQNode*>::iterator i = circular_link_.begin();
-         i != circular_link_.end(); i++)
-      delete *i;
-    circular_link_.clear();
+QNode::~QNode() {
+  PQNode *last     = NULL;
+  PQNode *current  = endmost_children_[0];
+  while(current) {
+    PQNode *next = current->QNextChild(last);
+    Delete(last, Pool());
+    last    = current;
+    current = next;
   }
+  Delete(last, Pool());
+}
+
+PNode::~PNode() {
+  for (PQNodeList::iterator i = circular_link_.begin();
+       i != circular_link_.end(); i++)
+    Delete(*i, Pool());
+  circular_link_.clear();
 }
 
-PQNode* PQNode::CircularChildWithLabel(PQNode_labels label) {
-  for (list<PQNode*>::iterator i = circular_link_.begin();
+PQNode* PNode::CircularChildWithLabel(PQNode_labels label) {
+  for (PQNodeList::iterator i = circular_link_.begin();
        i != circular_link_.end(); i++) {
-    if ((*i)->label_ == label)
+    if ((*i)->Label() == label)
       return *i;
   }
   return NULL;
 }
 
 
-PQNode* PQNode::EndmostChildWithLabel(PQNode_labels label) {
+PQNode* QNode::EndmostChildWithLabel(PQNode_labels label) {
   for (int i = 0; i < 2; ++i)
-    if (endmost_children_[i] && endmost_children_[i]->label_ == label)
+    if (endmost_children_[i] && endmost_children_[i]->Label() == label)
       return endmost_children_[i];
   return NULL;
 }
 
 PQNode* PQNode::ImmediateSiblingWithLabel(PQNode_labels label) {
   for (int i = 0; i < 2 && immediate_siblings_[i]; ++i)
-    if (immediate_siblings_[i]->label_ == label)
+    if (immediate_siblings_[i]->Label() == label)
       return immediate_siblings_[i];
   return NULL;
 }
 
 PQNode* PQNode::ImmediateSiblingWithoutLabel(PQNode_labels label) {
   for (int i = 0; i < 2 && immediate_siblings_[i]; ++i)
-    if (immediate_siblings_[i]->label_ != label)
+    if (immediate_siblings_[i]->Label() != label)
       return immediate_siblings_[i];
   return NULL;
 }
@@ -288,7 +441,7 @@ int PQNode::ImmediateSiblingCount() const {
   return count;
 }
 
-void PQNode::ReplaceEndmostChild(PQNode* old_child, PQNode* new_child) {
+void QNode::ReplaceEndmostChild(PQNode* old_child, PQNode* new_child) {
   for (int i = 0; i < 2; ++i) {
     if (endmost_children_[i] == old_child) {
       endmost_children_[i] = new_child;
@@ -304,39 +457,40 @@ void PQNode::ReplaceImmediateSibling(PQNode* old_child, PQNode* new_child) {
   new_child->immediate_siblings_[new_child->ImmediateSiblingCount()] = this;
 }
 
-void PQNode::ReplacePartialChild(PQNode* old_child, PQNode* new_child) {
+void PQInternalNode::ReplacePartialChild(PQNode* old_child, PQNode* new_child) {
   new_child->parent_ = this;
   partial_children_.insert(new_child);
   partial_children_.erase(old_child);
-  if (type_ == pnode) {
-    circular_link_.remove(old_child);
-    circular_link_.push_back(new_child);
+  if (Type() == pnode) {
+    PNode* pnode = AsPNode();
+    pnode->circular_link_.remove(old_child);
+    pnode->circular_link_.push_back(new_child);
   } else {
     old_child->SwapQ(new_child);
   }
 }
 
-void PQNode::ForgetChildren() {
+void QNode::ForgetChildren() {
   for (int i = 0; i < 2; ++i)
     endmost_children_[i] = NULL;
 }
 
-bool PQNode::ConsecutiveFullPartialChildren() {
+bool PQInternalNode::ConsecutiveFullPartialChildren() {
   // Trivial Case:
   if (full_children_.size() + partial_children_.size() <= 1)
     return true;
   // The strategy here is to count the number of each label of the siblings of
   // all of the full and partial children and see if the counts are correct.
-  map<PQNode_labels, int> counts;
-  for(set<PQNode*>::iterator it = full_children_.begin();
+  int counts[3] = {0, 0, 0};
+  for(PQNodeSet::iterator it = full_children_.begin();
       it != full_children_.end(); ++it) {
     for (int i = 0; i < 2 && (*it)->immediate_siblings_[i]; ++i)
-      counts[(*it)->immediate_siblings_[i]->label_]++;
+      counts[(*it)->immediate_siblings_[i]->Label()]++;
   }
-  for(set<PQNode*>::iterator it = partial_children_.begin();
+  for(PQNodeSet::iterator it = partial_children_.begin();
       it != partial_children_.end(); ++it) {
     for (int i = 0; i < 2 && (*it)->immediate_siblings_[i]; ++i)
-      counts[(*it)->immediate_siblings_[i]->label_]++;
+      counts[(*it)->immediate_siblings_[i]->Label()]++;
   }
   if (counts[partial] != partial_children_.size())
     return false;
@@ -347,38 +501,40 @@ bool PQNode::ConsecutiveFullPartialChildren() {
   return true;
 }
 
-void PQNode::MoveFullChildren(PQNode* new_node) {
-  for (set<PQNode*>::iterator i = full_children_.begin();
+void PNode::MoveFullChildren(PNode* new_node) {
+  for (PQNodeSet::iterator i = full_children_.begin();
        i != full_children_.end(); ++i) {
     circular_link_.remove(*i);
     new_node->circular_link_.push_back(*i);
     (*i)->parent_ = new_node;
+    leaf_count_ -= (*i)->LeafCount();
+    new_node->leaf_count_ += (*i)->LeafCount();
   }
 }
 
-void PQNode::ReplaceCircularLink(PQNode* old_child, PQNode* new_child) {
-  circular_link_.remove(old_child);
-  circular_link_.push_back(new_child);
+void PNode::ReplaceCircularLink(PQNode* old_child, PQNode* new_child) {
+  *find(circular_link_.begin(), circular_link_.end(), old_child) = new_child;
 }
 
 // FindLeaves, FindFrontier, Reset, and Print are very similar recursive
 // functions.  Each is a depth-first walk of the entire tree looking for data
 // at the leaves.
 // TODO: Could probably be implemented better using function pointers.
-void PQNode::FindLeaves(map<int, PQNode*> &leafAddress) {
-  if (type_ == leaf) {
-    leafAddress[leaf_value_] = this;
-  } else if (type_ == pnode) {
+void PQNode::FindLeaves(vector<PQLeaf*> &leaves) {
+  if (Type() == leaf) {
+    leaves.push_back(AsLeaf());
+  } else if (Type() == pnode) {
     // Recurse by asking each child in circular_link_ to find it's leaves.
-    for (list<PQNode*>::iterator i = circular_link_.begin();
-         i!=circular_link_.end(); i++)
-      (*i)->FindLeaves(leafAddress);
-  } else if (type_ == qnode) {
+    PNode* pnode = AsPNode();
+    for (PQNodeList::iterator i = pnode->circular_link_.begin();
+         i != pnode->circular_link_.end(); i++)
+      (*i)->FindLeaves(leaves);
+  } else if (Type() == qnode) {
     // Recurse by asking each child in my child list to find it's leaves.
     PQNode *last    = NULL;
-    PQNode *current = endmost_children_[0];
+    PQNode *current = AsQNode()->endmost_children_[0];
     while (current) {
-      current->FindLeaves(leafAddress);
+      current->FindLeaves(leaves);
       PQNode *next = current->QNextChild(last);
       last    = current;
       current = next;
@@ -387,15 +543,16 @@ void PQNode::FindLeaves(map<int, PQNode*> &leafAddress) {
 }
 
 void PQNode::FindFrontier(list<int> &ordering) {
-  if (type_ == leaf) {
-    ordering.push_back(leaf_value_);
-  } else if (type_ == pnode) {
-    for (list<PQNode*>::iterator i = circular_link_.begin();
-        i != circular_link_.end();i++)
+  if (Type() == leaf) {
+    ordering.push_back(AsLeaf()->leaf_value_);
+  } else if (Type() == pnode) {
+    PNode* pnode = AsPNode();
+    for (PQNodeList::iterator i = pnode->circular_link_.begin();
+        i != pnode->circular_link_.end();i++)
       (*i)->FindFrontier(ordering);
-  } else if (type_ == qnode) {
+  } else if (Type() == qnode) {
     PQNode *last    = NULL;
-    PQNode *current = endmost_children_[0];
+    PQNode *current = AsQNode()->endmost_children_[0];
     while (current) {
       current->FindFrontier(ordering);
       PQNode *next = current->QNextChild(last);
@@ -407,13 +564,14 @@ void PQNode::FindFrontier(list<int> &ordering) {
 
 // Resets a bunch of temporary variables after the reduce walks
 void PQNode::Reset() {
-  if (type_ == pnode) {
-    for (list<PQNode*>::iterator i = circular_link_.begin();
-         i != circular_link_.end(); i++)
+  if (Type() == pnode) {
+    PNode* pnode = AsPNode();
+    for (PQNodeList::iterator i = pnode->circular_link_.begin();
+         i != pnode->circular_link_.end(); i++)
       (*i)->Reset();
-  } else if (type_ == qnode) {
+  } else if (Type() == qnode) {
     PQNode *last    = NULL;
-    PQNode *current = endmost_children_[0];
+    PQNode *current = AsQNode()->endmost_children_[0];
     while (current) {
       current->Reset();
       PQNode *next = current->QNextChild(last);
@@ -422,38 +580,40 @@ void PQNode::Reset() {
     }
   }
 
-  full_children_.clear();
-  partial_children_.clear();
-  label_                 = empty;
-  mark_                  = unmarked;
-  pertinent_child_count = 0;
+  if (Type() != leaf) {
+    PQInternalNode* internal = AsInternal();
+    internal->full_children_.clear();
+    internal->partial_children_.clear();
+    internal->pertinent_child_count = 0;
+  }
+  // Clears the label, mark and pseudo flags, leaving only the type.
+  flags_                 = flags_ & kTypeMask;
   pertinent_leaf_count  = 0;
-  pseudochild_           = false;
-  pseudonode_            = false;
 }
 
 // Walks the tree from the top and prints the tree structure to the string out.
 // Used primarily for debugging purposes.
 void PQNode::Print(string *out) const {
-  if (type_ == leaf) {
-    char value_str[10];
-    sprintf(value_str, "%d", leaf_value_);
+  if (Type() == leaf) {
+    char value_str[12];
+    sprintf(value_str, "%d", AsLeaf()->leaf_value_);
     *out += value_str;
-  } else if (type_ == pnode) {
+  } else if (Type() == pnode) {
+    const PNode* pnode = AsPNode();
     *out += "(";
-    for (list<PQNode*>::const_iterator i = circular_link_.begin();
-         i != circular_link_.end(); i++) {
+    for (PQNodeList::const_iterator i = pnode->circular_link_.begin();
+         i != pnode->circular_link_.end(); i++) {
       (*i)->Print(out);
       // Add a space if there are more elements remaining.
-      if (++i != circular_link_.end())
+      if (++i != pnode->circular_link_.end())
         *out += " ";
       --i;
     }
     *out += ")";
-  } else if (type_ == qnode) {
+  } else if (Type() == qnode) {
     *out += "[";
     PQNode *last     = NULL;
-    PQNode *current  = endmost_children_[0];
+    PQNode *current  = AsQNode()->endmost_children_[0];
     while (current) {
       current->Print(out);
       PQNode *next = current->QNextChild(last);
@@ -469,14 +629,14 @@ void PQNode::Print(string *out) const {
 void PQNode::Identify() const {
   cout << "Node: " << this;
   cout << " Parent: " << parent_ << endl;
-  if (type_ == leaf) {
-    cout << "Type: leaf  Value: " << leaf_value_ << endl;
+  if (Type() == leaf) {
+    cout << "Type: leaf  Value: " << AsLeaf()->leaf_value_ << endl;
   } else {
     string value;
     Print(&value);
-    if (type_ == pnode)
+    if (Type() == pnode)
       cout << "Type: pnode Value: " << value << endl;
-    if (type_ == qnode)
+    if (Type() == qnode)
       cout << "Type: qnode Value: " << value << endl;
   }
 }
@@ -486,7 +646,7 @@ void PQNode::Identify() const {
 /***** QNodeChildrenIterator class *****/
 
 QNodeChildrenIterator::QNodeChildrenIterator(
-    PQNode* parent, PQNode* begin_side) {
+    QNode* parent, PQNode* begin_side) {
   parent_ = parent;
   Reset(begin_side);
 }
@@ -18,18 +18,45 @@
 #ifndef PQNODE_H
 #define PQNODE_H
 
+#include <stdint.h>
 #include <list>
 #include <map>
 #include <set>
 #include <string>
 #include <vector>
+#include "pqnodepool.h"
 using namespace std;
 
 
+class PQNode;
+class PQLeaf;
+class PQInternalNode;
+class PNode;
+class QNode;
+
+// The containers inside nodes draw from their tree's PQNodePool.
+typedef set<PQNode*, less<PQNode*>, PQNodeAllocator<PQNode*> > PQNodeSet;
+typedef list<PQNode*, PQNodeAllocator<PQNode*> > PQNodeList;
+
+// PQNode holds the fields shared by every kind of node, which is everything a
+// leaf needs apart from its value.  Each kind of node has its own layout:
+// PQLeaf adds the value, PQInternalNode the bookkeeping of pertinent children
+// shared by P-nodes and Q-nodes, and PNode and QNode their children.  Leaves
+// make up most of a tree, so they carry nothing else.
+//
+// There are no virtual methods.  Code that knows which kind of node it holds
+// uses the derived class directly, everything else switches on Type() and
+// uses one of the As*() casts.
+//
+// Nodes are allocated from their tree's PQNodePool with new (pool) and freed
+// with PQNode::Delete().
 class PQNode {
  // PQNodes are not exposed by pqtrees, they are internally used only.
  friend class PQTree;
   friend class QNodeChildrenIterator;
+  friend class PQInternalNode;
+  friend class PNode;
+  friend class QNode;
 
  public:
   // Enum types we use throughout.
@@ -38,45 +65,64 @@ class PQNode {
   enum PQNode_labels {empty, full, partial};
 
   // Returns the type of the current node, an enum of type PQNode_types.
-  PQNode_types Type();
+  PQNode_types Type() const {
+    return PQNode_types(flags_ & kTypeMask);
+  }
 
   // Returns the value of the leaf node.  Fails assertion if not leaf node.
   int LeafValue();
 
+  // Returns the number of leaves in the subtree rooted at this node, 1 for a
+  // leaf.
+  int LeafCount() const;
+
   // Returns all of this Node's children if it has any.
   // Return Value is the |children| argument.
   void Children(vector<PQNode*> *children);
 
- private:
-  /***** Used by P Nodes only *****/
+  // Returns a hash of the frontiers the subtree rooted at this node admits,
+  // which does not change when the children of a P-Node are reordered or a
+  // Q-Node is reversed: subtrees which admit the same frontiers hash the
+  // same.  Internal nodes keep their hash and the reductions forget the
+  // hashes of the nodes they change, so this only recomputes those, taking
+  // time linear in their number of children.
+  uint64_t CanonicalHash();
 
-  // A doubly-linked of links which form the children of a p-node, the order
-  // of the list is arbitrary.
-  list<PQNode*> circular_link_;
+ protected:
+  explicit PQNode(PQNode_types type);
 
-  // A count of the number of children used by a node.
-  int ChildCount();
-
-  // Returns the first |circular_link_| child with a given label or NULL.
-  PQNode* CircularChildWithLabel(PQNode_labels label);
+  // Copies the type, label, mark and counters of |to_copy|, but none of its
+  // pointers.
+  PQNode(const PQNode& to_copy);
 
-  // Moves the full children of this node to children of |new_node|.
-  void MoveFullChildren(PQNode* new_node);
+  // Nodes only live in pools.  There is no usual operator delete, nodes are
+  // destroyed through Delete().
+  static void* operator new(size_t size, PQNodePool* pool);
+  static void operator delete(void* block, PQNodePool* pool);
 
-  // Replaces the circular_link pointer of |old_child| with |new_child|.
-  void ReplaceCircularLink(PQNode* old_child, PQNode* new_child);
+ private:
+  // Casts this node to the layout of its type.  Each asserts on Type().
+  PQLeaf* AsLeaf();
+  PQInternalNode* AsInternal();
+  PNode* AsPNode();
+  QNode* AsQNode();
+  const PQLeaf* AsLeaf() const;
+  const PNode* AsPNode() const;
+  const QNode* AsQNode() const;
 
-  /***** Used by Q Nodes only *****/
+  // Deletes |node| using the destructor of its type and returns it to |pool|.
+  // Deleting a P-node or a Q-node deletes its children as well.
+  static void Delete(PQNode* node, PQNodePool* pool);
 
-  // A set containing the two endmost children of a Q-node
-  PQNode *endmost_children_[2];
-  PQNode *pseudo_neighbors_[2];
+  // Returns a deep copy of this node and everything below it, allocated from
+  // |pool|.
+  PQNode* DeepCopy(PQNodePool* pool) const;
 
-  // Boolean indicating whether or not this is a pseudonode/child.
-  bool pseudonode_, pseudochild_;
+  // Copies the label, mark, pertinent leaf count and pseudo flags of
+  // |to_copy|, which must have the same type.
+  void CopyScalars(const PQNode& to_copy);
 
-  // Returns the first endmost child with a given label or NULL.
-  PQNode* EndmostChildWithLabel(PQNode_labels label);
+  /***** Used by children of Q Nodes *****/
 
   // Returns the first immediate sibling with a given label or NULL.
   PQNode* ImmediateSiblingWithLabel(PQNode_labels label);
@@ -96,78 +142,87 @@ class PQNode {
   // Returns the number of immediate siblings this node has (0, 1, or 2).
   int ImmediateSiblingCount() const;
 
-  // Replaces the |endmost_children_| pointer to |old_child| with |new_child|.
-  void ReplaceEndmostChild(PQNode* old_child, PQNode* new_child);
-
   // Replaces the immediate sibling of |old_child| with |new_child|.
   void ReplaceImmediateSibling(PQNode* old_child, PQNode* new_child);
 
-  // Replaces the partial child |old_child| with |new_child|.
-  void ReplacePartialChild(PQNode* old_child, PQNode* new_child);
-
-  // Forces a Q-Node to "forget" it's pointers to it's endmost children.
-  // Useful if you want to delete a Q-Node but not it's children.
-  void ForgetChildren();
-
-  // Returns true if all of the full and partial children of this node are
-  // consecutive, with the partial children on the outside.
-  bool ConsecutiveFullPartialChildren();
-
-  /***** Used by Both Node types *****/
-
-  // A set containing all the children of a node currently known to be full.
-  set<PQNode*> full_children_;
-
-  // A set containing all the children of a node currently known to be partial.
-  set<PQNode*> partial_children_;
-
-  // Only children of Q nodes have more than 0 immediate siblings.  Stores the
-  // siblings to either side of this node in its parent's children.  One or both
-  // siblings may be NULL.
-  PQNode *immediate_siblings_[2];
+  /***** Used by all node types *****/
+
+  // Layout of |flags_|.
+  enum {
+    kTypeMask = 0x03,
+    kMarkShift = 2,
+    kMarkMask = 0x0c,
+    kLabelShift = 4,
+    kLabelMask = 0x30,
+    kPseudochildShift = 6,
+    kPseudochild = 0x40,
+    // Only set on Q-nodes, see QNode::IsPseudonode().
+    kPseudonodeShift = 7,
+    kPseudonode = 0x80
+  };
 
   // Label is an indication of whether the node is empty, full, or partial
-  enum PQNode_labels label_;
+  PQNode_labels Label() const {
+    return PQNode_labels((flags_ & kLabelMask) >> kLabelShift);
+  }
+  void SetLabel(PQNode_labels label) {
+    flags_ = (flags_ & ~kLabelMask) | (label << kLabelShift);
+  }
+
+  // Returns a mask with the bit LabelBit(Label()) set, so that the labels of
+  // several nodes can be tested at once by or-ing their masks together.
+  static int LabelBit(PQNode_labels label) {
+    return 1 << label;
+  }
+  int LabelBit() const {
+    return 1 << Label();
+  }
 
   // Mark is a designation used during the first pass of the reduction
   // algorithm.  Every node is initially unmarked.  It is marked
   // queued when it is placed onto the queue during the bubbling up.
   // It is marked either blocked or unblocked when it is processed.  Blocked
   // nodes can become unblocked if their siblings become unblocked.
-  enum PQNode_marks mark_;
-
-  // type is a designation telling whether the node is a leaf, P, or Q.
-  enum PQNode_types type_;
+  PQNode_marks Mark() const {
+    return PQNode_marks((flags_ & kMarkMask) >> kMarkShift);
+  }
+  void SetMark(PQNode_marks mark) {
+    flags_ = (flags_ & ~kMarkMask) | (mark << kMarkShift);
+  }
+
+  // Whether or not this is a pseudochild.
+  bool IsPseudochild() const {
+    return flags_ & kPseudochild;
+  }
+  void SetPseudochild(bool pseudochild) {
+    flags_ = (flags_ & ~kPseudochild) | (pseudochild << kPseudochildShift);
+  }
+
+  // Fields are ordered so that the flags, the parent and the siblings, which
+  // Bubble() and the templates read for every neighbour, share the first 32
+  // bytes of the node, and a PQLeaf packs into 40 bytes.
 
   // the immediate ancestor of a node.  This field is always
   // valid for children of P-nodes and for endmost children of Q-nodes
-  PQNode* parent_;
+  PQInternalNode* parent_;
 
-  // A count of the number of pertinent children currently possessed by a node
-  int pertinent_child_count;
+  // Only children of Q nodes have more than 0 immediate siblings.  Stores the
+  // siblings to either side of this node in its parent's children.  One or both
+  // siblings may be NULL.
+  PQNode *immediate_siblings_[2];
+
+  // The type, mark and label of the node and its pseudo flags, see the layout
+  // above.  type is a designation telling whether the node is a leaf, P, or Q.
+  unsigned char flags_;
 
   // A count of the number of pertinent leaves currently possessed by a node
   int pertinent_leaf_count;
 
-  // The value of the PQNode if it is a leaf.
-  int leaf_value_;
-
-  // Makes a deep copy of a node, sets this to be it's parent and returns copy.
-  PQNode* CopyAsChild(const PQNode& to_copy);
-
-  // Makes a deep copy of copy.
-  void Copy(const PQNode& copy);
-
-  // deep assignment operator
-  PQNode& operator=(const PQNode& to_copy);
-
   // Return the next child in the immediate_siblings chain given a last pointer
   // if last pointer is null, will return the first sibling.  Behavior similar
   // to an iterator.
   PQNode* QNextChild(PQNode *last) const;
 
-  void ReplaceChild(PQNode* old_child, PQNode* new_child);
-
   // removes this node from a q-parent and puts toInsert in it's place
   void SwapQ(PQNode *toInsert);
 
@@ -175,23 +230,11 @@ class PQNode {
   // child of a Q-Node, in which case returns NULL)
   PQNode* Parent() const;
 
-  // deep copy constructor
-  PQNode(const PQNode& to_copy);
-
-  // Constructor for a leaf PQNode.
-  PQNode(int value);
-
-  // Constructor for non-leaf PQNode.
-  PQNode();
-
-  // Deep destructor.
-  ~PQNode();
-
   // Label's this node as full, updating the parent if needed.
   void LabelAsFull();
 
-  // Walks the tree to build a map from values to leaf pointers.
-  void FindLeaves(map<int, PQNode*> &leafAddress);
+  // Walks the tree appending every leaf to |leaves|.
+  void FindLeaves(vector<PQLeaf*> &leaves);
 
   // Walks the tree to find it's Frontier, returns one possible ordering.
   void FindFrontier(list<int> &ordering);
@@ -207,6 +250,152 @@ class PQNode {
   void Identify() const;
 };
 
+class PQLeaf : public PQNode {
+  friend class PQNode;
+  friend class PQTree;
+
+ private:
+  // Constructor for a leaf PQNode.
+  explicit PQLeaf(int value);
+
+  // The value of the PQNode if it is a leaf.
+  int leaf_value_;
+};
+
+// The bookkeeping shared by P-nodes and Q-nodes.
+class PQInternalNode : public PQNode {
+  friend class PQNode;
+  friend class PQTree;
+  friend class QNodeChildrenIterator;
+
+ protected:
+  PQInternalNode(PQNode_types type, PQNodePool* pool);
+
+  // Copies everything but the children and the sets of pertinent children
+  // into a node allocated from |pool|.
+  PQInternalNode(const PQInternalNode& to_copy, PQNodePool* pool);
+
+  // Returns the pool this node and its children are allocated from.
+  PQNodePool* Pool() const;
+
+  // Makes a deep copy of a node, sets this to be it's parent and returns copy.
+  PQNode* CopyAsChild(const PQNode& to_copy);
+
+  // A set containing all the children of a node currently known to be full.
+  PQNodeSet full_children_;
+
+  // A set containing all the children of a node currently known to be partial.
+  PQNodeSet partial_children_;
+
+  // A count of the number of pertinent children currently possessed by a node
+  int pertinent_child_count;
+
+  // The number of leaves below this node.  The templates keep it up to date
+  // by adjusting only the nodes they restructure: a reduction never changes
+  // the leaf count of its pertinent root, so no other node is affected.
+  int leaf_count_;
+
+  // The CanonicalHash() of this node, or 0 if it has to be recomputed.  A
+  // node whose hash is 0 has ancestors whose hashes are all 0 as well.
+  uint64_t hash_;
+
+  // The position in the reduction history of the last reduction to change
+  // this node while its tree was explaining conflicts, or -1.  See
+  // PQTree::SetExplainConflicts().
+  int provenance_;
+
+ private:
+  // Replaces |old_child| with |new_child| among this node's children.
+  void ReplaceChild(PQNode* old_child, PQNode* new_child);
+
+  // Replaces the partial child |old_child| with |new_child|.
+  void ReplacePartialChild(PQNode* old_child, PQNode* new_child);
+
+  // Returns true if all of the full and partial children of this node are
+  // consecutive, with the partial children on the outside.
+  bool ConsecutiveFullPartialChildren();
+};
+
+class PNode : public PQInternalNode {
+  friend class PQNode;
+  friend class PQInternalNode;
+  friend class PQTree;
+
+ private:
+  explicit PNode(PQNodePool* pool);
+
+  // deep copy constructor
+  PNode(const PNode& to_copy, PQNodePool* pool);
+
+  // Deep destructor.
+  ~PNode();
+
+  // A doubly-linked of links which form the children of a p-node, the order
+  // of the list is arbitrary.
+  PQNodeList circular_link_;
+
+  // A count of the number of children used by a node.
+  int ChildCount();
+
+  // Returns the first |circular_link_| child with a given label or NULL.
+  PQNode* CircularChildWithLabel(PQNode_labels label);
+
+  // Moves the full children of this node to children of |new_node|, moving
+  // their leaf count with them.
+  void MoveFullChildren(PNode* new_node);
+
+  // Replaces the circular_link pointer of |old_child| with |new_child|, in
+  // place so that the order of the other children is kept.
+  void ReplaceCircularLink(PQNode* old_child, PQNode* new_child);
+};
+
+class QNode : public PQInternalNode {
+  friend class PQNode;
+  friend class PQInternalNode;
+  friend class PQTree;
+  friend class QNodeChildrenIterator;
+
+ private:
+  explicit QNode(PQNodePool* pool);
+
+  // deep copy constructor
+  QNode(const QNode& to_copy, PQNodePool* pool);
+
+  // Deep destructor.
+  ~QNode();
+
+  // A set containing the two endmost children of a Q-node
+  PQNode *endmost_children_[2];
+  PQNode *pseudo_neighbors_[2];
+
+  // Whether or not this is a pseudonode.
+  bool IsPseudonode() const {
+    return flags_ & kPseudonode;
+  }
+  void SetPseudonode(bool pseudonode) {
+    flags_ = (flags_ & ~kPseudonode) | (pseudonode << kPseudonodeShift);
+  }
+
+  // Returns the first endmost child with a given label or NULL.
+  PQNode* EndmostChildWithLabel(PQNode_labels label);
+
+  // Returns the LabelBit()s of both endmost children or-ed together.
+  int EndmostLabelBits() const {
+    int bits = 0;
+    for (int i = 0; i < 2; ++i)
+      if (endmost_children_[i])
+        bits |= endmost_children_[i]->LabelBit();
+    return bits;
+  }
+
+  // Replaces the |endmost_children_| pointer to |old_child| with |new_child|.
+  void ReplaceEndmostChild(PQNode* old_child, PQNode* new_child);
+
+  // Forces a Q-Node to "forget" it's pointers to it's endmost children.
+  // Useful if you want to delete a Q-Node but not it's children.
+  void ForgetChildren();
+};
+
 // Q-Nodes have an unusual structure that makes iterating over their children
 // slightly tricky.  This class makes the iterating much simpler.
 //
@@ -224,7 +413,7 @@ class QNodeChildrenIterator {
  public:
   // Creates an iterator of the children of |parent| optionally forcing the
   // iteration to start on the |begin_side|.
-  QNodeChildrenIterator(PQNode* parent, PQNode* begin_side=NULL);
+  QNodeChildrenIterator(QNode* parent, PQNode* begin_side=NULL);
 
   // Returns a pointer to the current PQNode child in the list.
   PQNode* Current();
@@ -245,7 +434,7 @@ class QNodeChildrenIterator {
  private:
   // Next() helper method to deal with pseudonodes.
   void NextPseudoNodeSibling();
-  PQNode* parent_;
+  QNode* parent_;
   PQNode* current_;
   PQNode* next_;
   PQNode* prev_;
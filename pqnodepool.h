@@ -0,0 +1,216 @@
+// Per-tree memory pool for PQNodes and the containers inside them.
+//
+// Every PQTree owns a PQNodePool.  Its nodes, and the list and set nodes of
+// their children, are carved out of large slabs and recycled through one free
+// list per block size instead of being returned to the heap.  Once a tree has
+// been through a few reductions its free lists hold enough blocks for the
+// nodes a reduction creates, so reducing it performs no heap allocations at
+// all.  The slabs are only released when the pool, and so the tree, dies,
+// which also reclaims nodes orphaned by a failed reduction.  Nothing in a pool
+// owns memory outside it, so a pool may be released without destroying the
+// objects in it.
+//
+// PQNodeAllocator<T> adapts a pool to the standard allocator interface so
+// that the containers inside PQNodes draw from their tree's pool.
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PQNODEPOOL_H
+#define PQNODEPOOL_H
+
+#include <assert.h>
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+class PQNodePool {
+ public:
+  PQNodePool() : cursor_(NULL), remaining_(0), capacity_(0) {
+    for (int i = 0; i < kClasses; ++i)
+      free_lists_[i] = NULL;
+  }
+
+  ~PQNodePool() {
+    for (size_t i = 0; i < slabs_.size(); ++i)
+      ::operator delete(slabs_[i]);
+  }
+
+  // Returns a block of at least |bytes| bytes.  Blocks too large for the free
+  // lists get a block of their own.
+  void* Allocate(size_t bytes) {
+    if (bytes > kLargestBlock)
+      return AllocateBlock(bytes);
+    int size_class = SizeClass(bytes);
+    FreeBlock* block = free_lists_[size_class];
+    if (block) {
+      free_lists_[size_class] = block->next;
+      return block;
+    }
+    size_t rounded = (size_class + 1) * kAlignment;
+    if (remaining_ < rounded) {
+      cursor_ = static_cast<char*>(::operator new(kSlabSize));
+      slabs_.push_back(cursor_);
+      remaining_ = kSlabSize;
+      capacity_ += kSlabSize;
+    }
+    void* out = cursor_;
+    cursor_ += rounded;
+    remaining_ -= rounded;
+    return out;
+  }
+
+  // Returns a dedicated block of |bytes| bytes which lives as long as the
+  // pool, for laying out many nodes of the same size at once.  Each of them
+  // may later be passed to Free() like a block from Allocate().
+  void* AllocateBlock(size_t bytes) {
+    char* block = static_cast<char*>(::operator new(bytes));
+    slabs_.push_back(block);
+    capacity_ += bytes;
+    return block;
+  }
+
+  // Returns a block obtained from Allocate(|bytes|) to its free list.  Blocks
+  // too large for the free lists are only reclaimed with the pool.
+  void Free(void* block, size_t bytes) {
+    if (!block || bytes > kLargestBlock)
+      return;
+    int size_class = SizeClass(bytes);
+    FreeBlock* freed = static_cast<FreeBlock*>(block);
+    freed->next = free_lists_[size_class];
+    free_lists_[size_class] = freed;
+  }
+
+  // Returns the number of bytes of slab memory held by the pool.
+  size_t Capacity() const {
+    return capacity_;
+  }
+
+  // Exchanges the memory held by this pool and |other|.  Objects keep
+  // pointing at the pool they were allocated from, so this is only useful for
+  // moving everything to a pool that is about to be released, leaving this
+  // one empty for a fresh copy of the objects.
+  void Swap(PQNodePool* other) {
+    for (int i = 0; i < kClasses; ++i)
+      swap(free_lists_[i], other->free_lists_[i]);
+    slabs_.swap(other->slabs_);
+    swap(cursor_, other->cursor_);
+    swap(remaining_, other->remaining_);
+    swap(capacity_, other->capacity_);
+  }
+
+ private:
+  enum {
+    kAlignment = 8,
+    kClasses = 32,
+    kLargestBlock = kAlignment * kClasses,
+    kSlabSize = 64 * 1024
+  };
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  static int SizeClass(size_t bytes) {
+    return bytes ? (bytes - 1) / kAlignment : 0;
+  }
+
+  // Pools hand out pointers into themselves, they cannot be copied.
+  PQNodePool(const PQNodePool&);
+  PQNodePool& operator=(const PQNodePool&);
+
+  // Free blocks of (i + 1) * kAlignment bytes, chained through their first
+  // word.
+  FreeBlock* free_lists_[kClasses];
+
+  // Every slab and block allocated so far, and the unused tail of the last
+  // slab.
+  vector<char*> slabs_;
+  char* cursor_;
+  size_t remaining_;
+  size_t capacity_;
+};
+
+template <class T>
+class PQNodeAllocator {
+ public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class U>
+  struct rebind {
+    typedef PQNodeAllocator<U> other;
+  };
+
+  explicit PQNodeAllocator(PQNodePool* pool) : pool_(pool) {}
+
+  template <class U>
+  PQNodeAllocator(const PQNodeAllocator<U>& other) : pool_(other.Pool()) {}
+
+  T* allocate(size_t n, const void* = 0) {
+    return static_cast<T*>(pool_->Allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    pool_->Free(p, n * sizeof(T));
+  }
+
+  void construct(T* p, const T& value) {
+    new (p) T(value);
+  }
+
+  void destroy(T* p) {
+    p->~T();
+  }
+
+  size_t max_size() const {
+    return size_t(-1) / sizeof(T);
+  }
+
+  T* address(T& value) const {
+    return &value;
+  }
+
+  const T* address(const T& value) const {
+    return &value;
+  }
+
+  PQNodePool* Pool() const {
+    return pool_;
+  }
+
+ private:
+  PQNodePool* pool_;
+};
+
+template <class T, class U>
+bool operator==(const PQNodeAllocator<T>& a, const PQNodeAllocator<U>& b) {
+  return a.Pool() == b.Pool();
+}
+
+template <class T, class U>
+bool operator!=(const PQNodeAllocator<T>& a, const PQNodeAllocator<U>& b) {
+  return a.Pool() != b.Pool();
+}
+
+#endif
@@ -16,6 +16,8 @@
 #include <assert.h>
 #include <iostream>
 #include <set>
+#include <string>
+#include "keyedpqtree.h"
 #include "pqnode.h"
 #include "pqtree.h"
 
@@ -159,6 +161,39 @@ void TestBed2() {
   ReduceBy(S, &tree);
 }
 
+void TestBed3() {
+  // The same kind of reductions, but over string keys.
+  const char* names[] = {"ant", "bee", "cat", "dog", "eel", "fox"};
+  set<string> S(names, names + 6);
+  KeyedPQTree<string> tree(S);
+
+  S.clear();
+  S.insert("dog");
+  S.insert("ant");
+  assert(tree.Reduce(S));
+  S.insert("fox");
+  assert(tree.Reduce(S));
+  S.clear();
+  S.insert("fox");
+  S.insert("eel");
+  assert(tree.Reduce(S));
+  cout << tree.Tree().Print() << endl;
+
+  list<string> frontier = tree.Frontier();
+  for (list<string>::iterator i = frontier.begin(); i != frontier.end(); ++i)
+    cout << *i << " ";
+  cout << endl;
+
+  // Keys outside the tree are rejected without invalidating it.
+  S.insert("gnu");
+  assert(!tree.Reduce(S));
+  S.clear();
+  S.insert("bee");
+  S.insert("cat");
+  assert(tree.Reduce(S));
+  cout << tree.Tree().Print() << endl;
+}
+
 int main(int argc, char **argv) {
   cout << "Test Bed 1:" << endl;
   cout << "-----------------" << endl;
@@ -167,4 +202,8 @@ int main(int argc, char **argv) {
   cout << "Test Bed 2:" << endl;
   cout << "-----------------" << endl;
   TestBed2();
+  cout << endl << endl;
+  cout << "Test Bed 3:" << endl;
+  cout << "-----------------" << endl;
+  TestBed3();
 }
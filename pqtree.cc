@@ -16,38 +16,174 @@
 #include "pqtree.h"
 
 #include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+// Orders the positions of sets in ReduceAllSkipping() by their sizes.
+struct BySetSize {
+  explicit BySetSize(const vector<const set<int>*>& sets) : sets_(sets) {}
+  bool operator()(int a, int b) const {
+    return sets_[a]->size() < sets_[b]->size();
+  }
+  const vector<const set<int>*>& sets_;
+};
+
+// Orders the positions of sets in ReduceAllSkipping() by decreasing weight.
+struct ByWeight {
+  explicit ByWeight(const vector<double>& weights) : weights_(weights) {}
+  bool operator()(int a, int b) const {
+    return weights_[a] > weights_[b];
+  }
+  const vector<double>& weights_;
+};
+
+// Hashes the values of |S| in order, to find duplicate sets.
+uint64_t SetHash(const set<int>& S) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (set<int>::const_iterator i = S.begin(); i != S.end(); ++i)
+    hash = (hash ^ unsigned(*i)) * 0x100000001b3ULL;
+  return hash;
+}
+
+// Returns the representative of |i| among the disjoint sets of |parent|,
+// halving the paths it follows.
+int FindSet(vector<int>* parent, int i) {
+  while ((*parent)[i] != i) {
+    (*parent)[i] = (*parent)[(*parent)[i]];
+    i = (*parent)[i];
+  }
+  return i;
+}
+
+}  // namespace
 
 PQTree::PQTree(const PQTree& to_copy) {
   CopyFrom(to_copy);
 }
 
 PQTree& PQTree::operator=(const PQTree& to_copy) {
-  if (&to_copy != this)
+  if (&to_copy != this) {
+    PQNode::Delete(root_, &pool_);
     CopyFrom(to_copy);
+  }
   return *this;
 }
 
 void PQTree::CopyFrom(const PQTree& to_copy) {
-  root_                 = new PQNode(*to_copy.root_);
+  root_                 = to_copy.root_->DeepCopy(&pool_);
   block_count_   = to_copy.block_count_;
   blocked_nodes_ = to_copy.blocked_nodes_;
   invalid_         = to_copy.invalid_;
   off_the_top_   = to_copy.off_the_top_;
   pseudonode_         = NULL;
   reductions_         = to_copy.reductions_;
+  record_reductions_  = to_copy.record_reductions_;
+  explain_conflicts_  = to_copy.explain_conflicts_;
+  explainable_        = to_copy.explainable_;
+  has_conflict_       = to_copy.has_conflict_;
+  first_explained_    = to_copy.first_explained_;
+  provenance_begins_  = to_copy.provenance_begins_;
+  provenance_deps_    = to_copy.provenance_deps_;
+  conflict_           = to_copy.conflict_;
+  queue_head_         = 0;
+  frontier_valid_     = false;
+  dirty_ranges_.clear();
+  pertinent_root_     = NULL;
+  CopyFrontierCount(to_copy);
+
+  vector<PQLeaf*> leaves;
+  root_->FindLeaves(leaves);
+  IndexLeaves(leaves);
+}
 
+void PQTree::IndexLeaves(const vector<PQLeaf*>& leaves) {
+  leaf_block_ = NULL;
   leaf_address_.clear();
-  root_->FindLeaves(leaf_address_);
+  sparse_leaf_address_.clear();
+  int min_value = 0, max_value = -1;
+  for (int i = 0; i < leaves.size(); ++i) {
+    int value = leaves[i]->leaf_value_;
+    if (i == 0 || value < min_value)
+      min_value = value;
+    if (i == 0 || value > max_value)
+      max_value = value;
+  }
+  leaf_count_ = leaves.size();
+  dense_leaf_address_ =
+      double(max_value) - min_value < 2.0 * leaves.size();
+  leaf_address_base_ = min_value;
+  if (dense_leaf_address_) {
+    leaf_address_.resize(max_value - min_value + 1, NULL);
+    for (int i = 0; i < leaves.size(); ++i)
+      leaf_address_[leaves[i]->leaf_value_ - min_value] = leaves[i];
+  } else {
+    for (int i = 0; i < leaves.size(); ++i)
+      sparse_leaf_address_[leaves[i]->leaf_value_] = leaves[i];
+  }
+}
+
+void PQTree::IndexLeaf(PQLeaf* leaf) {
+  int value = leaf->leaf_value_;
+  if (dense_leaf_address_) {
+    unsigned int offset = unsigned(value) - unsigned(leaf_address_base_);
+    if (offset < leaf_address_.size()) {
+      leaf_address_[offset] = leaf;
+      return;
+    }
+    if (leaf_address_.empty()) {
+      leaf_address_base_ = value;
+      leaf_address_.push_back(leaf);
+      return;
+    }
+    double min_value = min(value, leaf_address_base_);
+    double max_value = max(double(value),
+                           double(leaf_address_base_) + leaf_address_.size() - 1);
+    if (max_value - min_value < 2.0 * leaf_count_) {
+      if (value < leaf_address_base_) {
+        leaf_address_.insert(leaf_address_.begin(), leaf_address_base_ - value,
+                             NULL);
+        leaf_address_base_ = value;
+      } else {
+        leaf_address_.resize(value - leaf_address_base_ + 1, NULL);
+      }
+      leaf_address_[value - leaf_address_base_] = leaf;
+      return;
+    }
+    // Too sparse now, move everything to the map.
+    for (int i = 0; i < leaf_address_.size(); ++i) {
+      if (leaf_address_[i])
+        sparse_leaf_address_[leaf_address_base_ + i] = leaf_address_[i];
+    }
+    leaf_address_.clear();
+    dense_leaf_address_ = false;
+  }
+  sparse_leaf_address_[value] = leaf;
+}
+
+PQLeaf* PQTree::LeafAddress(int value) const {
+  if (dense_leaf_address_) {
+    // Unsigned, so values below the base wrap around and fail the test.
+    unsigned int offset = unsigned(value) - unsigned(leaf_address_base_);
+    return offset < leaf_address_.size() ? leaf_address_[offset] : NULL;
+  }
+  map<int, PQLeaf*>::const_iterator it = sparse_leaf_address_.find(value);
+  return it == sparse_leaf_address_.end() ? NULL : it->second;
 }
 
 int PQTree::UnblockSiblings(PQNode* candidate_node) {
-  assert (candidate_node->mark_ == PQNode::unblocked);
+  assert (candidate_node->Mark() == PQNode::unblocked);
   int unblocked_count = 0;
   for (int i = 0; i < 2 && candidate_node->immediate_siblings_[i]; ++i) {
     PQNode* sibling = candidate_node->immediate_siblings_[i];
-    if (sibling->mark_ == PQNode::blocked) {
+    if (sibling->Mark() == PQNode::blocked) {
       sibling->parent_ = candidate_node->parent_;
-      sibling->mark_ = PQNode::unblocked;
+      sibling->SetMark(PQNode::unblocked);
       unblocked_count++;
       unblocked_count += UnblockSiblings(sibling);
     }
@@ -68,29 +204,30 @@ int PQTree::UnblockSiblings(PQNode* candidate_node) {
 // remainder of the methods should be skipped.  The template ordering is:
 // L1, P1, P2, P3, P4, P5, P6, Q1, Q2, Q3
 
-bool PQTree::TemplateL1(PQNode* candidate_node) {
+bool PQTree::TemplateL1(PQLeaf* candidate_node) {
   // L1's pattern is simple: the node is a leaf node.
-  if (candidate_node->type_ != PQNode::leaf)
-    return false;
-
   candidate_node->LabelAsFull();
   return true;
 }
 
-bool PQTree::TemplateQ1(PQNode* candidate_node) {
+// As with TemplateP1(), a Q-Node at the root of the pertinent subtree may be an
+// interior child of another Q-Node, so its parent pointer is not to be trusted
+// and its parent does not need to hear about it.
+bool PQTree::TemplateQ1(QNode* candidate_node, bool is_reduction_root) {
   // Q1's Pattern is a Q-Node that has only full children.
-  if (candidate_node->type_ != PQNode::qnode)
-    return false;
+  const int not_full = ~PQNode::LabelBit(PQNode::full);
   for (QNodeChildrenIterator it(candidate_node); !it.IsDone(); it.Next()) {
-    if (it.Current()->label_ != PQNode::full)
+    if (it.Current()->LabelBit() & not_full)
       return false;
   }
 
-  candidate_node->LabelAsFull();
+  candidate_node->SetLabel(PQNode::full);
+  if (!is_reduction_root)
+    candidate_node->parent_->full_children_.insert(candidate_node);
   return true;
 }
 
-bool PQTree::TemplateQ2(PQNode* candidate_node) {
+bool PQTree::TemplateQ2(QNode* candidate_node, bool is_reduction_root) {
   // Q2's pattern is a Q-Node that either:
   // 1) contains consecutive full children with one end of the consecutive
   //    ordering being one of |candidate_node|'s |endmost_children|, also full.
@@ -98,8 +235,7 @@ bool PQTree::TemplateQ2(PQNode* candidate_node) {
   //    |endmost_children|.
   // 3) One of |candidate_node|'s |endmost_childdren| is full, consecutively
   //    followed by 0 or more full children, followed by one partial child.
-  if (candidate_node->type_ != PQNode::qnode ||
-      candidate_node->pseudonode_ ||
+  if (candidate_node->IsPseudonode() ||
       candidate_node->partial_children_.size() > 1 ||
       !candidate_node->ConsecutiveFullPartialChildren())
     return false;
@@ -107,17 +243,17 @@ bool PQTree::TemplateQ2(PQNode* candidate_node) {
   bool has_partial = candidate_node->partial_children_.size() > 0;
   bool has_full = candidate_node->full_children_.size() > 0;
 
-  if (has_full && !candidate_node->EndmostChildWithLabel(PQNode::full))
-    return false;
-  if (!has_full && !candidate_node->EndmostChildWithLabel(PQNode::partial))
+  // An endmost child must be full, or partial if there are no full children.
+  int wanted = PQNode::LabelBit(has_full ? PQNode::full : PQNode::partial);
+  if (!(candidate_node->EndmostLabelBits() & wanted))
     return false;
 
   // If there is a partial child, merge it's children into the candidate_node.
   if (has_partial) {
-    PQNode* to_merge = *candidate_node->partial_children_.begin();
+    QNode* to_merge = (*candidate_node->partial_children_.begin())->AsQNode();
     for (int i = 0; i < 2; ++i) {
       PQNode* child = to_merge->endmost_children_[i];
-      PQNode* sibling = to_merge->ImmediateSiblingWithLabel(child->label_);
+      PQNode* sibling = to_merge->ImmediateSiblingWithLabel(child->Label());
       if (sibling) {
         sibling->ReplaceImmediateSibling(to_merge, child);
       } else {
@@ -126,33 +262,33 @@ bool PQTree::TemplateQ2(PQNode* candidate_node) {
       }
     }
     to_merge->ForgetChildren();
-    delete to_merge;
+    CountQNode(-1);
+    PQNode::Delete(to_merge, &pool_);
   }
 
-  candidate_node->label_ = PQNode::partial;
-  if (candidate_node->parent_)
+  candidate_node->SetLabel(PQNode::partial);
+  if (!is_reduction_root)
     candidate_node->parent_->partial_children_.insert(candidate_node);
   return true;
 }
 
-bool PQTree::TemplateQ3(PQNode* candidate_node) {
+bool PQTree::TemplateQ3(QNode* candidate_node) {
   // Q3's pattern is a Q-Node that contains 0-2 partial children.  It can
   // contain any number of empty and full children, but any full children must
   // be consecutive and sandwiched between any partial children.  Unlike Q2,
   // the consecutive full and partial children need not be endmost children.
-  if (candidate_node->type_ != PQNode::qnode ||
-      candidate_node->partial_children_.size() > 2 ||
+  if (candidate_node->partial_children_.size() > 2 ||
       !candidate_node->ConsecutiveFullPartialChildren())
     return false;
 
   // Merge each of the partial children into |candidate_node|'s children
-  for (set<PQNode*>::iterator j = candidate_node->partial_children_.begin();
+  for (PQNodeSet::iterator j = candidate_node->partial_children_.begin();
        j != candidate_node->partial_children_.end(); j++) {
-    PQNode* to_merge = *j;
+    QNode* to_merge = (*j)->AsQNode();
     for (int i = 0; i < 2; ++i) {
       PQNode* sibling = to_merge->immediate_siblings_[i];
       if (sibling) {
-        PQNode* child = to_merge->EndmostChildWithLabel(sibling->label_);
+        PQNode* child = to_merge->EndmostChildWithLabel(sibling->Label());
         if (!child)
           child = to_merge->EndmostChildWithLabel(PQNode::full);
         sibling->ReplaceImmediateSibling(to_merge, child);
@@ -164,7 +300,8 @@ bool PQTree::TemplateQ3(PQNode* candidate_node) {
     }
 
     to_merge->ForgetChildren();
-    delete to_merge;
+    CountQNode(-1);
+    PQNode::Delete(to_merge, &pool_);
   }
   return true;
 }
@@ -174,53 +311,57 @@ bool PQTree::TemplateQ3(PQNode* candidate_node) {
 // child of a q-node.  In this case, we need to know that the P-node is a
 // pertinent root and not try to update its parent whose pointer is possibly
 // invalid.
-bool PQTree::TemplateP1(PQNode* candidate_node, bool is_reduction_root) {
+bool PQTree::TemplateP1(PNode* candidate_node, bool is_reduction_root) {
   // P1's pattern is a P-Node with all full children.
-  if (candidate_node->type_ != PQNode::pnode ||
-      candidate_node->full_children_.size() != candidate_node->ChildCount())
+  if (candidate_node->full_children_.size() != candidate_node->ChildCount())
     return false;
 
-  candidate_node->label_ = PQNode::full;
+  candidate_node->SetLabel(PQNode::full);
   if (!is_reduction_root)
     candidate_node->parent_->full_children_.insert(candidate_node);
   return true;
 }
 
-bool PQTree::TemplateP2(PQNode* candidate_node) {
+bool PQTree::TemplateP2(PNode* candidate_node) {
   // P2's pattern is a P-Node at the root of the perinent subtree containing
   // both empty and full children.
-  if (candidate_node->type_ != PQNode::pnode ||
-      !candidate_node->partial_children_.empty())
+  if (!candidate_node->partial_children_.empty())
     return false;
+  CountPNode(candidate_node, -1);
 
   // Move candidate_node's full children into their own P-node
   if (candidate_node->full_children_.size() >= 2) {
-    PQNode* new_pnode = new PQNode;
-    new_pnode->type_ = PQNode::pnode;
+    PNode* new_pnode = new (&pool_) PNode(&pool_);
+    NoteProvenance(new_pnode);
     new_pnode->parent_ = candidate_node;
     candidate_node->MoveFullChildren(new_pnode);
     candidate_node->circular_link_.push_back(new_pnode);
+    candidate_node->leaf_count_ += new_pnode->leaf_count_;
+    CountPNode(new_pnode, 1);
   }
+  CountPNode(candidate_node, 1);
   // Mark the root partial
-  candidate_node->label_ = PQNode::partial;
+  candidate_node->SetLabel(PQNode::partial);
 
   return true;
 }
-bool PQTree::TemplateP3(PQNode* candidate_node) {
+bool PQTree::TemplateP3(PNode* candidate_node) {
   // P3's pattern is a P-Node not at the root of the perinent subtree
   // containing both empty and full children.
-  if (candidate_node->type_ != PQNode::pnode ||
-      !candidate_node->partial_children_.empty())
+  if (!candidate_node->partial_children_.empty())
     return false;
+  CountPNode(candidate_node, -1);
 
   // P3's replacement is to create a Q-node that places all of the full
   // elements in a single P-Node child and all of the empty elements in a
   // single Q-Node child.  This new Q-Node is called a pseudonode as it isn't
   // properly formed (Q-Nodes should have at least 3 children) and will not
   // survive in it's current form to the end of the reduction.
-  PQNode* new_qnode = new PQNode;
-  new_qnode->type_ = PQNode::qnode;
-  new_qnode->label_ = PQNode::partial;
+  QNode* new_qnode = new (&pool_) QNode(&pool_);
+  NoteProvenance(new_qnode);
+  new_qnode->SetLabel(PQNode::partial);
+  new_qnode->leaf_count_ = candidate_node->leaf_count_;
+  CountQNode(1);
   candidate_node->parent_->ReplacePartialChild(candidate_node, new_qnode);
 
   // Set up a |full_child| of |new_qnode| containing all of |candidate_node|'s
@@ -229,14 +370,17 @@ bool PQTree::TemplateP3(PQNode* candidate_node) {
   if (candidate_node->full_children_.size() == 1) {
     full_child = *candidate_node->full_children_.begin();
     candidate_node->circular_link_.remove(full_child);
+    candidate_node->leaf_count_ -= full_child->LeafCount();
   } else {
-    full_child = new PQNode;
-    full_child->type_ = PQNode::pnode;
-    full_child->label_ = PQNode::full;
-    candidate_node->MoveFullChildren(full_child);
+    PNode* full_pnode = new (&pool_) PNode(&pool_);
+    NoteProvenance(full_pnode);
+    full_pnode->SetLabel(PQNode::full);
+    candidate_node->MoveFullChildren(full_pnode);
+    CountPNode(full_pnode, 1);
+    full_child = full_pnode;
   }
   full_child->parent_ = new_qnode;
-  full_child->label_ = PQNode::full;
+  full_child->SetLabel(PQNode::full);
   new_qnode->endmost_children_[0] = full_child;
   new_qnode->full_children_.insert(full_child);
 
@@ -246,12 +390,13 @@ bool PQTree::TemplateP3(PQNode* candidate_node) {
   if (candidate_node->circular_link_.size() == 1) {
     empty_child = *candidate_node->circular_link_.begin();
     candidate_node->circular_link_.clear();
-    delete candidate_node;
+    PQNode::Delete(candidate_node, &pool_);
   } else {
     empty_child = candidate_node;
+    CountPNode(candidate_node, 1);
   }
   empty_child->parent_ = new_qnode;
-  empty_child->label_ = PQNode::empty;
+  empty_child->SetLabel(PQNode::empty);
   new_qnode->endmost_children_[1] = empty_child;
 
   // Update the immediate siblings links (erasing the old ones if present)
@@ -261,33 +406,39 @@ bool PQTree::TemplateP3(PQNode* candidate_node) {
   return true;
 }
 
-bool PQTree::TemplateP4(PQNode* candidate_node) {
+bool PQTree::TemplateP4(PNode* candidate_node) {
   // P4's pattern is a P-Node at the root of the perinent subtree containing
   // one partial child and any number of empty/full children.
-  if (candidate_node->type_ != PQNode::pnode ||
-      candidate_node->partial_children_.size() != 1)
+  if (candidate_node->partial_children_.size() != 1)
     return false;
 
-  PQNode* partial_qnode = *candidate_node->partial_children_.begin();
+  QNode* partial_qnode = (*candidate_node->partial_children_.begin())->AsQNode();
   PQNode* empty_child = partial_qnode->EndmostChildWithLabel(PQNode::empty);
   PQNode* full_child = partial_qnode->EndmostChildWithLabel(PQNode::full);
 
   if (!empty_child || !full_child)
     return false;
+  CountPNode(candidate_node, -1);
 
   // Move the full children of |candidate_node| to children of |partial_qnode|.
   // TODO: Lots of redundancy between lines 271-287, 326-342, and 345-359.
   if (!candidate_node->full_children_.empty()) {
+    int leaf_count = candidate_node->leaf_count_;
     PQNode *full_children_root;
     if (candidate_node->full_children_.size() == 1) {
       full_children_root = *(candidate_node->full_children_.begin());
       candidate_node->circular_link_.remove(full_children_root);
     } else {
-      full_children_root = new PQNode;
-      full_children_root->type_ = PQNode::pnode;
-      full_children_root->label_ = PQNode::full;
-      candidate_node->MoveFullChildren(full_children_root);
+      PNode* full_pnode = new (&pool_) PNode(&pool_);
+      NoteProvenance(full_pnode);
+      full_pnode->SetLabel(PQNode::full);
+      candidate_node->MoveFullChildren(full_pnode);
+      CountPNode(full_pnode, 1);
+      full_children_root = full_pnode;
     }
+    // The full leaves stay below |candidate_node|, one level further down.
+    candidate_node->leaf_count_ = leaf_count;
+    partial_qnode->leaf_count_ += full_children_root->LeafCount();
     full_children_root->parent_ = partial_qnode;
     partial_qnode->ReplaceEndmostChild(full_child, full_children_root);
     partial_qnode->full_children_.insert(full_children_root);
@@ -310,33 +461,38 @@ bool PQTree::TemplateP4(PQNode* candidate_node) {
         }
       }
     }
+    pertinent_root_ = partial_qnode;
     candidate_node->circular_link_.clear();
-    delete candidate_node;
+    PQNode::Delete(candidate_node, &pool_);
+  } else {
+    CountPNode(candidate_node, 1);
   }
   return true;
 }
 
-bool PQTree::TemplateP5(PQNode* candidate_node) {
+bool PQTree::TemplateP5(PNode* candidate_node) {
   // P4's pattern is a P-Node not at the root of the perinent subtree
   // containing one partial child and any number of empty/full children.
-  if (candidate_node->type_ != PQNode::pnode ||
-      candidate_node->partial_children_.size() != 1)
+  if (candidate_node->partial_children_.size() != 1)
     return false;
 
   // |partial_qnode| will become the pertinent subtree root after replacement.
-  PQNode* partial_qnode = *candidate_node->partial_children_.begin();
-  assert(partial_qnode->type_ == PQNode::qnode);
+  QNode* partial_qnode = (*candidate_node->partial_children_.begin())->AsQNode();
   PQNode* empty_child = partial_qnode->EndmostChildWithLabel(PQNode::empty);
   PQNode* full_child = partial_qnode->EndmostChildWithLabel(PQNode::full);
   PQNode* empty_sibling = candidate_node->CircularChildWithLabel(PQNode::empty);
 
   if (!empty_child || !full_child)
     return false;
+  CountPNode(candidate_node, -1);
 
-  // Move partial_qnode from candidate_node's child to it's parent's child
+  // Move partial_qnode from candidate_node's child to it's parent's child.
+  // Every leaf of |candidate_node| ends up below it.
   candidate_node->parent_->ReplaceChild(candidate_node, partial_qnode);
   partial_qnode->pertinent_leaf_count = candidate_node->pertinent_leaf_count;
   candidate_node->circular_link_.remove(partial_qnode);
+  candidate_node->leaf_count_ -= partial_qnode->leaf_count_;
+  partial_qnode->leaf_count_ += candidate_node->leaf_count_;
 
   // Move the full children of |candidate_node| to children of |partial_qnode|.
   if (!candidate_node->full_children_.empty()) {
@@ -344,11 +500,14 @@ bool PQTree::TemplateP5(PQNode* candidate_node) {
     if (candidate_node->full_children_.size() == 1) {
       full_children_root = *candidate_node->full_children_.begin();
       candidate_node->circular_link_.remove(full_children_root);
+      candidate_node->leaf_count_ -= full_children_root->LeafCount();
     } else {
-      full_children_root = new PQNode;
-      full_children_root->type_ = PQNode::pnode;
-      full_children_root->label_ = PQNode::full;
-      candidate_node->MoveFullChildren(full_children_root);
+      PNode* full_pnode = new (&pool_) PNode(&pool_);
+      NoteProvenance(full_pnode);
+      full_pnode->SetLabel(PQNode::full);
+      candidate_node->MoveFullChildren(full_pnode);
+      CountPNode(full_pnode, 1);
+      full_children_root = full_pnode;
     }
 
     full_children_root->parent_ = partial_qnode;
@@ -364,7 +523,7 @@ bool PQTree::TemplateP5(PQNode* candidate_node) {
       empty_children_root = empty_sibling;
     } else {
       empty_children_root = candidate_node;
-      empty_children_root->label_ = PQNode::empty;
+      empty_children_root->SetLabel(PQNode::empty);
       empty_children_root->ClearImmediateSiblings();
     }
 
@@ -376,20 +535,22 @@ bool PQTree::TemplateP5(PQNode* candidate_node) {
   if (candidate_node->ChildCount() < 2) {
     // We want to delete candidate_node, but not it's children.
     candidate_node->circular_link_.clear();
-    delete candidate_node;
+    PQNode::Delete(candidate_node, &pool_);
+  } else {
+    CountPNode(candidate_node, 1);
   }
 
   return true;
 }
 
-bool PQTree::TemplateP6(PQNode* candidate_node) {
-  if (candidate_node->type_ != PQNode::pnode ||
-      candidate_node->partial_children_.size() != 2)
+bool PQTree::TemplateP6(PNode* candidate_node) {
+  if (candidate_node->partial_children_.size() != 2)
     return false;
 
   // TODO: Convert these to an array so we don't have 2 of everything.
-  PQNode* partial_qnode1 = *candidate_node->partial_children_.begin();
-  PQNode* partial_qnode2 = *(++(candidate_node->partial_children_.begin()));
+  QNode* partial_qnode1 = (*candidate_node->partial_children_.begin())->AsQNode();
+  QNode* partial_qnode2 =
+      (*(++(candidate_node->partial_children_.begin())))->AsQNode();
 
   PQNode* empty_child1 = partial_qnode1->EndmostChildWithLabel(PQNode::empty);
   PQNode* full_child1 = partial_qnode1->EndmostChildWithLabel(PQNode::full);
@@ -400,6 +561,12 @@ bool PQTree::TemplateP6(PQNode* candidate_node) {
   PQNode* full_child2 = partial_qnode2->EndmostChildWithLabel(PQNode::full);
   if (!empty_child2 || !full_child2)
     return false;
+  CountPNode(candidate_node, -1);
+
+  // |partial_qnode1| takes in the children of |partial_qnode2| and the full
+  // children of |candidate_node|, whose own leaf count does not change.
+  int leaf_count = candidate_node->leaf_count_;
+  partial_qnode1->leaf_count_ += partial_qnode2->leaf_count_;
 
   // Move the full children of candidate_node to be children of partial_qnode1
   if (!candidate_node->full_children_.empty()) {
@@ -409,13 +576,16 @@ bool PQTree::TemplateP6(PQNode* candidate_node) {
       candidate_node->circular_link_.remove(full_children_root);
     } else {
       // create full_children_root to be a new p-node
-      full_children_root = new PQNode;
-      full_children_root->type_ = PQNode::pnode;
-      full_children_root->label_ = PQNode::full;
-      candidate_node->MoveFullChildren(full_children_root);
+      PNode* full_pnode = new (&pool_) PNode(&pool_);
+      NoteProvenance(full_pnode);
+      full_pnode->SetLabel(PQNode::full);
+      candidate_node->MoveFullChildren(full_pnode);
+      CountPNode(full_pnode, 1);
+      full_children_root = full_pnode;
     }
     full_children_root->parent_ = partial_qnode1;
     full_child2->parent_ = partial_qnode1;
+    partial_qnode1->leaf_count_ += full_children_root->LeafCount();
 
     full_child1->AddImmediateSibling(full_children_root);
     full_child2->AddImmediateSibling(full_children_root);
@@ -429,37 +599,39 @@ bool PQTree::TemplateP6(PQNode* candidate_node) {
   empty_child2->parent_ = partial_qnode1;
 
   // We dont need |partial_qnode2| any more
+  candidate_node->leaf_count_ = leaf_count;
   candidate_node->circular_link_.remove(partial_qnode2);
   partial_qnode2->ForgetChildren();
-  delete partial_qnode2;
+  PQNode::Delete(partial_qnode2, &pool_);
+  CountQNode(-1);
 
   // If |candidate_node| now only has one child, get rid of |candidate_node|.
   if (candidate_node->circular_link_.size() == 1) {
-    partial_qnode1->parent_ = candidate_node->parent_;
     partial_qnode1->pertinent_leaf_count = candidate_node->pertinent_leaf_count;
-    partial_qnode1->label_ = PQNode::partial;
+    partial_qnode1->SetLabel(PQNode::partial);
+    pertinent_root_ = partial_qnode1;
 
-    if (candidate_node->parent_) {
-      candidate_node->parent_->partial_children_.insert(partial_qnode1);
-      if (candidate_node->parent_->type_ == PQNode::pnode) {
-        candidate_node->parent_->ReplaceCircularLink(candidate_node,
-                                                     partial_qnode1);
+    // As in TemplateP4(), an interior child of a Q-Node has no reliable
+    // parent, so only its siblings are told about the replacement.
+    if (candidate_node->Parent()) {
+      candidate_node->parent_->ReplaceChild(candidate_node, partial_qnode1);
+    } else {
+      partial_qnode1->parent_ = NULL;
+      if (root_ == candidate_node) {
+        root_ = partial_qnode1;
       } else {
-        for (int i = 0; i < 2 && candidate_node->immediate_siblings_[i]; ++i) {
-          PQNode* sibling = candidate_node->immediate_siblings_[i];
+        for (int i = 0; i < 2; ++i) {
+          PQNode *sibling = candidate_node->immediate_siblings_[i];
           sibling->ReplaceImmediateSibling(candidate_node, partial_qnode1);
         }
-        candidate_node->parent_->ReplaceEndmostChild(candidate_node,
-                                                     partial_qnode1);
       }
-    } else {
-      root_ = partial_qnode1;
-      partial_qnode1->parent_ = NULL;
-
-      // Delete candidate_node, but not it's children.
-      candidate_node->circular_link_.clear();
-      delete candidate_node;
     }
+
+    // Delete candidate_node, but not it's children.
+    candidate_node->circular_link_.clear();
+    PQNode::Delete(candidate_node, &pool_);
+  } else {
+    CountPNode(candidate_node, 1);
   }
   return true;
 }
@@ -467,40 +639,40 @@ bool PQTree::TemplateP6(PQNode* candidate_node) {
 // This procedure is the first pass of the Booth & Leuker PQTree algorithm.
 // It processes the pertinent subtree of the PQ-Tree to determine the mark
 // of every node in that subtree.
-bool PQTree::Bubble(set<int> reduction_set) {
-  queue<PQNode*> q;
+bool PQTree::Bubble(const set<int>& reduction_set) {
+  queue_.clear();
+  queue_head_ = 0;
+  blocked_list_.clear();
   block_count_ = 0;
   blocked_nodes_ = 0;
   off_the_top_ = 0;
 
-  // Stores blocked nodes
-  set<PQNode*> blocked_list;
-
-  // Insert the set's leaves into the queue
-  for (set<int>::iterator i = reduction_set.begin();
+  // Insert the set's leaves into the queue.  A value which is not a leaf
+  // fails the reduction before any node is marked.
+  for (set<int>::const_iterator i = reduction_set.begin();
        i != reduction_set.end(); ++i) {
-    PQNode *temp = leaf_address_[*i];
-    assert (temp);
-    q.push(temp);
+    PQLeaf* leaf = LeafAddress(*i);
+    if (!leaf)
+      return false;
+    queue_.push_back(leaf);
   }
 
-  while (q.size() + block_count_ + off_the_top_ > 1) {
-    if (q.empty())
+  while (queue_.size() - queue_head_ + block_count_ + off_the_top_ > 1) {
+    if (queue_head_ == queue_.size())
       return false;
 
-    PQNode* candidate_node = q.front();
-    q.pop();
-    candidate_node->mark_ = PQNode::blocked;
+    PQNode* candidate_node = queue_[queue_head_++];
+    candidate_node->SetMark(PQNode::blocked);
 
-    // Get the set of blocked and PQNode::unblocked siblings
-    set<PQNode*> unblocked_siblings;
-    set<PQNode*> blocked_siblings;
+    // Get the blocked and unblocked siblings
+    PQNode* unblocked_sibling = NULL;
+    int blocked_siblings = 0;
     for (int i = 0; i < 2 && candidate_node->immediate_siblings_[i]; ++i) {
       PQNode* sibling = candidate_node->immediate_siblings_[i];
-      if (sibling->mark_ == PQNode::blocked) {
-        blocked_siblings.insert(sibling);
-      } else if (sibling->mark_ == PQNode::unblocked) {
-        unblocked_siblings.insert(sibling);
+      if (sibling->Mark() == PQNode::blocked) {
+        ++blocked_siblings;
+      } else if (sibling->Mark() == PQNode::unblocked) {
+        unblocked_sibling = sibling;
       }
     }
 
@@ -508,16 +680,16 @@ bool PQTree::Bubble(set<int> reduction_set) {
     //  - 1 or more of its immediate siblings is unblocked.
     //  - It has 1 immediate sibling meaning it is a corner child of a q node.
     //  - It has 0 immediate siblings meaning it is a p node.
-    if (!unblocked_siblings.empty()) {
-      candidate_node->parent_ = (*unblocked_siblings.begin())->parent_;
-      candidate_node->mark_ = PQNode::unblocked;
+    if (unblocked_sibling) {
+      candidate_node->parent_ = unblocked_sibling->parent_;
+      candidate_node->SetMark(PQNode::unblocked);
     } else if (candidate_node->ImmediateSiblingCount() < 2) {
-      candidate_node->mark_ = PQNode::unblocked;
+      candidate_node->SetMark(PQNode::unblocked);
     }
 
     // If |candidate_node| is unblocked, we can process it.
-    if (candidate_node->mark_ == PQNode::unblocked) {
-      if (!blocked_siblings.empty()) {
+    if (candidate_node->Mark() == PQNode::unblocked) {
+      if (blocked_siblings) {
         int list_size = UnblockSiblings(candidate_node);
         candidate_node->parent_->pertinent_child_count += list_size;
         blocked_nodes_ -= list_size;
@@ -527,16 +699,16 @@ bool PQTree::Bubble(set<int> reduction_set) {
         off_the_top_ = 1;
       } else {
         candidate_node->parent_->pertinent_child_count++;
-        if (candidate_node->parent_->mark_ == PQNode::unmarked) {
-          q.push(candidate_node->parent_);
-          candidate_node->parent_->mark_ = PQNode::queued;
+        if (candidate_node->parent_->Mark() == PQNode::unmarked) {
+          queue_.push_back(candidate_node->parent_);
+          candidate_node->parent_->SetMark(PQNode::queued);
         }
       }
-      block_count_ -= blocked_siblings.size();
+      block_count_ -= blocked_siblings;
     } else {
-      block_count_ += 1 - blocked_siblings.size();
+      block_count_ += 1 - blocked_siblings;
       blocked_nodes_ += 1;
-      blocked_list.insert(candidate_node);
+      blocked_list_.push_back(candidate_node);
     }
   }
 
@@ -546,22 +718,20 @@ bool PQTree::Bubble(set<int> reduction_set) {
   // In this case, we have a block that is contained within a Q-node.  We must
   // assign a psuedonode to handle it.
   if (block_count_ == 1 && blocked_nodes_ > 1) {
-    pseudonode_ = new PQNode;
-    pseudonode_->type_ = PQNode::qnode;
-    pseudonode_->pseudonode_ = true;
+    pseudonode_ = new (&pool_) QNode(&pool_);
+    pseudonode_->SetPseudonode(true);
     pseudonode_->pertinent_child_count = 0;
 
     // Find the blocked nodes and which of those are endmost children.
     int side = 0;
-    for (set<PQNode*>::iterator i = blocked_list.begin();
-        i != blocked_list.end(); ++i) {
-      PQNode* blocked = *i;
-      if (blocked->mark_ == PQNode::blocked) {  // may have become unblocked
+    for (int i = 0; i < blocked_list_.size(); ++i) {
+      PQNode* blocked = blocked_list_[i];
+      if (blocked->Mark() == PQNode::blocked) {  // may have become unblocked
         pseudonode_->pertinent_child_count++;
         pseudonode_->pertinent_leaf_count += blocked->pertinent_leaf_count;
         for (int j = 0; j < 2; ++j) {
           PQNode* sibling = blocked->immediate_siblings_[j];
-          if (sibling->mark_ == PQNode::unmarked) {
+          if (sibling->Mark() == PQNode::unmarked) {
             blocked->RemoveImmediateSibling(sibling);
             sibling->RemoveImmediateSibling(blocked);
             pseudonode_->pseudo_neighbors_[side] = sibling;
@@ -570,74 +740,307 @@ bool PQTree::Bubble(set<int> reduction_set) {
           }
         }
         blocked->parent_ = pseudonode_;
-        blocked->pseudochild_ = true;
+        blocked->SetPseudochild(true);
       }
     }
-    q.push(pseudonode_);
+    queue_.push_back(pseudonode_);
   }
   return true;
 }
 
-bool PQTree::ReduceStep(set<int> reduction_set) {
-  // Build a queue with all the pertinent leaves in it
-  queue<PQNode*> q;
-  for (set<int>::iterator i = reduction_set.begin();
+bool PQTree::ReduceStep(const set<int>& reduction_set) {
+  // The reduction rearranges the children of the Q-Node holding the block,
+  // if there is a pseudonode, which is found from the end of its children
+  // past the pseudonode.
+  if (pseudonode_ && explain_conflicts_)
+    NoteProvenance(ParentOf(pseudonode_->pseudo_neighbors_[0]));
+
+  // The pertinent leaves are all processed before any internal node, so they
+  // are handled here rather than queued.  Template L1 always matches them.
+  queue_.clear();
+  queue_head_ = 0;
+  for (set<int>::const_iterator i = reduction_set.begin();
        i != reduction_set.end(); i++) {
-    PQNode* candidate_node = leaf_address_[*i];
+    PQLeaf* candidate_node = LeafAddress(*i);
     if (candidate_node == NULL)
       return false;
     candidate_node->pertinent_leaf_count = 1;
-    q.push(candidate_node);
+    if (candidate_node->pertinent_leaf_count < reduction_set.size()) {
+      PQInternalNode* candidate_parent = candidate_node->parent_;
+      candidate_parent->pertinent_leaf_count++;
+      candidate_parent->pertinent_child_count--;
+      if (candidate_parent->pertinent_child_count == 0)
+        queue_.push_back(candidate_parent);
+    }
+    TemplateL1(candidate_node);
   }
 
-  while (!q.empty()) {
-    // Remove candidate_node from the front of the queue
-    PQNode* candidate_node = q.front();
-    q.pop();
+  while (queue_head_ < queue_.size()) {
+    // Remove candidate_node from the front of the queue.  Whichever template
+    // matches may change its subtree, so its hash is forgotten and its
+    // provenance noted.
+    PQInternalNode* candidate_node = queue_[queue_head_++]->AsInternal();
+    candidate_node->hash_ = 0;
 
     // We test against different templates depending on whether |candidate_node|
     // is the root of the pertinent subtree.
-    if (candidate_node->pertinent_leaf_count < reduction_set.size()) {
-      PQNode* candidate_parent = candidate_node->parent_;
+    bool is_reduction_root =
+        candidate_node->pertinent_leaf_count >= reduction_set.size();
+
+    // A P-Node at the root of the pertinent subtree keeps its leaves, and with
+    // them the reductions which put them together, however its children are
+    // regrouped.
+    if (is_reduction_root && candidate_node->Type() == PQNode::pnode)
+      NoteDependence(candidate_node);
+    else
+      NoteProvenance(candidate_node);
+    if (!is_reduction_root) {
+      PQInternalNode* candidate_parent = candidate_node->parent_;
       candidate_parent->pertinent_leaf_count +=
           candidate_node->pertinent_leaf_count;
       candidate_parent->pertinent_child_count--;
       // Push |candidate_parent| onto the queue if it no longer has any
       // pertinent children.
       if (candidate_parent->pertinent_child_count == 0)
-        q.push(candidate_parent);
-
-      // Test against each template in turn until one of them returns true.
-      if      (TemplateL1(candidate_node)) {}
-      else if (TemplateP1(candidate_node, /*is_reduction_root=*/ false)) {}
-      else if (TemplateP3(candidate_node)) {}
-      else if (TemplateP5(candidate_node)) {}
-      else if (TemplateQ1(candidate_node)) {}
-      else if (TemplateQ2(candidate_node)) {}
-      else {
-        CleanPseudo();
+        queue_.push_back(candidate_parent);
+    }
+
+    // Test against each template of the node's type in turn until one of them
+    // returns true.
+    if (is_reduction_root)
+      pertinent_root_ = candidate_node;
+    bool matched;
+    if (candidate_node->Type() == PQNode::pnode) {
+      PNode* pnode = candidate_node->AsPNode();
+      if (!is_reduction_root)
+        matched = TemplateP1(pnode, /*is_reduction_root=*/ false) ||
+                  TemplateP3(pnode) ||
+                  TemplateP5(pnode);
+      else
+        matched = TemplateP1(pnode, /*is_reduction_root=*/ true) ||
+                  TemplateP2(pnode) ||
+                  TemplateP4(pnode) ||
+                  TemplateP6(pnode);
+    } else {
+      QNode* qnode = candidate_node->AsQNode();
+      if (!is_reduction_root)
+        matched = TemplateQ1(qnode, /*is_reduction_root=*/ false) ||
+                  TemplateQ2(qnode, /*is_reduction_root=*/ false);
+      else
+        matched = TemplateQ1(qnode, /*is_reduction_root=*/ true) ||
+                  TemplateQ2(qnode, /*is_reduction_root=*/ true) ||
+                  TemplateQ3(qnode);
+    }
+    if (!matched) {
+      CleanPseudo();
+      return false;
+    }
+  }
+
+  // The pseudonode is about to be dissolved, note where its children are.
+  PQNode* ends[2] = {pertinent_root_, pertinent_root_};
+  if (pertinent_root_ == pseudonode_) {
+    ends[0] = pseudonode_->endmost_children_[0];
+    ends[1] = pseudonode_->endmost_children_[1];
+  }
+  CleanPseudo();
+  if (frontier_valid_)
+    MarkDirty(ends);
+  ForgetHashes(ends[0]);
+  ForgetHashes(ends[1]);
+  return true;
+}
+
+bool PQTree::LabelPertinent(const set<int>& reduction_set) {
+  // The same walk as ReduceStep(), but each node is only labelled as the
+  // template matching it would leave it.  Every partial node then stands
+  // where the partial Q-Node replacing it would, so the labels of siblings
+  // and endmost children read the same as in ReduceStep().
+  queue_.clear();
+  queue_head_ = 0;
+  for (set<int>::const_iterator i = reduction_set.begin();
+       i != reduction_set.end(); i++) {
+    PQLeaf* candidate_node = LeafAddress(*i);
+    candidate_node->pertinent_leaf_count = 1;
+    PQInternalNode* candidate_parent = candidate_node->parent_;
+    candidate_parent->pertinent_leaf_count++;
+    candidate_parent->pertinent_child_count--;
+    if (candidate_parent->pertinent_child_count == 0)
+      queue_.push_back(candidate_parent);
+    candidate_node->LabelAsFull();
+  }
+
+  while (queue_head_ < queue_.size()) {
+    PQInternalNode* candidate_node = queue_[queue_head_++]->AsInternal();
+    bool is_reduction_root =
+        candidate_node->pertinent_leaf_count >= reduction_set.size();
+    if (!is_reduction_root) {
+      PQInternalNode* candidate_parent = candidate_node->parent_;
+      candidate_parent->pertinent_leaf_count +=
+          candidate_node->pertinent_leaf_count;
+      candidate_parent->pertinent_child_count--;
+      if (candidate_parent->pertinent_child_count == 0)
+        queue_.push_back(candidate_parent);
+    }
+
+    int partial_children = candidate_node->partial_children_.size();
+    bool all_full;
+    if (candidate_node->Type() == PQNode::pnode) {
+      // P1 to P6 only ask for few enough partial children.
+      if (partial_children > (is_reduction_root ? 2 : 1))
         return false;
+      all_full = candidate_node->full_children_.size() ==
+          candidate_node->AsPNode()->ChildCount();
+    } else {
+      QNode* qnode = candidate_node->AsQNode();
+      all_full = true;
+      for (QNodeChildrenIterator it(qnode); !it.IsDone(); it.Next()) {
+        if (it.Current()->Label() != PQNode::full) {
+          all_full = false;
+          break;
+        }
       }
-    } else {  // candidate_node is the root of the reduction subtree
-      // Test against each template in turn until one of them returns true.
-      if      (TemplateL1(candidate_node)) {}
-      else if (TemplateP1(candidate_node, /*is_reduction_root=*/ true)) {}
-      else if (TemplateP2(candidate_node)) {}
-      else if (TemplateP4(candidate_node)) {}
-      else if (TemplateP6(candidate_node)) {}
-      else if (TemplateQ1(candidate_node)) {}
-      else if (TemplateQ2(candidate_node)) {}
-      else if (TemplateQ3(candidate_node)) {}
-      else {
-        CleanPseudo();
-        return false;
+      // Q1, or else Q2 below the root and Q3 at it.
+      if (!all_full) {
+        if (partial_children > (is_reduction_root ? 2 : 1) ||
+            !qnode->ConsecutiveFullPartialChildren())
+          return false;
+        int wanted = PQNode::LabelBit(qnode->full_children_.empty() ?
+                                      PQNode::partial : PQNode::full);
+        if (!is_reduction_root && !(qnode->EndmostLabelBits() & wanted))
+          return false;
       }
     }
+
+    if (is_reduction_root)
+      continue;
+    if (all_full) {
+      candidate_node->SetLabel(PQNode::full);
+      candidate_node->parent_->full_children_.insert(candidate_node);
+    } else {
+      candidate_node->SetLabel(PQNode::partial);
+      candidate_node->parent_->partial_children_.insert(candidate_node);
+    }
   }
-  CleanPseudo();
   return true;
 }
 
+void PQTree::UnlabelPertinent(const set<int>& reduction_set) {
+  for (set<int>::const_iterator i = reduction_set.begin();
+       i != reduction_set.end(); i++) {
+    PQLeaf* leaf = LeafAddress(*i);
+    leaf->SetLabel(PQNode::empty);
+    leaf->pertinent_leaf_count = 0;
+    leaf->parent_->pertinent_child_count++;
+  }
+  for (int i = 0; i < queue_.size(); ++i) {
+    PQInternalNode* node = queue_[i]->AsInternal();
+    if (node->pertinent_leaf_count < reduction_set.size())
+      node->parent_->pertinent_child_count++;
+    node->SetLabel(PQNode::empty);
+    node->pertinent_leaf_count = 0;
+    node->full_children_.clear();
+    node->partial_children_.clear();
+  }
+}
+
+void PQTree::NoteProvenance(PQInternalNode* node) {
+  if (!explain_conflicts_)
+    return;
+  int reduction = first_explained_ + provenance_begins_.size() - 1;
+  if (node->provenance_ == reduction)
+    return;
+  // Nodes created by this reduction, or with no reduction behind them, have
+  // no provenance of their own.
+  if (node->provenance_ != -1)
+    provenance_deps_.push_back(node->provenance_);
+  node->provenance_ = reduction;
+}
+
+void PQTree::NoteDependence(PQInternalNode* node) {
+  if (!explain_conflicts_ || node->provenance_ == -1)
+    return;
+  provenance_deps_.push_back(node->provenance_);
+}
+
+void PQTree::NoteConflict(bool before_changes) {
+  if (!explain_conflicts_)
+    return;
+  // The provenance noted by the failed reduction becomes the conflict, as the
+  // reduction itself is forgotten.
+  conflict_.assign(provenance_deps_.begin() + provenance_begins_.back(),
+                   provenance_deps_.end());
+  provenance_deps_.resize(provenance_begins_.back());
+  provenance_begins_.pop_back();
+  has_conflict_ = true;
+  if (!before_changes)
+    return;
+
+  // Bubble() and LabelPertinent() change nothing, so they note no
+  // provenance, but their failure comes down to the nodes they queued and
+  // the Q-Nodes holding the nodes Bubble() found blocked, which split the
+  // set apart.
+  if (pseudonode_) {
+    PQInternalNode* parent = ParentOf(pseudonode_->pseudo_neighbors_[0]);
+    if (parent->provenance_ != -1)
+      conflict_.push_back(parent->provenance_);
+  }
+  for (int i = 0; i < queue_.size(); ++i) {
+    if (queue_[i]->Type() != PQNode::leaf &&
+        queue_[i]->AsInternal()->provenance_ != -1)
+      conflict_.push_back(queue_[i]->AsInternal()->provenance_);
+  }
+  for (int i = 0; i < blocked_list_.size(); ++i) {
+    if (blocked_list_[i]->Mark() != PQNode::blocked)
+      continue;
+    PQInternalNode* parent = ParentOf(blocked_list_[i]);
+    if (parent->provenance_ != -1)
+      conflict_.push_back(parent->provenance_);
+  }
+}
+
+void PQTree::ForgetHashes(PQNode* node) {
+  while (node != root_) {
+    PQInternalNode* parent = ParentOf(node);
+    if (!parent->hash_)
+      return;
+    parent->hash_ = 0;
+    node = parent;
+  }
+}
+
+uint64_t PQTree::CanonicalHash() {
+  return root_->CanonicalHash();
+}
+
+void PQTree::CountPNode(PNode* pnode, int sign) {
+  int children = pnode->ChildCount();
+  pnode_arities_[children] += sign;
+  log_frontier_count_ += sign * lgamma(children + 1.0);
+}
+
+void PQTree::CountQNode(int sign) {
+  qnode_count_ += sign;
+  log_frontier_count_ += sign * log(2.0);
+}
+
+void PQTree::CopyFrontierCount(const PQTree& to_copy) {
+  pnode_arities_ = to_copy.pnode_arities_;
+  qnode_count_ = to_copy.qnode_count_;
+  log_frontier_count_ = to_copy.log_frontier_count_;
+}
+
+void PQTree::MarkDirty(PQNode* ends[2]) {
+  int begin = NodeRank(ends[0]);
+  int end = begin + ends[0]->LeafCount();
+  if (ends[1] != ends[0]) {
+    int other = NodeRank(ends[1]);
+    begin = min(begin, other);
+    end = max(end, other + ends[1]->LeafCount());
+  }
+  dirty_ranges_.push_back(make_pair(begin, end));
+}
+
 void PQTree::CleanPseudo() {
   if (pseudonode_) {
     // The parents of these nodes should be ignored in the next round, but
@@ -660,30 +1063,336 @@ void PQTree::CleanPseudo() {
     }
 
     pseudonode_->ForgetChildren();
-    delete pseudonode_;
+    PQNode::Delete(pseudonode_, &pool_);
     pseudonode_ = NULL;
   }
 }
 
 // Basic constructor from an initial set.
-PQTree::PQTree(set<int> reduction_set) {
+PQTree::PQTree(const set<int>& reduction_set) {
+  vector<int> leaves(reduction_set.begin(), reduction_set.end());
+  Init(leaves.empty() ? NULL : &leaves[0], leaves.size());
+}
+
+PQTree::PQTree(int leaf_count) {
+  Init(NULL, leaf_count);
+}
+
+PQTree::PQTree(const int* leaves, int count) {
+  Init(leaves, count);
+}
+
+void PQTree::Init(const int* leaves, int count) {
   // Set up the root node as a P-Node initially.
-  root_ = new PQNode;
-  root_->type_ = PQNode::pnode;
+  PNode* root = new (&pool_) PNode(&pool_);
+  root_ = root;
+  root->leaf_count_ = count;
+  record_reductions_ = true;
+  explain_conflicts_ = false;
+  explainable_ = true;
+  has_conflict_ = false;
+  first_explained_ = 0;
+  queue_head_ = 0;
+  frontier_valid_ = false;
+  pertinent_root_ = NULL;
+  pnode_arities_.assign(count + 1, 0);
+  qnode_count_ = 0;
+  log_frontier_count_ = 0;
   invalid_ = false;
   pseudonode_ = NULL;
   block_count_ = 0;
   blocked_nodes_ = 0;
   off_the_top_ = 0;
-  for (set<int>::iterator i = reduction_set.begin();
-       i != reduction_set.end(); i++) {
-    PQNode *new_node;
-    new_node = new PQNode(*i);
-    leaf_address_[*i] = new_node;
-    new_node->parent_ = root_;
-    new_node->type_ = PQNode::leaf;
-    root_->circular_link_.push_back(new_node);
+
+  // Lay all the leaves out in a single block, and index them as we go if
+  // they are 0 .. |count| - 1.
+  PQLeaf* block = static_cast<PQLeaf*>(
+      pool_.AllocateBlock(count * sizeof(PQLeaf)));
+  if (!leaves)
+    leaf_address_.resize(count);
+  for (int i = 0; i < count; ++i) {
+    PQLeaf *new_node = ::new (block + i) PQLeaf(leaves ? leaves[i] : i);
+    new_node->parent_ = root;
+    root->circular_link_.push_back(new_node);
+    if (!leaves)
+      leaf_address_[i] = new_node;
+  }
+
+  if (!leaves) {
+    leaf_count_ = count;
+    dense_leaf_address_ = true;
+    leaf_address_base_ = 0;
+  } else {
+    vector<PQLeaf*> all_leaves(count);
+    for (int i = 0; i < count; ++i)
+      all_leaves[i] = block + i;
+    IndexLeaves(all_leaves);
+  }
+  leaf_block_ = block;
+  CountPNode(root, 1);
+}
+
+PQTree::PQTree() {
+  root_ = NULL;
+  record_reductions_ = true;
+  explain_conflicts_ = false;
+  explainable_ = true;
+  has_conflict_ = false;
+  first_explained_ = 0;
+  queue_head_ = 0;
+  frontier_valid_ = false;
+  pertinent_root_ = NULL;
+  invalid_ = false;
+  pseudonode_ = NULL;
+  block_count_ = 0;
+  blocked_nodes_ = 0;
+  off_the_top_ = 0;
+  qnode_count_ = 0;
+  log_frontier_count_ = 0;
+  dense_leaf_address_ = true;
+  leaf_address_base_ = 0;
+  leaf_count_ = 0;
+  leaf_block_ = NULL;
+}
+
+PQTree* PQTree::Clone() const {
+  PQTree* clone = new PQTree;
+  clone->block_count_ = block_count_;
+  clone->blocked_nodes_ = blocked_nodes_;
+  clone->off_the_top_ = off_the_top_;
+  clone->invalid_ = invalid_;
+  clone->reductions_ = reductions_;
+  clone->record_reductions_ = record_reductions_;
+  clone->explain_conflicts_ = explain_conflicts_;
+  clone->explainable_ = explainable_;
+  clone->has_conflict_ = has_conflict_;
+  clone->first_explained_ = first_explained_;
+  clone->provenance_begins_ = provenance_begins_;
+  clone->provenance_deps_ = provenance_deps_;
+  clone->conflict_ = conflict_;
+  clone->leaf_count_ = leaf_count_;
+  clone->CopyFrontierCount(*this);
+  clone->dense_leaf_address_ = dense_leaf_address_;
+  clone->leaf_address_base_ = leaf_address_base_;
+  clone->leaf_block_ = static_cast<PQLeaf*>(
+      clone->pool_.AllocateBlock(leaf_count_ * sizeof(PQLeaf)));
+
+  if (leaf_block_) {
+    // Every leaf is in |leaf_block_|, so the leaves and the leaf index can be
+    // copied wholesale, relocating the index by the distance between the
+    // blocks.  The leaves' links are rewritten as their parents are copied.
+    memcpy(static_cast<void*>(clone->leaf_block_), leaf_block_,
+           leaf_count_ * sizeof(PQLeaf));
+    if (dense_leaf_address_) {
+      clone->leaf_address_.resize(leaf_address_.size());
+      for (int i = 0; i < leaf_address_.size(); ++i)
+        clone->leaf_address_[i] = leaf_address_[i] ?
+            clone->leaf_block_ + (leaf_address_[i] - leaf_block_) : NULL;
+    } else {
+      for (map<int, PQLeaf*>::const_iterator i = sparse_leaf_address_.begin();
+           i != sparse_leaf_address_.end(); ++i) {
+        PQLeaf* leaf = clone->leaf_block_ + (i->second - leaf_block_);
+        clone->sparse_leaf_address_.insert(clone->sparse_leaf_address_.end(),
+                                           make_pair(i->first, leaf));
+      }
+    }
+  } else if (dense_leaf_address_) {
+    clone->leaf_address_.resize(leaf_address_.size(), NULL);
+  }
+
+  const PQInternalNode* root = root_->AsInternal();
+  PQInternalNode* root_copy;
+  if (root->Type() == PQNode::pnode)
+    root_copy = new (&clone->pool_) PNode(&clone->pool_);
+  else
+    root_copy = new (&clone->pool_) QNode(&clone->pool_);
+  root_copy->CopyScalars(*root);
+  root_copy->pertinent_child_count = root->pertinent_child_count;
+  root_copy->leaf_count_ = root->leaf_count_;
+  root_copy->hash_ = root->hash_;
+  root_copy->provenance_ = root->provenance_;
+  clone->root_ = root_copy;
+
+  // Copy the tree through an explicit stack of pending nodes rather than
+  // recursion, so that deep trees cannot overflow the call stack.
+  PQLeaf* next_leaf = clone->leaf_block_;
+  vector<pair<const PQInternalNode*, PQInternalNode*> > pending;
+  pending.push_back(make_pair(root, root_copy));
+  while (!pending.empty()) {
+    pair<const PQInternalNode*, PQInternalNode*> node = pending.back();
+    pending.pop_back();
+    clone->CloneChildren(node.first, node.second, leaf_block_, &next_leaf,
+                         &pending);
+  }
+  return clone;
+}
+
+void PQTree::CloneChildren(
+    const PQInternalNode* from, PQInternalNode* to, const PQLeaf* from_block,
+    PQLeaf** next_leaf,
+    vector<pair<const PQInternalNode*, PQInternalNode*> >* pending) {
+  PQNode* last_copy = NULL;
+  PQNode* last = NULL;
+  PQNode* current = from->Type() == PQNode::pnode ? NULL :
+      from->AsQNode()->endmost_children_[0];
+  PQNodeList::const_iterator i;
+  if (from->Type() == PQNode::pnode) {
+    i = from->AsPNode()->circular_link_.begin();
+    if (i != from->AsPNode()->circular_link_.end())
+      current = *i;
+  }
+
+  while (current) {
+    PQNode* copy;
+    if (current->Type() == PQNode::leaf && from_block) {
+      // Already copied, at the same offset in |leaf_block_|.
+      copy = leaf_block_ + (current->AsLeaf() - from_block);
+      copy->ClearImmediateSiblings();
+    } else if (current->Type() == PQNode::leaf) {
+      PQLeaf* leaf = ::new (*next_leaf) PQLeaf(*current->AsLeaf());
+      ++*next_leaf;
+      if (dense_leaf_address_)
+        leaf_address_[leaf->leaf_value_ - leaf_address_base_] = leaf;
+      else
+        sparse_leaf_address_[leaf->leaf_value_] = leaf;
+      copy = leaf;
+    } else {
+      const PQInternalNode* internal = current->AsInternal();
+      PQInternalNode* internal_copy;
+      if (current->Type() == PQNode::pnode)
+        internal_copy = new (&pool_) PNode(&pool_);
+      else
+        internal_copy = new (&pool_) QNode(&pool_);
+      internal_copy->CopyScalars(*internal);
+      internal_copy->pertinent_child_count = internal->pertinent_child_count;
+      internal_copy->leaf_count_ = internal->leaf_count_;
+      internal_copy->hash_ = internal->hash_;
+      internal_copy->provenance_ = internal->provenance_;
+      pending->push_back(make_pair(internal, internal_copy));
+      copy = internal_copy;
+    }
+    copy->parent_ = to;
+
+    // Link |copy| in and move on to the next child.
+    if (to->Type() == PQNode::pnode) {
+      to->AsPNode()->circular_link_.push_back(copy);
+      ++i;
+      current = i == from->AsPNode()->circular_link_.end() ? NULL : *i;
+    } else {
+      if (last_copy) {
+        last_copy->AddImmediateSibling(copy);
+        copy->AddImmediateSibling(last_copy);
+      } else {
+        to->AsQNode()->endmost_children_[0] = copy;
+      }
+      to->AsQNode()->endmost_children_[1] = copy;
+      PQNode* next = current->QNextChild(last);
+      last = current;
+      current = next;
+    }
+    last_copy = copy;
+  }
+}
+
+void PQTree::Compact() {
+  if (invalid_)
+    return;
+
+  // Move the old nodes to |old_pool|, which releases them when it goes out of
+  // scope, and build the new layout in the emptied |pool_|.  The old nodes
+  // are only read, so it does not matter that their containers still refer
+  // to |pool_|.
+  PQNodePool old_pool;
+  old_pool.Swap(&pool_);
+  PQLeaf* block = static_cast<PQLeaf*>(
+      pool_.AllocateBlock(leaf_count_ * sizeof(PQLeaf)));
+  PQLeaf* next_leaf = block;
+
+  // Copy the tree depth-first, through an explicit stack of the old nodes
+  // still to be copied, each paired with the copy of its parent.  Children
+  // are pushed last first so that they come off the stack in order.
+  vector<pair<PQNode*, PQInternalNode*> > pending;
+  vector<PQNode*> children;
+  pending.push_back(make_pair(root_, static_cast<PQInternalNode*>(NULL)));
+  while (!pending.empty()) {
+    PQNode* node = pending.back().first;
+    PQInternalNode* parent = pending.back().second;
+    pending.pop_back();
+
+    PQNode* copy;
+    if (node->Type() == PQNode::leaf) {
+      PQLeaf* leaf = ::new (next_leaf++) PQLeaf(*node->AsLeaf());
+      if (dense_leaf_address_)
+        leaf_address_[leaf->leaf_value_ - leaf_address_base_] = leaf;
+      else
+        sparse_leaf_address_[leaf->leaf_value_] = leaf;
+      copy = leaf;
+    } else {
+      PQInternalNode* internal_copy;
+      if (node->Type() == PQNode::pnode)
+        internal_copy = new (&pool_) PNode(&pool_);
+      else
+        internal_copy = new (&pool_) QNode(&pool_);
+      internal_copy->CopyScalars(*node);
+      internal_copy->pertinent_child_count =
+          node->AsInternal()->pertinent_child_count;
+      internal_copy->leaf_count_ = node->AsInternal()->leaf_count_;
+      internal_copy->hash_ = node->AsInternal()->hash_;
+      internal_copy->provenance_ = node->AsInternal()->provenance_;
+      children.clear();
+      node->Children(&children);
+      for (int i = children.size() - 1; i >= 0; --i)
+        pending.push_back(make_pair(children[i], internal_copy));
+      copy = internal_copy;
+    }
+
+    copy->parent_ = parent;
+    if (!parent) {
+      root_ = copy;
+    } else if (parent->Type() == PQNode::pnode) {
+      parent->AsPNode()->circular_link_.push_back(copy);
+    } else {
+      QNode* qnode = parent->AsQNode();
+      if (qnode->endmost_children_[1]) {
+        qnode->endmost_children_[1]->AddImmediateSibling(copy);
+        copy->AddImmediateSibling(qnode->endmost_children_[1]);
+      } else {
+        qnode->endmost_children_[0] = copy;
+      }
+      qnode->endmost_children_[1] = copy;
+    }
+  }
+  leaf_block_ = block;
+}
+
+double PQTree::Fragmentation() const {
+  // Steps to a node no further ahead than this count as local.
+  const ptrdiff_t kLocalDistance = 4096;
+
+  const char* last[2] = {NULL, NULL};
+  int steps = 0;
+  int scattered = 0;
+  vector<PQNode*> pending, children;
+  pending.push_back(root_);
+  while (!pending.empty()) {
+    PQNode* node = pending.back();
+    pending.pop_back();
+    int kind = node->Type() == PQNode::leaf ? 0 : 1;
+    const char* address = reinterpret_cast<const char*>(node);
+    if (last[kind]) {
+      ++steps;
+      ptrdiff_t distance = address - last[kind];
+      if (distance <= 0 || distance > kLocalDistance)
+        ++scattered;
+    }
+    last[kind] = address;
+    if (kind) {
+      children.clear();
+      node->Children(&children);
+      pending.insert(pending.end(), children.rbegin(), children.rend());
+    }
   }
+  return steps ? double(scattered) / steps : 0;
 }
 
 PQNode* PQTree::Root() {
@@ -698,55 +1407,80 @@ string PQTree::Print() const {
 
 //reduces the tree but protects if from becoming invalid
 //if the reduction fails, takes more time
-bool PQTree::SafeReduce(set<int> S) {
+bool PQTree::SafeReduce(const set<int>& S) {
   //using a backup copy to enforce safety
   PQTree toCopy(*this);
 
   if (!Reduce(S)) {
-    //reduce failed, so perform a copy
-    root_ = new PQNode(*toCopy.root_);
+    //reduce failed, so perform a copy.  The failed nodes move to
+    //|failed_pool|, which frees them on return, so that the copy goes into
+    //an emptied |pool_| and rejected reductions do not grow the tree.
+    PQNodePool failed_pool;
+    failed_pool.Swap(&pool_);
+    root_ = toCopy.root_->DeepCopy(&pool_);
     block_count_ = toCopy.block_count_;
     blocked_nodes_ = toCopy.blocked_nodes_;
     off_the_top_ = toCopy.off_the_top_;
     invalid_ = toCopy.invalid_;
-    leaf_address_.clear();
-    root_->FindLeaves(leaf_address_);
+    pseudonode_ = NULL;
+    pertinent_root_ = NULL;
+    vector<PQLeaf*> leaves;
+    root_->FindLeaves(leaves);
+    IndexLeaves(leaves);
+    frontier_valid_ = false;
+    CopyFrontierCount(toCopy);
     return false;
   }
   return true;
 }
 
-bool PQTree::SafeReduceAll(list<set<int> > L) {
+bool PQTree::SafeReduceAll(const list<set<int> >& L) {
   //using a backup copy to enforce safety
   PQTree toCopy(*this);
   if (!ReduceAll(L)) {
-    //reduce failed, so perform a copy
-    root_ = new PQNode(*toCopy.root_);
+    //reduce failed, so perform a copy.  The failed nodes move to
+    //|failed_pool|, which frees them on return, so that the copy goes into
+    //an emptied |pool_| and rejected reductions do not grow the tree.
+    PQNodePool failed_pool;
+    failed_pool.Swap(&pool_);
+    root_ = toCopy.root_->DeepCopy(&pool_);
     block_count_ = toCopy.block_count_;
     blocked_nodes_ = toCopy.blocked_nodes_;
     off_the_top_ = toCopy.off_the_top_;
     invalid_ = toCopy.invalid_;
-    leaf_address_.clear();
-    root_->FindLeaves(leaf_address_);
+    pseudonode_ = NULL;
+    pertinent_root_ = NULL;
+    vector<PQLeaf*> leaves;
+    root_->FindLeaves(leaves);
+    IndexLeaves(leaves);
+    frontier_valid_ = false;
+    CopyFrontierCount(toCopy);
     return false;
   }
   return true;
 }
 
 
-bool PQTree::Reduce(set<int> reduction_set) {
+bool PQTree::Reduce(const set<int>& reduction_set) {
   if (reduction_set.size() < 2) {
-    reductions_.push_back(reduction_set);
+    if (record_reductions_)
+      reductions_.push_back(reduction_set);
+    if (explain_conflicts_)
+      provenance_begins_.push_back(provenance_deps_.size());
     return true;
   }
   if (invalid_)
     return false;
+  if (explain_conflicts_)
+    provenance_begins_.push_back(provenance_deps_.size());
   if (!Bubble(reduction_set)) {
     invalid_ = true;
+    NoteConflict(/*before_changes=*/ true);
     return false;
   }
   if (!ReduceStep(reduction_set)) {
     invalid_ = true;
+    NoteConflict(/*before_changes=*/ false);
     return false;
   }
 
@@ -754,24 +1488,1377 @@ bool PQTree::Reduce(set<int> reduction_set) {
   root_->Reset();
 
   // Store the reduction set for later lookup.
-  reductions_.push_back(reduction_set);
+  if (record_reductions_)
+    reductions_.push_back(reduction_set);
   return true;
 }
 
-bool PQTree::ReduceAll(list<set<int> > L) {
-  for (list<set<int> >::iterator S = L.begin(); S != L.end(); S++) {
+bool PQTree::ReduceAll(const list<set<int> >& L) {
+  list<set<int> >::const_iterator S = L.begin();
+  advance(S, ReduceLaminarPrefix(L));
+  for (; S != L.end(); S++) {
     if (!Reduce(*S))
       return false;
   }
   return true;
 }
 
+bool PQTree::ReduceAllPreprocessed(const list<set<int> >& L) {
+  // Drop the trivial sets, then the duplicates, which sort next to the
+  // first of their kind by hash and then by position.
+  vector<const set<int>*> candidates;
+  for (list<set<int> >::const_iterator S = L.begin(); S != L.end(); ++S) {
+    if (S->size() < 2)
+      continue;
+    bool every_leaf = S->size() == leaf_count_;
+    for (set<int>::const_iterator i = S->begin(); every_leaf && i != S->end();
+         ++i)
+      every_leaf = LeafAddress(*i) != NULL;
+    if (!every_leaf)
+      candidates.push_back(&*S);
+  }
+  vector<pair<uint64_t, int> > hashes;
+  for (int i = 0; i < candidates.size(); ++i)
+    hashes.push_back(make_pair(SetHash(*candidates[i]), i));
+  sort(hashes.begin(), hashes.end());
+  vector<bool> duplicate(candidates.size(), false);
+  for (int i = 1; i < hashes.size(); ++i) {
+    for (int j = i - 1; j >= 0 && hashes[j].first == hashes[i].first; --j) {
+      if (!duplicate[hashes[j].second] &&
+          *candidates[hashes[j].second] == *candidates[hashes[i].second]) {
+        duplicate[hashes[i].second] = true;
+        break;
+      }
+    }
+  }
+  list<set<int> > kept;
+  for (int i = 0; i < candidates.size(); ++i) {
+    if (!duplicate[i])
+      kept.push_back(*candidates[i]);
+  }
+  if (invalid_ || explain_conflicts_ || !Unreduced())
+    return ReduceAll(kept);
+
+  // Find the sets each leaf is in, as a hash and as a list.  A set with a
+  // value which is not a leaf is left for Reduce(), which rejects it.
+  map<int, int> slots;
+  LeafSlots(&slots);
+  int slot_count = SlotCount(slots);
+  vector<uint64_t> membership_hashes(slot_count, 0xcbf29ce484222325ULL);
+  vector<int> membership_begins(slot_count + 1, 0);
+  for (list<set<int> >::iterator S = kept.begin(); S != kept.end(); ++S) {
+    for (set<int>::iterator i = S->begin(); i != S->end(); ++i) {
+      if (!LeafAddress(*i))
+        return ReduceAll(kept);
+      membership_begins[LeafSlot(*i, slots) + 1]++;
+    }
+  }
+  for (int i = 0; i < slot_count; ++i)
+    membership_begins[i + 1] += membership_begins[i];
+  vector<int> memberships(membership_begins[slot_count]);
+  vector<int> filled(membership_begins.begin(), membership_begins.end() - 1);
+  int index = 0;
+  for (list<set<int> >::iterator S = kept.begin(); S != kept.end(); ++S) {
+    for (set<int>::iterator i = S->begin(); i != S->end(); ++i) {
+      int slot = LeafSlot(*i, slots);
+      membership_hashes[slot] =
+          (membership_hashes[slot] ^ unsigned(index)) * 0x100000001b3ULL;
+      memberships[filled[slot]++] = index;
+    }
+    ++index;
+  }
+
+  // Group the leaves in some set into classes of twins by hash, checking
+  // the lists, with the first slot of each class as its representative.
+  // Leaves in no set are left alone, as they may go anywhere.
+  vector<PQLeaf*> slot_leaves(slot_count, NULL);
+  PNode* root = root_->AsPNode();
+  for (PQNodeList::iterator i = root->circular_link_.begin();
+       i != root->circular_link_.end(); ++i)
+    slot_leaves[LeafSlot((*i)->AsLeaf()->LeafValue(), slots)] = (*i)->AsLeaf();
+  vector<pair<uint64_t, int> > leaf_hashes;
+  for (int i = 0; i < slot_count; ++i) {
+    if (membership_begins[i] != membership_begins[i + 1])
+      leaf_hashes.push_back(make_pair(membership_hashes[i], i));
+  }
+  sort(leaf_hashes.begin(), leaf_hashes.end());
+  vector<int> representatives(slot_count);
+  for (int i = 0; i < slot_count; ++i)
+    representatives[i] = i;
+  vector<PNode*> twins(slot_count, NULL);
+  int twin_count = 0;
+  for (int i = 1; i < leaf_hashes.size(); ++i) {
+    int slot = leaf_hashes[i].second;
+    for (int j = i - 1;
+         j >= 0 && leaf_hashes[j].first == leaf_hashes[i].first; --j) {
+      int other = leaf_hashes[j].second;
+      if (representatives[other] != other ||
+          membership_begins[slot + 1] - membership_begins[slot] !=
+              membership_begins[other + 1] - membership_begins[other] ||
+          !equal(memberships.begin() + membership_begins[slot],
+                 memberships.begin() + membership_begins[slot + 1],
+                 memberships.begin() + membership_begins[other]))
+        continue;
+      representatives[slot] = other;
+      if (!twins[other]) {
+        twins[other] = new (&pool_) PNode(&pool_);
+        twins[other]->circular_link_.push_back(slot_leaves[other]);
+      }
+      twins[other]->circular_link_.push_back(slot_leaves[slot]);
+      ++twin_count;
+      break;
+    }
+  }
+  if (twin_count == 0 || leaf_count_ - twin_count < 2) {
+    for (int i = 0; i < slot_count; ++i) {
+      if (twins[i]) {
+        twins[i]->circular_link_.clear();
+        PQNode::Delete(twins[i], &pool_);
+      }
+    }
+    return ReduceAll(kept);
+  }
+
+  // Reduce a tree of the representatives, taking the twins out of the root,
+  // by the sets left with only their representatives, one to one with the
+  // sets kept.
+  CountPNode(root, -1);
+  for (PQNodeList::iterator i = root->circular_link_.begin();
+       i != root->circular_link_.end();) {
+    int slot = LeafSlot((*i)->AsLeaf()->LeafValue(), slots);
+    if (representatives[slot] != slot)
+      i = root->circular_link_.erase(i);
+    else
+      ++i;
+  }
+  CountPNode(root, 1);
+  int total_leaves = leaf_count_;
+  leaf_count_ -= twin_count;
+  root->leaf_count_ = leaf_count_;
+  list<set<int> > compressed;
+  for (list<set<int> >::iterator S = kept.begin(); S != kept.end(); ++S) {
+    compressed.push_back(set<int>());
+    for (set<int>::iterator i = S->begin(); i != S->end(); ++i) {
+      int slot = LeafSlot(*i, slots);
+      if (representatives[slot] == slot)
+        compressed.back().insert(compressed.back().end(), *i);
+    }
+  }
+  bool record = record_reductions_;
+  record_reductions_ = false;
+  int reduced = ReduceLaminarPrefix(compressed);
+  list<set<int> >::iterator S = compressed.begin();
+  advance(S, reduced);
+  for (; S != compressed.end() && Reduce(*S); ++S)
+    ++reduced;
+  record_reductions_ = record;
+  leaf_count_ = total_leaves;
+  if (record_reductions_) {
+    list<set<int> >::iterator K = kept.begin();
+    for (int i = 0; i < reduced; ++i, ++K)
+      reductions_.push_back(*K);
+  }
+  if (invalid_)
+    return false;
+
+  // Merging the twins constrains the tree beyond the sets kept, so each
+  // class is recorded as well.
+  for (int i = 0; i < slot_count; ++i) {
+    if (!twins[i])
+      continue;
+    CountPNode(twins[i], 1);
+    if (record_reductions_) {
+      reductions_.push_back(set<int>());
+      for (PQNodeList::iterator j = twins[i]->circular_link_.begin();
+           j != twins[i]->circular_link_.end(); ++j)
+        reductions_.back().insert((*j)->AsLeaf()->LeafValue());
+    }
+  }
+  ExpandTwins(twins, slots);
+  return true;
+}
+
+void PQTree::ExpandTwins(const vector<PNode*>& twins,
+                         const map<int, int>& slots) {
+  // Replace each representative on the way down, and recount the leaves of
+  // the nodes met in reverse, children before parents.  The new P-Nodes only
+  // hold leaves, so they are not walked.
+  for (int i = 0; i < twins.size(); ++i) {
+    if (!twins[i])
+      continue;
+    PQNodeList& children = twins[i]->circular_link_;
+    for (PQNodeList::iterator j = children.begin(); j != children.end(); ++j)
+      (*j)->parent_ = twins[i];
+  }
+  vector<PQInternalNode*> internal;
+  vector<PQNode*> stack(1, root_);
+  while (!stack.empty()) {
+    PQNode* node = stack.back();
+    stack.pop_back();
+    if (node->Type() == PQNode::leaf)
+      continue;
+    internal.push_back(node->AsInternal());
+    if (node->Type() == PQNode::pnode) {
+      PQNodeList& children = node->AsPNode()->circular_link_;
+      for (PQNodeList::iterator i = children.begin(); i != children.end();
+           ++i) {
+        if ((*i)->Type() == PQNode::leaf) {
+          PNode* expanded = twins[LeafSlot((*i)->AsLeaf()->LeafValue(), slots)];
+          if (expanded) {
+            *i = expanded;
+            expanded->parent_ = node->AsPNode();
+            internal.push_back(expanded);
+            continue;
+          }
+        }
+        stack.push_back(*i);
+      }
+      continue;
+    }
+    QNode* qnode = node->AsQNode();
+    PQNode* last = NULL;
+    PQNode* current = qnode->endmost_children_[0];
+    while (current) {
+      PQNode* next = current->QNextChild(last);
+      if (current->Type() == PQNode::leaf) {
+        PNode* expanded =
+            twins[LeafSlot(current->AsLeaf()->LeafValue(), slots)];
+        if (expanded) {
+          qnode->ReplaceChild(current, expanded);
+          expanded->parent_ = qnode;
+          current->ClearImmediateSiblings();
+          current->parent_ = expanded;
+          internal.push_back(expanded);
+          last = expanded;
+          current = next;
+          continue;
+        }
+      }
+      stack.push_back(current);
+      last = current;
+      current = next;
+    }
+  }
+
+  vector<PQNode*> children;
+  for (int i = internal.size() - 1; i >= 0; --i) {
+    PQInternalNode* node = internal[i];
+    children.clear();
+    node->Children(&children);
+    node->leaf_count_ = 0;
+    for (int j = 0; j < children.size(); ++j)
+      node->leaf_count_ += children[j]->LeafCount();
+    node->hash_ = 0;
+  }
+  frontier_valid_ = false;
+}
+
+int PQTree::ReduceLaminarPrefix(const list<set<int> >& L) {
+  // Reductions which have left the tree a single P-Node over its leaves have
+  // not changed it.  The provenance of the nodes built is not noted, so
+  // explaining conflicts takes the usual path.
+  if (invalid_ || explain_conflicts_ || !Unreduced())
+    return 0;
+  vector<const set<int>*> sets;
+  for (list<set<int> >::const_iterator S = L.begin(); S != L.end(); ++S)
+    sets.push_back(&*S);
+  map<int, int> slots;
+  LeafSlots(&slots);
+
+  // The whole family is checked first, as it is often laminar throughout.
+  // Otherwise the longest laminar prefix is found by binary search, cut short
+  // by the prefixes each failed check names.
+  int laminar = 0;
+  int not_laminar = LaminarPass(sets, sets.size(), slots, false);
+  if (not_laminar < 0)
+    laminar = sets.size();
+  while (not_laminar - laminar > 1) {
+    int middle = (laminar + not_laminar) / 2;
+    int failed = LaminarPass(sets, middle, slots, false);
+    if (failed < 0)
+      laminar = middle;
+    else
+      not_laminar = failed;
+  }
+  if (laminar == 0)
+    return 0;
+
+  LaminarPass(sets, laminar, slots, true);
+  if (record_reductions_) {
+    for (int i = 0; i < laminar; ++i)
+      reductions_.push_back(*sets[i]);
+  }
+  return laminar;
+}
+
+bool PQTree::Unreduced() const {
+  return root_->Type() == PQNode::pnode &&
+         root_->AsPNode()->ChildCount() == leaf_count_;
+}
+
+void PQTree::LeafSlots(map<int, int>* slots) const {
+  if (dense_leaf_address_)
+    return;
+  for (map<int, PQLeaf*>::const_iterator i = sparse_leaf_address_.begin();
+       i != sparse_leaf_address_.end(); ++i)
+    slots->insert(make_pair(i->first, slots->size()));
+}
+
+int PQTree::LeafSlot(int value, const map<int, int>& slots) const {
+  if (dense_leaf_address_)
+    return value - leaf_address_base_;
+  return slots.find(value)->second;
+}
+
+int PQTree::SlotCount(const map<int, int>& slots) const {
+  return dense_leaf_address_ ? leaf_address_.size() : slots.size();
+}
+
+int PQTree::LaminarPass(const vector<const set<int>*>& sets, int count,
+                        const map<int, int>& slots, bool build) {
+  // Each leaf has a slot, and each disjoint set of slots stands for the
+  // node at the top of the hierarchy built so far above them, which has
+  // |leaves|[i] leaves and was built for |sets|[|owners|[i]], where i is
+  // the representative slot.
+  int slot_count = SlotCount(slots);
+  vector<int> parent(slot_count);
+  for (int i = 0; i < slot_count; ++i)
+    parent[i] = i;
+  vector<int> leaves(slot_count, 1);
+  vector<int> owners(slot_count, -1);
+  vector<int> hits(slot_count, 0);
+  vector<int> stamps(slot_count, -1);
+  vector<PQNode*> tops;
+  PNode* root = root_->AsPNode();
+  if (build) {
+    tops.resize(slot_count);
+    for (PQNodeList::iterator i = root->circular_link_.begin();
+         i != root->circular_link_.end(); ++i) {
+      tops[LeafSlot((*i)->AsLeaf()->LeafValue(), slots)] = *i;
+    }
+  }
+
+  // Sets of fewer than two leaves or of every leaf leave no trace.
+  vector<int> order;
+  for (int i = 0; i < count; ++i) {
+    if (sets[i]->size() >= 2 && sets[i]->size() < leaf_count_)
+      order.push_back(i);
+  }
+  stable_sort(order.begin(), order.end(), BySetSize(sets));
+
+  // Every set smaller than |S| is inside it or apart from it exactly when
+  // the tops of the nodes built so far over the leaves of |S| hold no other
+  // leaves.  One holding others was built for a set which overlaps |S|.
+  vector<int> tops_found;
+  for (int i = 0; i < order.size(); ++i) {
+    const set<int>& S = *sets[order[i]];
+    tops_found.clear();
+    for (set<int>::const_iterator j = S.begin(); j != S.end(); ++j) {
+      if (!LeafAddress(*j))
+        return order[i] + 1;
+      int top = FindSet(&parent, LeafSlot(*j, slots));
+      if (stamps[top] != i) {
+        stamps[top] = i;
+        hits[top] = 0;
+        tops_found.push_back(top);
+      }
+      hits[top]++;
+    }
+    for (int j = 0; j < tops_found.size(); ++j) {
+      int top = tops_found[j];
+      if (hits[top] < leaves[top])
+        return max(order[i], owners[top]) + 1;
+    }
+    // The set is the same as the one the single top was built for.
+    if (tops_found.size() == 1)
+      continue;
+
+    int merged = tops_found[0];
+    for (int j = 1; j < tops_found.size(); ++j) {
+      if (leaves[tops_found[j]] > leaves[merged])
+        merged = tops_found[j];
+    }
+    PNode* node = NULL;
+    if (build) {
+      node = new (&pool_) PNode(&pool_);
+      node->leaf_count_ = S.size();
+    }
+    for (int j = 0; j < tops_found.size(); ++j) {
+      int top = tops_found[j];
+      parent[top] = merged;
+      if (build) {
+        tops[top]->parent_ = node;
+        node->circular_link_.push_back(tops[top]);
+      }
+    }
+    leaves[merged] = S.size();
+    owners[merged] = order[i];
+    if (build) {
+      tops[merged] = node;
+      CountPNode(node, 1);
+    }
+  }
+  if (!build)
+    return -1;
+
+  // The tops left become the children of the root, in place of its leaves.
+  CountPNode(root, -1);
+  vector<PQNode*> old_children(root->circular_link_.begin(),
+                               root->circular_link_.end());
+  root->circular_link_.clear();
+  for (int i = 0; i < old_children.size(); ++i) {
+    int value = old_children[i]->AsLeaf()->LeafValue();
+    int top = FindSet(&parent, LeafSlot(value, slots));
+    if (stamps[top] != -2) {
+      stamps[top] = -2;
+      tops[top]->parent_ = root;
+      root->circular_link_.push_back(tops[top]);
+    }
+  }
+  CountPNode(root, 1);
+  root->hash_ = 0;
+  frontier_valid_ = false;
+  return -1;
+}
+
+bool PQTree::ReduceOrSkip(const set<int>& reduction_set) {
+  if (reduction_set.size() < 2)
+    return Reduce(reduction_set);
+  if (invalid_)
+    return false;
+  for (set<int>::const_iterator i = reduction_set.begin();
+       i != reduction_set.end(); ++i) {
+    if (!LeafAddress(*i))
+      return false;
+  }
+  if (explain_conflicts_)
+    provenance_begins_.push_back(provenance_deps_.size());
+  if (!Bubble(reduction_set) || !LabelPertinent(reduction_set)) {
+    NoteConflict(/*before_changes=*/ true);
+    CleanPseudo();
+    root_->Reset();
+    return false;
+  }
+
+  // LabelPertinent() has checked every template ReduceStep() will need, so
+  // it cannot fail.  Should it fail all the same, the tree is left half
+  // restructured, and is invalid like after a failed Reduce().
+  UnlabelPertinent(reduction_set);
+  bool reduced = ReduceStep(reduction_set);
+  assert(reduced);
+  if (!reduced) {
+    invalid_ = true;
+    NoteConflict(/*before_changes=*/ false);
+    return false;
+  }
+  root_->Reset();
+  if (record_reductions_)
+    reductions_.push_back(reduction_set);
+  return true;
+}
+
+vector<bool> PQTree::ReduceAllSkipping(const list<set<int> >& L,
+                                       ReductionOrder order,
+                                       const vector<double>& weights) {
+  vector<const set<int>*> sets;
+  for (list<set<int> >::const_iterator S = L.begin(); S != L.end(); ++S)
+    sets.push_back(&*S);
+  vector<int> attempts;
+  for (int i = 0; i < sets.size(); ++i)
+    attempts.push_back(i);
+  if (order == ascending_size)
+    stable_sort(attempts.begin(), attempts.end(), BySetSize(sets));
+  else if (order == by_weight)
+    stable_sort(attempts.begin(), attempts.end(), ByWeight(weights));
+
+  vector<bool> kept(sets.size(), false);
+  for (int i = 0; i < attempts.size(); ++i)
+    kept[attempts[i]] = ReduceOrSkip(*sets[attempts[i]]);
+  return kept;
+}
+
+void PQTree::SetRecordReductions(bool record) {
+  record_reductions_ = record;
+}
+
+void PQTree::SetExplainConflicts(bool explain) {
+  if (explain && !explain_conflicts_) {
+    // Whatever was done to the tree so far is accounted for by all the
+    // reductions so far, which every node is marked with -2 to stand for.
+    first_explained_ = reductions_.size();
+    provenance_begins_.clear();
+    provenance_deps_.clear();
+    has_conflict_ = false;
+    vector<PQNode*> stack(1, root_);
+    vector<PQNode*> children;
+    while (!invalid_ && !stack.empty()) {
+      PQNode* node = stack.back();
+      stack.pop_back();
+      if (node->Type() == PQNode::leaf)
+        continue;
+      node->AsInternal()->provenance_ = -2;
+      children.clear();
+      node->Children(&children);
+      stack.insert(stack.end(), children.begin(), children.end());
+    }
+  }
+  explain_conflicts_ = explain;
+}
+
+bool PQTree::ExplainConflict(vector<int>* conflict) const {
+  conflict->clear();
+  if (!has_conflict_ || !explainable_)
+    return false;
+
+  // Follow the provenance of the nodes the failed reduction ran into back
+  // through the reductions which produced them.
+  int explained = provenance_begins_.size();
+  vector<bool> needed(explained, false);
+  bool all_earlier = false;
+  vector<int> stack(conflict_);
+  while (!stack.empty()) {
+    int reduction = stack.back();
+    stack.pop_back();
+    if (reduction < first_explained_) {
+      all_earlier = true;
+      continue;
+    }
+    int i = reduction - first_explained_;
+    if (needed[i])
+      continue;
+    needed[i] = true;
+    int end = i + 1 < explained ? provenance_begins_[i + 1]
+                                : provenance_deps_.size();
+    stack.insert(stack.end(), provenance_deps_.begin() + provenance_begins_[i],
+                 provenance_deps_.begin() + end);
+  }
+
+  if (all_earlier) {
+    for (int i = 0; i < first_explained_; ++i)
+      conflict->push_back(i);
+  }
+  for (int i = 0; i < explained; ++i) {
+    if (needed[i])
+      conflict->push_back(first_explained_ + i);
+  }
+  return true;
+}
+
 list<int> PQTree::Frontier() {
-  list<int> out;
-  root_->FindFrontier(out);
+  const vector<int>& frontier = FrontierArray();
+  return list<int>(frontier.begin(), frontier.end());
+}
+
+const vector<int>& PQTree::FrontierArray() {
+  if (!frontier_valid_) {
+    frontier_.resize(leaf_count_);
+    dirty_ranges_.clear();
+    EmitFrontier(0, leaf_count_);
+    frontier_valid_ = true;
+    return frontier_;
+  }
+
+  // Rewrite the union of the dirty ranges, merging those that overlap.
+  sort(dirty_ranges_.begin(), dirty_ranges_.end());
+  for (int i = 0; i < dirty_ranges_.size();) {
+    int begin = dirty_ranges_[i].first;
+    int end = dirty_ranges_[i].second;
+    for (++i; i < dirty_ranges_.size() && dirty_ranges_[i].first <= end; ++i)
+      end = max(end, dirty_ranges_[i].second);
+    EmitFrontier(begin, end);
+  }
+  dirty_ranges_.clear();
+  return frontier_;
+}
+
+void PQTree::EmitFrontier(int begin, int end) {
+  // Descend only into the children whose leaves overlap [begin, end), through
+  // an explicit stack of nodes paired with the position of their first leaf.
+  vector<pair<PQNode*, int> > pending;
+  pending.push_back(make_pair(root_, 0));
+  while (!pending.empty()) {
+    PQNode* node = pending.back().first;
+    int position = pending.back().second;
+    pending.pop_back();
+    if (node->Type() == PQNode::leaf) {
+      frontier_[position] = node->AsLeaf()->leaf_value_;
+    } else if (node->Type() == PQNode::pnode) {
+      PNode* pnode = node->AsPNode();
+      for (PQNodeList::iterator i = pnode->circular_link_.begin();
+           i != pnode->circular_link_.end() && position < end; ++i) {
+        int next = position + (*i)->LeafCount();
+        if (next > begin)
+          pending.push_back(make_pair(*i, position));
+        position = next;
+      }
+    } else {
+      for (QNodeChildrenIterator it(node->AsQNode());
+           !it.IsDone() && position < end; it.Next()) {
+        int next = position + it.Current()->LeafCount();
+        if (next > begin)
+          pending.push_back(make_pair(it.Current(), position));
+        position = next;
+      }
+    }
+  }
+}
+
+void PQTree::SamplingLayout(vector<int>* layout) const {
+  // Nodes are entered with -1 and left with the index of their entry, at
+  // which point the end of their subtree is known.
+  layout->clear();
+  vector<pair<PQNode*, int> > pending;
+  pending.push_back(make_pair(root_, -1));
+  while (!pending.empty()) {
+    PQNode* node = pending.back().first;
+    int entry = pending.back().second;
+    pending.pop_back();
+    if (entry >= 0) {
+      (*layout)[entry + 2] = layout->size();
+      continue;
+    }
+    entry = layout->size();
+    layout->push_back(node->Type());
+    if (node->Type() == PQNode::leaf) {
+      layout->push_back(node->AsLeaf()->leaf_value_);
+      layout->push_back(entry + 3);
+      continue;
+    }
+    layout->push_back(0);
+    layout->push_back(0);
+    pending.push_back(make_pair(node, entry));
+    int first = pending.size();
+    if (node->Type() == PQNode::pnode) {
+      PNode* pnode = node->AsPNode();
+      for (PQNodeList::iterator i = pnode->circular_link_.begin();
+           i != pnode->circular_link_.end(); ++i)
+        pending.push_back(make_pair(*i, -1));
+    } else {
+      for (QNodeChildrenIterator it(node->AsQNode()); !it.IsDone(); it.Next())
+        pending.push_back(make_pair(it.Current(), -1));
+    }
+    (*layout)[entry + 1] = pending.size() - first;
+    reverse(pending.begin() + first, pending.end());
+  }
+}
+
+void PQTree::CanonicalLayout(vector<int>* canonical) const {
+  vector<int> layout;
+  SamplingLayout(&layout);
+  int nodes = layout.size() / 3;
+
+  // Find each node's parent and, walking backwards so that children come
+  // before their parents, the smallest leaf below it, as an unsigned key
+  // which sorts like the value.
+  vector<int> parents(nodes, -1);
+  vector<unsigned int> smallest(nodes, ~0u);
+  for (int entry = layout.size() - 3; entry >= 0; entry -= 3) {
+    int node = entry / 3;
+    if (layout[entry] == PQNode::leaf)
+      smallest[node] = unsigned(layout[entry + 1]) ^ 0x80000000u;
+    for (int child = entry + 3; child < layout[entry + 2];
+         child = layout[child + 2]) {
+      parents[child / 3] = node;
+      smallest[node] = min(smallest[node], smallest[child / 3]);
+    }
+  }
+
+  // Radix sort every node but the root by its smallest leaf, a byte at a
+  // time.
+  vector<int> order, sorted(nodes - 1);
+  for (int node = 1; node < nodes; ++node)
+    order.push_back(node);
+  for (int shift = 0; shift < 32; shift += 8) {
+    int starts[257] = {0};
+    for (int i = 0; i < order.size(); ++i)
+      ++starts[((smallest[order[i]] >> shift) & 0xff) + 1];
+    for (int digit = 0; digit < 256; ++digit)
+      starts[digit + 1] += starts[digit];
+    for (int i = 0; i < order.size(); ++i)
+      sorted[starts[(smallest[order[i]] >> shift) & 0xff]++] = order[i];
+    order.swap(sorted);
+  }
+
+  // Deal the sorted nodes out to their parents, which leaves the children of
+  // every node in order of their smallest leaf.  The children of a Q-Node
+  // are then put back in their own order, smallest end first.
+  vector<int> child_begins(nodes + 1, 0);
+  for (int node = 0; node < nodes; ++node) {
+    int entry = node * 3;
+    child_begins[node + 1] = child_begins[node] +
+        (layout[entry] == PQNode::leaf ? 0 : layout[entry + 1]);
+  }
+  vector<int> children(child_begins[nodes]);
+  vector<int> next(child_begins.begin(), child_begins.end() - 1);
+  for (int i = 0; i < order.size(); ++i)
+    children[next[parents[order[i]]]++] = order[i];
+  for (int node = 0; node < nodes; ++node) {
+    int entry = node * 3;
+    if (layout[entry] != PQNode::qnode)
+      continue;
+    int slot = child_begins[node];
+    for (int child = entry + 3; child < layout[entry + 2];
+         child = layout[child + 2])
+      children[slot++] = child / 3;
+    int first = child_begins[node];
+    int last = child_begins[node + 1] - 1;
+    if (smallest[children[first]] > smallest[children[last]])
+      reverse(children.begin() + first, children.begin() + last + 1);
+  }
+
+  canonical->clear();
+  vector<int> pending;
+  if (nodes)
+    pending.push_back(0);
+  while (!pending.empty()) {
+    int node = pending.back();
+    pending.pop_back();
+    canonical->push_back(layout[node * 3]);
+    canonical->push_back(layout[node * 3 + 1]);
+    for (int i = child_begins[node + 1] - 1; i >= child_begins[node]; --i)
+      pending.push_back(children[i]);
+  }
+}
+
+bool PQTree::Equivalent(const PQTree& a, const PQTree& b) {
+  if (a.invalid_ || b.invalid_)
+    return a.invalid_ && b.invalid_;
+  if (a.leaf_count_ != b.leaf_count_)
+    return false;
+  vector<int> canonical_a, canonical_b;
+  a.CanonicalLayout(&canonical_a);
+  b.CanonicalLayout(&canonical_b);
+  return canonical_a == canonical_b;
+}
+
+void PQTree::StructureReductions(list<set<int> >* reductions) const {
+  // The leaves below each node are consecutive in |layout|, so every set is
+  // a run of |leaves|.  |firsts| holds the index in |leaves| of the first
+  // leaf below each node.
+  vector<int> layout;
+  SamplingLayout(&layout);
+  vector<int> leaves, firsts(layout.size() / 3 + 1);
+  for (int entry = 0; entry < layout.size(); entry += 3) {
+    firsts[entry / 3] = leaves.size();
+    if (layout[entry] == PQNode::leaf)
+      leaves.push_back(layout[entry + 1]);
+  }
+  firsts.back() = leaves.size();
+
+  for (int entry = 0; entry < layout.size(); entry += 3) {
+    int end = layout[entry + 2] / 3;
+    if (layout[entry] == PQNode::pnode && entry > 0) {
+      reductions->push_back(set<int>(leaves.begin() + firsts[entry / 3],
+                                     leaves.begin() + firsts[end]));
+    } else if (layout[entry] == PQNode::qnode) {
+      int child = entry + 3;
+      int next = layout[child + 2];
+      while (next < layout[entry + 2]) {
+        reductions->push_back(set<int>(
+            leaves.begin() + firsts[child / 3],
+            leaves.begin() + firsts[layout[next + 2] / 3]));
+        child = next;
+        next = layout[child + 2];
+      }
+    }
+  }
+}
+
+bool PQTree::Intersect(PQTree* a, const PQTree& b) {
+  // Reduce() takes every value it is given to be a leaf, and a leaf of |b|
+  // directly below its root is in none of the sets, so each leaf of |b| is
+  // looked up in |a| first.
+  bool covered = true;
+  if (b.dense_leaf_address_) {
+    for (int i = 0; covered && i < b.leaf_address_.size(); ++i) {
+      covered = !b.leaf_address_[i] ||
+                a->LeafAddress(b.leaf_address_base_ + i) != NULL;
+    }
+  } else {
+    for (map<int, PQLeaf*>::const_iterator i = b.sparse_leaf_address_.begin();
+         covered && i != b.sparse_leaf_address_.end(); ++i)
+      covered = a->LeafAddress(i->first) != NULL;
+  }
+  if (!covered) {
+    a->invalid_ = true;
+    return false;
+  }
+  list<set<int> > reductions;
+  b.StructureReductions(&reductions);
+  return a->ReduceAll(reductions);
+}
+
+bool PQTree::IntersectAll(const vector<PQTree*>& trees) {
+  bool intersected = true;
+  for (int step = 1; step < trees.size(); step *= 2) {
+    for (int i = 0; i + step < trees.size(); i += 2 * step) {
+      if (!Intersect(trees[i], *trees[i + step]))
+        intersected = false;
+    }
+  }
+  return intersected;
+}
+
+void PQTree::LayoutOrdinals(const vector<int>& layout, vector<int>* dense,
+                            map<int, int>* sparse) const {
+  dense->clear();
+  sparse->clear();
+  if (dense_leaf_address_)
+    dense->resize(leaf_address_.size(), -1);
+  int ordinal = 0;
+  for (int entry = 0; entry < layout.size(); entry += 3) {
+    if (layout[entry] != PQNode::leaf)
+      continue;
+    if (dense_leaf_address_)
+      (*dense)[layout[entry + 1] - leaf_address_base_] = ordinal++;
+    else
+      (*sparse)[layout[entry + 1]] = ordinal++;
+  }
+}
+
+bool PQTree::AdmitsLayout(const vector<int>& layout, const vector<int>& dense,
+                          const map<int, int>& sparse,
+                          const vector<int>& permutation,
+                          vector<int>* positions, vector<int>* spans) const {
+  // Find where each leaf is in |permutation|, by leaf number.
+  int leaves = root_->LeafCount();
+  if (permutation.size() != leaves)
+    return false;
+  positions->assign(leaves, -1);
+  for (int i = 0; i < leaves; ++i) {
+    int ordinal;
+    if (dense_leaf_address_) {
+      unsigned int offset = unsigned(permutation[i]) -
+                            unsigned(leaf_address_base_);
+      ordinal = offset < dense.size() ? dense[offset] : -1;
+    } else {
+      map<int, int>::const_iterator it = sparse.find(permutation[i]);
+      ordinal = it == sparse.end() ? -1 : it->second;
+    }
+    if (ordinal < 0 || (*positions)[ordinal] >= 0)
+      return false;
+    (*positions)[ordinal] = i;
+  }
+
+  // Every node comes after its parent in |layout|, so walking it backwards
+  // finds the first and last position of each node's children before the
+  // node itself.  A node's leaves are consecutive when they span as many
+  // positions as there are of them.
+  spans->resize(layout.size());
+  int ordinal = leaves;
+  for (int entry = layout.size() - 3; entry >= 0; entry -= 3) {
+    if (layout[entry] == PQNode::leaf) {
+      (*spans)[entry] = (*spans)[entry + 1] = (*positions)[--ordinal];
+      (*spans)[entry + 2] = 1;
+      continue;
+    }
+    int first = leaves;
+    int last = -1;
+    int count = 0;
+    bool forward = true;
+    bool backward = true;
+    int previous = -1;
+    for (int child = entry + 3; child < layout[entry + 2];
+         child = layout[child + 2]) {
+      first = min(first, (*spans)[child]);
+      last = max(last, (*spans)[child + 1]);
+      count += (*spans)[child + 2];
+      if (previous >= 0) {
+        forward = forward && (*spans)[child] == (*spans)[previous + 1] + 1;
+        backward = backward && (*spans)[previous] == (*spans)[child + 1] + 1;
+      }
+      previous = child;
+    }
+    if (last - first + 1 != count ||
+        (layout[entry] == PQNode::qnode && !forward && !backward))
+      return false;
+    (*spans)[entry] = first;
+    (*spans)[entry + 1] = last;
+    (*spans)[entry + 2] = count;
+  }
+  return true;
+}
+
+bool PQTree::Admits(const vector<int>& permutation) const {
+  vector<int> layout, dense, positions, spans;
+  map<int, int> sparse;
+  SamplingLayout(&layout);
+  LayoutOrdinals(layout, &dense, &sparse);
+  return AdmitsLayout(layout, dense, sparse, permutation, &positions, &spans);
+}
+
+void PQTree::Admits(const vector<vector<int> >& permutations,
+                    vector<bool>* admitted) const {
+  vector<int> layout, dense, positions, spans;
+  map<int, int> sparse;
+  SamplingLayout(&layout);
+  LayoutOrdinals(layout, &dense, &sparse);
+  admitted->resize(permutations.size());
+  for (int i = 0; i < permutations.size(); ++i) {
+    (*admitted)[i] = AdmitsLayout(layout, dense, sparse, permutations[i],
+                                  &positions, &spans);
+  }
+}
+
+PQInternalNode* PQTree::ParentOf(PQNode* node) {
+  if (node->ImmediateSiblingCount() == 0)
+    return node->parent_;
+  // Only the endmost children of a Q-Node are guaranteed to know their
+  // parent.
+  PQNode* last = node;
+  PQNode* current = node->immediate_siblings_[0];
+  while (current) {
+    PQNode* next = current->QNextChild(last);
+    last = current;
+    current = next;
+  }
+  return last->parent_;
+}
+
+void PQTree::ReplaceNode(PQNode* old_node, PQNode* new_node) {
+  if (old_node == root_) {
+    root_ = new_node;
+    new_node->parent_ = NULL;
+    return;
+  }
+  PQInternalNode* parent = ParentOf(old_node);
+  parent->ReplaceChild(old_node, new_node);
+  new_node->parent_ = parent;
+}
+
+bool PQTree::AddLeaf(int value) {
+  if (invalid_ || LeafAddress(value))
+    return false;
+  PQLeaf* leaf = new (&pool_) PQLeaf(value);
+  leaf_block_ = NULL;
+  ++leaf_count_;
+  if (pnode_arities_.size() <= leaf_count_)
+    pnode_arities_.resize(2 * leaf_count_, 0);
+  IndexLeaf(leaf);
+
+  PNode* root;
+  if (root_->Type() == PQNode::pnode) {
+    root = root_->AsPNode();
+    root->hash_ = 0;
+    CountPNode(root, -1);
+  } else {
+    root = new (&pool_) PNode(&pool_);
+    root->circular_link_.push_back(root_);
+    root->leaf_count_ = root_->LeafCount();
+    root_->parent_ = root;
+    root_ = root;
+  }
+  // The new leaf goes last, so it also goes last in the frontier.
+  leaf->parent_ = root;
+  root->circular_link_.push_back(leaf);
+  ++root->leaf_count_;
+  CountPNode(root, 1);
+  if (frontier_valid_)
+    frontier_.push_back(value);
+  return true;
+}
+
+bool PQTree::RemoveLeaf(int value) {
+  PQLeaf* leaf = LeafAddress(value);
+  if (invalid_ || !leaf)
+    return false;
+  PQInternalNode* parent = ParentOf(leaf);
+  for (PQInternalNode* ancestor = parent; ; ancestor = ParentOf(ancestor)) {
+    --ancestor->leaf_count_;
+    ancestor->hash_ = 0;
+    if (ancestor == root_)
+      break;
+  }
+
+  if (parent->Type() == PQNode::pnode) {
+    PNode* pnode = parent->AsPNode();
+    CountPNode(pnode, -1);
+    pnode->circular_link_.remove(leaf);
+    // The root keeps a lone leaf, as in a tree with a single leaf.
+    PQNode* only = pnode->ChildCount() == 1 ? pnode->circular_link_.front()
+                                            : NULL;
+    if (only && (pnode != root_ || only->Type() != PQNode::leaf)) {
+      ReplaceNode(pnode, only);
+      pnode->circular_link_.clear();
+      PQNode::Delete(pnode, &pool_);
+    } else {
+      CountPNode(pnode, 1);
+    }
+  } else {
+    QNode* qnode = parent->AsQNode();
+    PQNode* siblings[2] = {leaf->immediate_siblings_[0],
+                           leaf->immediate_siblings_[1]};
+    for (int i = 0; i < 2 && siblings[i]; ++i)
+      siblings[i]->RemoveImmediateSibling(leaf);
+    if (siblings[1]) {
+      siblings[0]->AddImmediateSibling(siblings[1]);
+      siblings[1]->AddImmediateSibling(siblings[0]);
+    } else {
+      qnode->ReplaceEndmostChild(leaf, siblings[0]);
+      siblings[0]->parent_ = qnode;
+    }
+    // A Q-Node with two children admits both of their orders, so it is
+    // really a P-Node.
+    PQNode* ends[2] = {qnode->endmost_children_[0],
+                       qnode->endmost_children_[1]};
+    if (ends[0]->immediate_siblings_[0] == ends[1]) {
+      PNode* pnode = new (&pool_) PNode(&pool_);
+      pnode->leaf_count_ = qnode->leaf_count_;
+      for (int i = 0; i < 2; ++i) {
+        ends[i]->ClearImmediateSiblings();
+        ends[i]->parent_ = pnode;
+        pnode->circular_link_.push_back(ends[i]);
+      }
+      ReplaceNode(qnode, pnode);
+      qnode->ForgetChildren();
+      PQNode::Delete(qnode, &pool_);
+      CountQNode(-1);
+      CountPNode(pnode, 1);
+    }
+  }
+  PQNode::Delete(leaf, &pool_);
+
+  leaf_block_ = NULL;
+  --leaf_count_;
+  if (dense_leaf_address_)
+    leaf_address_[value - leaf_address_base_] = NULL;
+  else
+    sparse_leaf_address_.erase(value);
+  // Dropping |value| from each recorded set would lose the constraints it
+  // tied together, so the history becomes the sets forcing the new shape.
+  reductions_.clear();
+  if (record_reductions_)
+    StructureReductions(&reductions_);
+  frontier_valid_ = false;
+  explainable_ = false;
+  return true;
+}
+
+PQTree* PQTree::Project(const set<int>& subset) {
+  vector<int> values;
+  vector<PQLeaf*> leaves;
+  for (set<int>::const_iterator i = subset.begin(); i != subset.end(); ++i) {
+    PQLeaf* leaf = LeafAddress(*i);
+    if (leaf) {
+      values.push_back(*i);
+      leaves.push_back(leaf);
+    }
+  }
+  PQTree* projected = new PQTree(values.empty() ? NULL : &values[0],
+                                 values.size());
+  projected->record_reductions_ = record_reductions_;
+  projected->explainable_ = false;
+  if (invalid_) {
+    projected->invalid_ = true;
+    return projected;
+  }
+  // A root over at most one leaf is already as the projection has it.
+  if (values.size() < 2)
+    return projected;
+
+  // Walk up from each leaf, noting each node reached as a kept child of its
+  // parent.  A parent reached for the second time has already been walked
+  // up from.
+  map<PQNode*, vector<PQNode*> > kept;
+  for (int i = 0; i < leaves.size(); ++i) {
+    for (PQNode* node = leaves[i]; node != root_; ) {
+      PQInternalNode* parent = ParentOf(node);
+      vector<PQNode*>& children = kept[parent];
+      children.push_back(node);
+      if (children.size() > 1)
+        break;
+      node = parent;
+    }
+  }
+
+  // Rebuild the kept nodes from the top down in place of the projected
+  // tree's root, passing over every node left with a single kept child.
+  // Each is pushed with the copy of its parent, or NULL for the new root.
+  PNode* old_root = projected->root_->AsPNode();
+  projected->CountPNode(old_root, -1);
+  old_root->circular_link_.clear();
+  PQNode::Delete(old_root, &projected->pool_);
+  vector<PQInternalNode*> copies;
+  vector<PQNode*> children;
+  vector<pair<PQNode*, PQInternalNode*> > pending;
+  pending.push_back(make_pair(root_, static_cast<PQInternalNode*>(NULL)));
+  while (!pending.empty()) {
+    PQNode* node = pending.back().first;
+    PQInternalNode* parent = pending.back().second;
+    pending.pop_back();
+    while (node->Type() != PQNode::leaf && kept[node].size() == 1)
+      node = kept[node].front();
+
+    PQNode* copy;
+    if (node->Type() == PQNode::leaf) {
+      copy = projected->LeafAddress(node->AsLeaf()->LeafValue());
+    } else {
+      // The kept children of a P-Node may come in any order, but those of a
+      // Q-Node must be found in order among all of its children.
+      vector<PQNode*>& node_kept = kept[node];
+      children.clear();
+      if (node->Type() == PQNode::pnode) {
+        children = node_kept;
+      } else {
+        QNode* qnode = node->AsQNode();
+        PQNode* last = NULL;
+        PQNode* current = qnode->endmost_children_[0];
+        while (children.size() < node_kept.size()) {
+          if (current->Type() == PQNode::leaf ?
+              projected->LeafAddress(current->AsLeaf()->LeafValue()) != NULL :
+              kept.count(current) > 0)
+            children.push_back(current);
+          PQNode* next = current->QNextChild(last);
+          last = current;
+          current = next;
+        }
+      }
+      // A Q-Node left with two children admits both of their orders, so it
+      // becomes a P-Node.
+      PQInternalNode* internal_copy;
+      if (children.size() > 2 && node->Type() == PQNode::qnode) {
+        internal_copy = new (&projected->pool_) QNode(&projected->pool_);
+        projected->CountQNode(1);
+      } else {
+        internal_copy = new (&projected->pool_) PNode(&projected->pool_);
+      }
+      for (int i = children.size() - 1; i >= 0; --i)
+        pending.push_back(make_pair(children[i], internal_copy));
+      copies.push_back(internal_copy);
+      copy = internal_copy;
+    }
+
+    copy->parent_ = parent;
+    if (!parent) {
+      projected->root_ = copy;
+    } else if (parent->Type() == PQNode::pnode) {
+      parent->AsPNode()->circular_link_.push_back(copy);
+    } else {
+      QNode* qnode = parent->AsQNode();
+      if (qnode->endmost_children_[1]) {
+        qnode->endmost_children_[1]->AddImmediateSibling(copy);
+        copy->AddImmediateSibling(qnode->endmost_children_[1]);
+      } else {
+        qnode->endmost_children_[0] = copy;
+      }
+      qnode->endmost_children_[1] = copy;
+    }
+  }
+
+  // Every copy comes after its parent in |copies|, so going backwards sums
+  // the leaf counts bottom up.
+  for (int i = copies.size() - 1; i >= 0; --i) {
+    PQInternalNode* copy = copies[i];
+    children.clear();
+    copy->Children(&children);
+    for (int j = 0; j < children.size(); ++j)
+      copy->leaf_count_ += children[j]->LeafCount();
+    if (copy->Type() == PQNode::pnode)
+      projected->CountPNode(copy->AsPNode(), 1);
+  }
+  if (record_reductions_)
+    projected->StructureReductions(&projected->reductions_);
+  return projected;
+}
+
+PQTree* PQTree::FromNodes(const vector<int>& frontier,
+                          const vector<int>& nodes) {
+  int count = frontier.size();
+  PQTree* tree = new PQTree(frontier.empty() ? NULL : &frontier[0], count);
+  tree->explainable_ = false;
+  if (nodes.empty())
+    return tree;
+
+  // The fresh tree's leaves are laid out in one block in frontier order, so
+  // they only need hanging below the new nodes in place of its root.
+  PQLeaf* block = tree->leaf_block_;
+  PNode* old_root = tree->root_->AsPNode();
+  tree->CountPNode(old_root, -1);
+  old_root->circular_link_.clear();
+  PQNode::Delete(old_root, &tree->pool_);
+
+  // Walk the frontier with the nodes open at each position on |open|, each
+  // with the position after its last leaf.
+  vector<pair<PQInternalNode*, int> > open;
+  vector<PQInternalNode*> built;
+  if (nodes[0] != 0 || nodes[1] != count) {
+    PNode* root = new (&tree->pool_) PNode(&tree->pool_);
+    root->leaf_count_ = count;
+    root->parent_ = NULL;
+    tree->root_ = root;
+    open.push_back(make_pair(root, count));
+    built.push_back(root);
+  }
+  int next = 0;
+  for (int i = 0; i < count; ++i) {
+    while (!open.empty() && open.back().second <= i)
+      open.pop_back();
+    for (; next < nodes.size() && nodes[next] == i; next += 3) {
+      PQInternalNode* node;
+      if (nodes[next + 2]) {
+        node = new (&tree->pool_) QNode(&tree->pool_);
+        tree->CountQNode(1);
+      } else {
+        node = new (&tree->pool_) PNode(&tree->pool_);
+      }
+      node->leaf_count_ = nodes[next + 1] - i;
+      if (open.empty()) {
+        node->parent_ = NULL;
+        tree->root_ = node;
+      } else {
+        AppendChild(open.back().first, node);
+      }
+      open.push_back(make_pair(node, nodes[next + 1]));
+      built.push_back(node);
+    }
+    AppendChild(open.back().first, block + i);
+  }
+  for (int i = 0; i < built.size(); ++i) {
+    if (built[i]->Type() == PQNode::pnode)
+      tree->CountPNode(built[i]->AsPNode(), 1);
+  }
+  return tree;
+}
+
+void PQTree::AppendChild(PQInternalNode* parent, PQNode* child) {
+  child->parent_ = parent;
+  if (parent->Type() == PQNode::pnode) {
+    parent->AsPNode()->circular_link_.push_back(child);
+    return;
+  }
+  QNode* qnode = parent->AsQNode();
+  if (qnode->endmost_children_[1]) {
+    qnode->endmost_children_[1]->AddImmediateSibling(child);
+    child->AddImmediateSibling(qnode->endmost_children_[1]);
+  } else {
+    qnode->endmost_children_[0] = child;
+  }
+  qnode->endmost_children_[1] = child;
+}
+
+int PQTree::Rank(int value) {
+  PQNode* leaf = LeafAddress(value);
+  return leaf ? NodeRank(leaf) : -1;
+}
+
+int PQTree::NodeRank(PQNode* node) {
+  // Add up the leaves before |node| among its siblings, then those before its
+  // parent among the parent's siblings, and so on up to the root.
+  int rank = 0;
+  while (node != root_) {
+    PQInternalNode* parent;
+    int before = 0;
+    if (node->ImmediateSiblingCount() == 0) {
+      // A child of a P-Node, whose parent pointer is always valid.
+      parent = node->parent_;
+      PNode* pnode = parent->AsPNode();
+      for (PQNodeList::iterator i = pnode->circular_link_.begin(); *i != node;
+           ++i)
+        before += (*i)->LeafCount();
+    } else {
+      // A child of a Q-Node.  Only the endmost children are guaranteed to
+      // know their parent, so walk to the end of the Q-Node in one direction
+      // counting the leaves passed on the way.
+      PQNode* last = node;
+      PQNode* current = node->immediate_siblings_[0];
+      while (current) {
+        before += current->LeafCount();
+        PQNode* next = current->QNextChild(last);
+        last = current;
+        current = next;
+      }
+      parent = last->parent_;
+      if (last != parent->AsQNode()->endmost_children_[0])
+        before = parent->leaf_count_ - before - node->LeafCount();
+    }
+    rank += before;
+    node = parent;
+  }
+  return rank;
+}
+
+int PQTree::Select(int position) {
+  assert(position >= 0 && position < leaf_count_);
+  // Descend into the child holding |position|, skipping the leaves of the
+  // children before it.
+  PQNode* node = root_;
+  while (node->Type() != PQNode::leaf) {
+    if (node->Type() == PQNode::pnode) {
+      PNode* pnode = node->AsPNode();
+      PQNodeList::iterator i = pnode->circular_link_.begin();
+      for (; position >= (*i)->LeafCount(); ++i)
+        position -= (*i)->LeafCount();
+      node = *i;
+    } else {
+      QNodeChildrenIterator it(node->AsQNode());
+      for (; position >= it.Current()->LeafCount(); it.Next())
+        position -= it.Current()->LeafCount();
+      node = it.Current();
+    }
+  }
+  return node->LeafValue();
+}
+
+// Multiplies the number held in base 10^9 digits, least significant first,
+// in |digits| by |factor|.
+static void MultiplyDigits(vector<uint32_t>* digits, uint64_t factor) {
+  uint64_t carry = 0;
+  for (size_t i = 0; i < digits->size(); ++i) {
+    carry += (*digits)[i] * factor;
+    (*digits)[i] = carry % 1000000000;
+    carry /= 1000000000;
+  }
+  for (; carry; carry /= 1000000000)
+    digits->push_back(carry % 1000000000);
+}
+
+string PQTree::CountFrontiers() const {
+  // k! is the product of every j from 2 to k, so the product of k! over the
+  // P-Nodes is the product over j of j raised to the number of P-Nodes with
+  // at least j children.  Factors are gathered into 32-bit words before
+  // multiplying them into the count.
+  vector<uint32_t> digits(1, 1);
+  uint64_t factor = 1;
+  int at_least = 0;
+  for (int j = int(pnode_arities_.size()) - 1; j >= 2; --j) {
+    at_least += pnode_arities_[j];
+    for (int i = 0; i < at_least; ++i) {
+      if (factor * j > 0xffffffffu) {
+        MultiplyDigits(&digits, factor);
+        factor = 1;
+      }
+      factor *= j;
+    }
+  }
+  for (int i = 0; i < qnode_count_; ++i) {
+    if (factor * 2 > 0xffffffffu) {
+      MultiplyDigits(&digits, factor);
+      factor = 1;
+    }
+    factor *= 2;
+  }
+  MultiplyDigits(&digits, factor);
+
+  char digit_str[16];
+  sprintf(digit_str, "%u", digits.back());
+  string out = digit_str;
+  for (int i = int(digits.size()) - 2; i >= 0; --i) {
+    sprintf(digit_str, "%09u", digits[i]);
+    out += digit_str;
+  }
   return out;
 }
 
+double PQTree::LogFrontierCount() const {
+  return log_frontier_count_;
+}
+
+bool PQTree::IsAdjacent(int a, int b) {
+  int rank_a = Rank(a);
+  int rank_b = Rank(b);
+  return rank_a >= 0 && rank_b >= 0 && abs(rank_a - rank_b) == 1;
+}
+
 list<int> PQTree::ReducedFrontier() {
   list<int> out, inter;
   root_->FindFrontier(inter);
@@ -800,7 +2887,7 @@ set<int> PQTree::GetContained() {
   return out;
 }
 
-// Default destructor, Needs to delete the root.
+// Default destructor.  Every node, and everything inside the nodes, lives in
+// |pool_|, so releasing the pool frees the whole tree without visiting it.
 PQTree::~PQTree() {
-  delete root_;
 }
@@ -21,6 +21,7 @@ Booth and George S. Lueker in the Journal of Computer and System Sciences 13,
 // with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
 
 
+#include <algorithm>
 #include <list>
 #include <set>
 #include <vector>
@@ -38,6 +39,10 @@ using namespace std;
 class PQTree {
   private:
 
+  // Every node of the tree is allocated from here.  Declared first so that it
+  // outlives the nodes.
+  PQNodePool pool_;
+
   // Root node of the PQTree
   PQNode *root_;
 
@@ -54,21 +59,203 @@ class PQTree {
   // Keeps track of all reductions performed on this tree in order
   list<set<int> > reductions_;
 
-  // Keeps a pointer to the leaf containing a particular value this map actually
-  // increases the time complexity of the algorithm.  To fix, you can create an
-  // array of items so that each item hashes to its leaf address in constant
-  // time, but this is a tradeoff to conserve space.
-  map<int, PQNode*> leaf_address_;
+  // Whether Reduce() appends to |reductions_|.
+  bool record_reductions_;
+
+  // Conflict explanation, see SetExplainConflicts().  Positions in the
+  // reduction history from |first_explained_| on were performed while
+  // explaining.  Position |first_explained_| + i is the reduction which
+  // changed the nodes whose earlier provenance is listed in
+  // |provenance_deps_| from |provenance_begins_|[i] up to the next begin:
+  // between them, the earlier reductions behind those nodes and the
+  // reduction itself account for every node it changed or created.  A node
+  // last changed before |first_explained_| is accounted for by all the
+  // reductions before it.  |conflict_| holds the provenance of the nodes the
+  // last failed reduction ran into, and |explainable_| turns false for good
+  // once leaves are removed, as the recorded reductions then no longer
+  // account for the tree.
+  bool explain_conflicts_;
+  bool explainable_;
+  bool has_conflict_;
+  int first_explained_;
+  vector<int> provenance_begins_;
+  vector<int> provenance_deps_;
+  vector<int> conflict_;
+
+  // Keeps a pointer to the leaf containing a particular value.  Universes
+  // whose values span at most twice as many integers as there are leaves,
+  // like 0 .. n-1, are indexed by the array |leaf_address_| offset by
+  // |leaf_address_base_|, which finds a leaf in constant time.  Sparser
+  // universes fall back to the map |sparse_leaf_address_| to conserve space.
+  bool dense_leaf_address_;
+  int leaf_address_base_;
+  vector<PQLeaf*> leaf_address_;
+  map<int, PQLeaf*> sparse_leaf_address_;
+
+  // The number of leaves in the tree.
+  int leaf_count_;
+
+  // The block holding every leaf of the tree, in no particular order, or NULL
+  // if the leaves were allocated one by one.
+  PQLeaf* leaf_block_;
 
   // A reference to a pseudonode that cannot be reached through the root
   // of the tree.  The pseudonode is a temporary node designed to handle
   // a special case in the first bubbling up pass it only exists during the
   // scope of the reduce operation
-  PQNode* pseudonode_;
+  QNode* pseudonode_;
 
   // true if a non-safe reduce has failed, tree is useless.
   bool invalid_;
 
+  // The frontier as of the last call to Frontier(), and the ranges of
+  // positions in it that reductions have rearranged since, as [begin, end)
+  // pairs.  A reduction only rearranges the leaves below its pertinent root,
+  // which are consecutive in the frontier, so the rest stays valid.  Nothing
+  // is tracked until Frontier() is first called, which sets
+  // |frontier_valid_|.
+  vector<int> frontier_;
+  bool frontier_valid_;
+  vector<pair<int, int> > dirty_ranges_;
+
+  // The number of P-Nodes with each number of children, the number of
+  // Q-Nodes, and the natural logarithm of the number of frontiers they admit,
+  // updated by the templates as they restructure the tree.  See
+  // CountFrontiers().  |pnode_arities_| has room for every possible number of
+  // children, so that updating it never allocates.
+  vector<int> pnode_arities_;
+  int qnode_count_;
+  long double log_frontier_count_;
+
+  // The node which took the place of the pertinent root during the current
+  // reduction.  ReduceStep() sets it to the pertinent root and the templates
+  // which replace that node update it.
+  PQNode* pertinent_root_;
+
+  // Scratch buffers reused by every reduction, so that once they have grown
+  // a reduction performs no heap allocations.  Bubble() and ReduceStep() each
+  // enqueue a node at most once, so |queue_| is a plain buffer consumed from
+  // |queue_head_| and emptied at the start of each pass.  |blocked_list_|
+  // holds the nodes Bubble() found blocked.
+  vector<PQNode*> queue_;
+  size_t queue_head_;
+  vector<PQNode*> blocked_list_;
+
+  // Sets up a tree whose root P-Node has the leaves |leaves|[0 .. |count| - 1],
+  // or 0 .. |count| - 1 if |leaves| is NULL.  All the leaves are allocated in
+  // one block.
+  void Init(const int* leaves, int count);
+
+  // Rebuilds the leaf index from |leaves|, which need not be in one block.
+  void IndexLeaves(const vector<PQLeaf*>& leaves);
+
+  // Forgets the hashes of the ancestors of |node|, stopping at the first
+  // which has none.
+  void ForgetHashes(PQNode* node);
+
+  // Adds |leaf| to the leaf index, growing the dense index if the universe
+  // stays dense enough and otherwise moving it to the sparse one.
+  void IndexLeaf(PQLeaf* leaf);
+
+  // Returns the parent of the non-root |node|, walking to the end of its
+  // siblings if it is the child of a Q-Node.
+  PQInternalNode* ParentOf(PQNode* node);
+
+  // Puts |new_node|, which must have no siblings, in the place of |old_node|
+  // in the tree.  |old_node| is left linked to its children.
+  void ReplaceNode(PQNode* old_node, PQNode* new_node);
+
+  // Returns the leaf with value |value|, or NULL if there is none.
+  PQLeaf* LeafAddress(int value) const;
+
+  // Returns the position in the frontier of the first leaf below |node|.
+  int NodeRank(PQNode* node);
+
+  // While explaining conflicts, notes that the reduction under way changes or
+  // creates |node|, remembering the reduction which last changed it.
+  void NoteProvenance(PQInternalNode* node);
+
+  // While explaining conflicts, notes that the reduction under way relies on
+  // |node| without changing the leaves below it.
+  void NoteDependence(PQInternalNode* node);
+
+  // Notes the provenance of every node a failed reduction ran into in
+  // |conflict_|, and forgets the failed reduction.  |before_changes| tells
+  // whether it failed in Bubble() or LabelPertinent(), before changing the
+  // tree, rather than in ReduceStep().
+  void NoteConflict(bool before_changes);
+
+  // Adds the frontier positions of the leaves below the pertinent root of
+  // the reduction just performed to |dirty_ranges_|.  |ends| are the
+  // pertinent root, or the endmost children of the pseudonode if the
+  // pertinent root was one.
+  void MarkDirty(PQNode* ends[2]);
+
+  // Rewrites |frontier_| at the positions [|begin|, |end|) from the tree.
+  void EmitFrontier(int begin, int end);
+
+  // Adds (|sign| = 1) or removes (|sign| = -1) |pnode| with its current
+  // number of children, or a Q-Node, from the frontier count.
+  void CountPNode(PNode* pnode, int sign);
+  void CountQNode(int sign);
+
+  // Copies the frontier count of |to_copy|.
+  void CopyFrontierCount(const PQTree& to_copy);
+
+  // Writes the shape of the tree to |layout| for sampling: three entries per
+  // node in depth-first frontier order, the node's type, then its leaf value
+  // or number of children, then the index of the entry after its subtree.
+  void SamplingLayout(vector<int>* layout) const;
+
+  // Writes the tree to |canonical| in a form which depends only on the
+  // frontiers it admits: two entries per node in depth-first order, the
+  // node's type, then its leaf value or number of children.  The children of
+  // each P-Node are ordered by the smallest leaf below them and each Q-Node
+  // is read in the direction which puts the smaller of those first.
+  void CanonicalLayout(vector<int>* canonical) const;
+
+  // Appends to |reductions| sets which force a tree over the same leaves into
+  // this tree's shape: the leaves of every P-Node but the root, and the
+  // leaves of every two neighbouring children of a Q-Node, which between
+  // them force the Q-Node as well.
+  void StructureReductions(list<set<int> >* reductions) const;
+
+  // Numbers the leaves of |layout| in the order they appear, indexing the
+  // numbers by leaf value like the leaf index: in |dense| offset by
+  // |leaf_address_base_| if the leaf index is dense, otherwise in |sparse|.
+  // Values that are not leaves have no number, or -1 in |dense|.
+  void LayoutOrdinals(const vector<int>& layout, vector<int>* dense,
+                      map<int, int>* sparse) const;
+
+  // Returns whether the tree written out by SamplingLayout(), with its leaves
+  // numbered by LayoutOrdinals(), admits |permutation|.  |positions| and
+  // |spans| are scratch space.
+  bool AdmitsLayout(const vector<int>& layout, const vector<int>& dense,
+                    const map<int, int>& sparse,
+                    const vector<int>& permutation, vector<int>* positions,
+                    vector<int>* spans) const;
+
+  // Appends a random frontier of the tree written out by SamplingLayout() to
+  // |out|, using |stack| as scratch space.
+  template <class RandomNumberGenerator>
+  static void SampleLayout(const vector<int>& layout,
+                           RandomNumberGenerator& random, vector<int>* stack,
+                           vector<int>* out);
+
+  // Constructs an empty tree for Clone() to fill in.
+  PQTree();
+
+  // Copies the children of |from|, the node of another tree, to |to|, which
+  // must be a fresh node of the same type.  If the other tree's leaves are all
+  // in |from_block| they have already been copied to the same offsets in
+  // |leaf_block_|, otherwise they are placed consecutively from |*next_leaf|
+  // and indexed.  Copies of internal children are pushed on |pending| with
+  // their originals so that their children get copied later.
+  void CloneChildren(
+      const PQInternalNode* from, PQInternalNode* to, const PQLeaf* from_block,
+      PQLeaf** next_leaf,
+      vector<pair<const PQInternalNode*, PQInternalNode*> >* pending);
+
   // Loops through the consecutive blocked siblings of an unblocked node
   // recursively unblocking the siblings.
   // Args:
@@ -81,34 +268,128 @@ class PQTree {
   // letter describing which type of node it refers to and a number indicating
   // the index of the template for that letter.  These are the same indices in
   // the Booth & Lueker paper.  The return value indicates whether or not the
-  // pattern accurately matches the template
-  bool TemplateL1(PQNode* candidate_node);
-  bool TemplateQ1(PQNode* candidate_node);
-  bool TemplateQ2(PQNode* candidate_node);
-  bool TemplateQ3(PQNode* candidate_node);
-  bool TemplateP1(PQNode* candidate_node, bool is_reduction_root);
-  bool TemplateP2(PQNode* candidate_node);
-  bool TemplateP3(PQNode* candidate_node);
-  bool TemplateP4(PQNode* candidate_node);
-  bool TemplateP5(PQNode* candidate_node);
-  bool TemplateP6(PQNode* candidate_node);
+  // pattern accurately matches the template.  Each template only applies to
+  // one type of node, so it takes that type and ReduceStep() only tries the
+  // templates for the type of the node at hand.
+  bool TemplateL1(PQLeaf* candidate_node);
+  bool TemplateQ1(QNode* candidate_node, bool is_reduction_root);
+  bool TemplateQ2(QNode* candidate_node, bool is_reduction_root);
+  bool TemplateQ3(QNode* candidate_node);
+  bool TemplateP1(PNode* candidate_node, bool is_reduction_root);
+  bool TemplateP2(PNode* candidate_node);
+  bool TemplateP3(PNode* candidate_node);
+  bool TemplateP4(PNode* candidate_node);
+  bool TemplateP5(PNode* candidate_node);
+  bool TemplateP6(PNode* candidate_node);
 
   // This procedure is the first pass of the Booth&Leuker PQTree algorithm
   // It processes the pertinent subtree of the PQ-Tree to determine the mark
   // of every node in that subtree
   // the pseudonode, if created, is returned so that it can be deleted at
   // the end of the reduce step
-  bool Bubble(set<int> S);
-
-  bool ReduceStep(set<int> S);
+  bool Bubble(const set<int>& S);
+
+  bool ReduceStep(const set<int>& S);
+
+  // Labels the pertinent subtree found by Bubble() the way ReduceStep()
+  // would, checking at each node the conditions of the templates, but
+  // without restructuring anything.  Returns whether ReduceStep() would
+  // succeed.  UnlabelPertinent() undoes a successful labelling, leaving the
+  // tree as Bubble() left it for ReduceStep().
+  bool LabelPertinent(const set<int>& S);
+  void UnlabelPertinent(const set<int>& S);
+
+  // Reduces the tree by |S| if that succeeds, and otherwise leaves it as it
+  // was.  A set with a value which is not a leaf fails.
+  bool ReduceOrSkip(const set<int>& S);
+
+  // Returns whether the tree is still a single P-Node over its leaves, as
+  // no reduction has changed it.
+  bool Unreduced() const;
+
+  // Puts each leaf of |twins| which is not NULL back in the tree in place of
+  // the leaf in the same slot, below a new P-Node with it, and recounts the
+  // leaves below every node.  Takes time linear in the size of the tree.
+  void ExpandTwins(const vector<PNode*>& twins, const map<int, int>& slots);
+
+  // Appends |child| to the children of |parent| and makes |parent| its
+  // parent, for building a node's children in order.
+  static void AppendChild(PQInternalNode* parent, PQNode* child);
+
+  // Number the leaves, for scratch arrays indexed by leaf.  A leaf's slot is
+  // its offset in |leaf_address_| if that is dense, and otherwise is given
+  // by |slots|, which LeafSlots() fills in.  Slots run from 0 up to
+  // SlotCount(), and some may not hold a leaf.
+  void LeafSlots(map<int, int>* slots) const;
+  int LeafSlot(int value, const map<int, int>& slots) const;
+  int SlotCount(const map<int, int>& slots) const;
+
+  // The laminar fast path of ReduceAll().  In a laminar family every two
+  // sets are nested or disjoint, and reducing a tree no reduction has changed
+  // yet by one only builds a hierarchy of P-Nodes, one per distinct set.
+  // ReduceLaminarPrefix() builds that hierarchy directly for the longest
+  // laminar prefix of |L|, if the tree has not been changed and conflicts
+  // are not being explained, records its sets and returns how many there
+  // are.
+  int ReduceLaminarPrefix(const list<set<int> >& L);
+
+  // Takes the first |count| of |sets| smallest first, finding the nodes
+  // already built below each one by union-find over its leaves, and returns
+  // -1 if they are laminar and only contain leaves.  Otherwise returns the
+  // length of a prefix of |sets| found not to be.  With |build|, which needs
+  // a laminar family, also builds their hierarchy below the root.  |slots|
+  // is from LeafSlots().
+  int LaminarPass(const vector<const set<int>*>& sets, int count,
+                  const map<int, int>& slots, bool build);
 
  public:
   // Default constructor - constructs a tree using a set
   // Only reductions using elements of that set will succeed
-  PQTree(set<int> S);
+  PQTree(const set<int>& S);
+
+  // Constructs a tree over the leaves 0 .. |leaf_count| - 1 in linear time.
+  explicit PQTree(int leaf_count);
+
+  // Constructs a tree over the |count| distinct leaves in |leaves| in linear
+  // time.
+  PQTree(const int* leaves, int count);
+
+  // Constructs a tree over the distinct leaves in [|begin|, |end|).
+  template <class Iterator>
+  PQTree(Iterator begin, Iterator end) {
+    vector<int> leaves(begin, end);
+    Init(leaves.empty() ? NULL : &leaves[0], leaves.size());
+  }
+
   PQTree(const PQTree& to_copy);
   ~PQTree();
 
+  // Returns a new copy of this tree, owned by the caller.  This is much faster
+  // than the copy constructor: the nodes are copied in one iterative pass
+  // with all the leaves laid out in one block, Q-Node children are linked as
+  // they are copied, and the leaf index is filled in directly rather than
+  // rebuilt from a walk of the copy.
+  PQTree* Clone() const;
+
+  // Lays every node of the tree out afresh in depth-first frontier order: the
+  // leaves in one block in the order of the frontier, and the internal nodes
+  // and their child lists in the order a walk of the tree visits them.  All
+  // links and the leaf index are rewritten and the memory held by the old
+  // nodes is released.  Reductions create and free internal nodes all over
+  // the tree's memory and move leaves away from their frontier neighbours,
+  // so after many of them this makes walks of the whole tree, such as
+  // Print() or a walk from Root(), much more cache friendly.  Does nothing
+  // to an invalid tree.
+  void Compact();
+
+  // Returns the fraction of the steps of a depth-first walk of the tree that
+  // do not move forward through memory by less than a page, counting steps
+  // from leaf to leaf and from internal node to internal node separately.
+  // This is 0 for a freshly constructed or compacted tree and approaches 1 as
+  // reductions scatter the nodes, so it can be used to decide when to
+  // Compact().  Takes time linear in the size of the tree.
+  double Fragmentation() const;
+
   // Returns the root PQNode used for exploring the tree.
   PQNode* Root();
 
@@ -120,17 +401,206 @@ class PQTree {
 
   // Reduces the tree but protects if from becoming invalid if the reduction
   // fails, takes more time.
-  bool SafeReduce(set<int>);
-  bool SafeReduceAll(list<set<int> >);
+  bool SafeReduce(const set<int>& S);
+  bool SafeReduceAll(const list<set<int> >& L);
 
   //reduces the tree - tree can become invalid, making all further
-  //reductions fail
-  bool Reduce(set<int> S);
-  bool ReduceAll(list<set<int> > L);
-
-  // Returns 1 possible frontier, or ordering preserving the reductions
+  //reductions fail.  A set with a value which is not a leaf fails.
+  bool Reduce(const set<int>& S);
+
+  // Reduces the tree by each set of |L| in turn, stopping at the first which
+  // fails.  If no reduction has changed the tree yet, the longest prefix of
+  // |L| in which every two sets are nested or disjoint is reduced by all at
+  // once, building its hierarchy of P-Nodes in time linear in the size of
+  // the sets plus sorting them, before the remaining sets are reduced one by
+  // one.
+  bool ReduceAll(const list<set<int> >& L);
+
+  // The orders in which ReduceAllSkipping() may attempt its sets.
+  enum ReductionOrder {
+    input_order,     // As given.
+    ascending_size,  // Smallest first, ties as given.
+    by_weight        // Heaviest first, ties as given.
+  };
+
+  // Attempts every set of |L| in the order |order| picks, keeping each one
+  // that succeeds and skipping each one that would fail, which leaves the
+  // tree as it was.  Returns whether each set of |L|, in the order of |L|,
+  // was kept.  |weights| holds the weight of each set of |L| for by_weight
+  // and is otherwise ignored.  Each set is checked against the tree before
+  // it changes anything, so skipping a set costs about as much as reducing
+  // by it and nothing is copied, unlike SafeReduce().  While explaining
+  // conflicts, ExplainConflict() explains the last set skipped.  Nothing is
+  // kept if the tree is invalid.
+  vector<bool> ReduceAllSkipping(
+      const list<set<int> >& L, ReductionOrder order = input_order,
+      const vector<double>& weights = vector<double>());
+
+  // Reduces the tree by the sets of |L| like ReduceAll(), after shrinking
+  // the problem.  Sets of fewer than two leaves or of every leaf are
+  // dropped, as are sets the same as an earlier one, found by hashing, and
+  // only the sets left are recorded.  If no reduction has changed the tree
+  // yet, and conflicts are not being explained, leaves in exactly the same
+  // sets, of which there is at least one, are twins: the sets are reduced
+  // on a tree of one representative of each class of twins, and then the
+  // rest of each class goes back in the tree below a P-Node with its
+  // representative.  The tree then admits exactly the frontiers of |L| in
+  // which twins are next to each other, which includes at least one of the
+  // frontiers of |L| if there are any, but not necessarily all of them.
+  // Each class of twins is then recorded as a set after the sets left, so
+  // that reducing by the recorded sets gives back the same tree.
+  bool ReduceAllPreprocessed(const list<set<int> >& L);
+
+  // Turns recording of reductions on or off, it is on by default.
+  // GetReductions(), GetContained() and ReducedFrontier() only see reductions
+  // performed while recording.  Copying each reduction set into the history
+  // is the only heap allocation a Reduce() makes once the tree is warm.
+  void SetRecordReductions(bool record);
+
+  // Returns 1 possible frontier, or ordering preserving the reductions.  This
+  // copies the frontier FrontierArray() keeps into a new list, which takes
+  // time and allocations linear in the number of leaves on every call, so
+  // callers which ask after every reduction should use FrontierArray().
   list<int> Frontier();
 
+  // Returns the same frontier as Frontier() as an array, owned by the tree
+  // and valid until the next call to a non-const method.  The tree keeps it
+  // from one call to the next and only rewrites the parts rearranged by the
+  // reductions in between, so calling this after every reduction costs time
+  // proportional to the leaves below each pertinent root rather than to the
+  // size of the tree.
+  const vector<int>& FrontierArray();
+
+  // Returns the number of distinct frontiers the tree admits, in decimal:
+  // the product of k! over the P-Nodes with k children and of 2 over the
+  // Q-Nodes.  The tree keeps track of how many nodes of each kind it has as
+  // it is reduced, so this takes no walk of the tree, only time to multiply
+  // the count out, which can be large: a fresh tree over n leaves admits n!
+  // frontiers.
+  string CountFrontiers() const;
+
+  // Returns the natural logarithm of CountFrontiers() in constant time.
+  double LogFrontierCount() const;
+
+  // Writes a frontier drawn uniformly at random from those the tree admits to
+  // |out|, by shuffling the children of every P-Node and reversing every
+  // Q-Node with probability 1/2.  |random| is called like the generator
+  // passed to random_shuffle: random(k) must return a uniformly distributed
+  // integer in 0 .. k - 1.  Takes time linear in the size of the tree, and
+  // only reads the tree, so any number of threads may sample a tree that is
+  // not being changed at the same time, each with its own generator.
+  template <class RandomNumberGenerator>
+  void SampleFrontier(RandomNumberGenerator& random, vector<int>* out) const;
+
+  // Writes |count| independent samples as from SampleFrontier() to |out|,
+  // walking the tree only once for all of them.
+  template <class RandomNumberGenerator>
+  void SampleFrontiers(RandomNumberGenerator& random, int count,
+                       vector<vector<int> >* out) const;
+
+  // Returns the PQNode::CanonicalHash() of the root: trees which admit the
+  // same frontiers hash the same.  A reduction forgets the hashes of the
+  // nodes it changes and their ancestors, so this only rehashes those.
+  uint64_t CanonicalHash();
+
+  // Returns whether |a| and |b| admit exactly the same frontiers, however
+  // their children happen to be ordered.  Both trees are brought into a
+  // canonical form in linear time: the children of each node have disjoint
+  // leaves, so they are ordered by the smallest leaf below each of them, with
+  // all the nodes of a tree bucketed by that leaf at once by a radix sort
+  // rather than one comparison sort per node.  Two invalid trees are
+  // equivalent.
+  static bool Equivalent(const PQTree& a, const PQTree& b);
+
+  // Reduces |a| so that it admits exactly the frontiers both |a| and |b|
+  // admit.  Rather than replaying the reductions performed on |b|, reduces
+  // |a| by the few sets that make up the structure of |b|: one per P-Node
+  // and one per pair of neighbouring Q-Node children, taking time linear in
+  // their total size.  Like Reduce(), returns false and leaves |a| invalid
+  // if no frontier is admitted by both, or if |b| has leaves |a| does not,
+  // which is checked before anything is reduced.
+  static bool Intersect(PQTree* a, const PQTree& b);
+
+  // Intersects all of |trees| into |trees|[0], merging them in pairs and
+  // then the results in pairs, and so on, so that no tree takes part in
+  // more than a logarithmic number of merges and the merges of each round
+  // are independent of one another.  The other trees are left intersected
+  // with some of their neighbours.  Returns false if any merge failed.
+  static bool IntersectAll(const vector<PQTree*>& trees);
+
+  // Returns whether |permutation| is one of the frontiers the tree admits:
+  // it must hold every leaf exactly once, the leaves of every node must be
+  // consecutive in it, and the children of every Q-Node must appear in order
+  // or in reverse.  Checks the positions the leaves of each node span in
+  // linear time, rather than checking every reduction performed.  Only reads
+  // the tree, so concurrent calls on a tree that is not being changed are
+  // safe.
+  bool Admits(const vector<int>& permutation) const;
+
+  // Sets (*admitted)[i] to Admits(permutations[i]), walking the tree only
+  // once for all of them.
+  void Admits(const vector<vector<int> >& permutations,
+              vector<bool>* admitted) const;
+
+  // Position queries on the frontier Frontier() returns, answered from the
+  // leaf counts every node keeps without materialising the frontier.  Each
+  // takes time proportional to the depth of the leaf plus, at each level, the
+  // number of siblings passed over, rather than to the size of the tree.
+  //
+  // Rank() returns the position of the leaf |value| in the frontier, or -1
+  // if there is no such leaf.  Select() returns the leaf at |position|, which
+  // must be in 0 .. leaves - 1.  IsAdjacent() returns whether the leaves |a|
+  // and |b| are next to each other in the frontier.
+  int Rank(int value);
+  int Select(int position);
+  bool IsAdjacent(int a, int b);
+
+  // Adds a new leaf |value| as a child of the root, making the root a P-Node
+  // first if it is not one, so that the new leaf may go anywhere that splits
+  // no node of the tree.  That is anywhere that splits no reduction performed
+  // so far, except for reductions of every leaf, which leave no trace in the
+  // tree and no longer hold.  Returns false if |value| is already a leaf or
+  // the tree is invalid.  Takes constant amortised time.
+  bool AddLeaf(int value);
+
+  // Removes the leaf |value| from the tree.  The tree then admits exactly the
+  // frontiers it admitted before with |value| left out: a P-Node left with a
+  // single child is replaced by that child and a Q-Node left with two
+  // children becomes a P-Node.  Leaving |value| out of each recorded set
+  // would lose the constraints it took part in, so while recording, the
+  // recorded reductions are replaced by the sets Intersect() reduces by, one
+  // per P-Node and one per pair of neighbouring Q-Node children, which
+  // rebuild the tree when replayed; otherwise they are dropped.  Returns
+  // false if there is no leaf |value| or the tree is invalid.  Apart from
+  // listing those sets this takes time proportional to the depth of the leaf
+  // and the siblings walked past to find each ancestor, like Rank().
+  bool RemoveLeaf(int value);
+
+  // Returns a new tree, owned by the caller, over the leaves of |subset| that
+  // are leaves of this tree, admitting exactly the frontiers of this tree
+  // with every other leaf left out, as if they had all been removed with
+  // RemoveLeaf().  Finds the nodes to keep by walking up from the leaves of
+  // |subset| as far as the first node already reached, rather than walking
+  // the whole tree, so apart from recording the new tree's structure as in
+  // RemoveLeaf() this takes time proportional to the size of |subset| times
+  // the depth of the tree, plus the siblings walked past as in RemoveLeaf()
+  // and the children of the kept Q-Nodes.  Nothing is recorded for the
+  // projection of an invalid tree.
+  PQTree* Project(const set<int>& subset);
+
+  // Returns a new tree, owned by the caller, over the distinct leaves of
+  // |frontier| laid out in that order, with the internal nodes given by
+  // |nodes| in three entries each: the position in |frontier| of the node's
+  // first leaf, the position after its last leaf, and 1 for a Q-Node or 0
+  // for a P-Node.  The nodes must be nested or disjoint, listed in
+  // depth-first order, which puts the larger of two nodes with the same
+  // first leaf first, and each must have at least two children, a Q-Node
+  // three.  A node over the whole frontier is the root, and otherwise the
+  // root is a P-Node.  No reductions are recorded.  Takes time linear in
+  // the size of the tree.
+  static PQTree* FromNodes(const vector<int>& frontier,
+                           const vector<int>& nodes);
+
   // Assignment operator
   PQTree& operator=(const PQTree& to_copy);
 
@@ -145,8 +615,83 @@ class PQTree {
   // Returns the reductions that have been performed on this tree.
   list<set<int> > GetReductions();
 
+  // Turns conflict explanation on or off, it is off by default.  While it is
+  // on, every reduction notes which earlier reductions produced the nodes it
+  // changes, so that when one fails ExplainConflict() can name the earlier
+  // reductions that clash with it.  This costs memory proportional to the
+  // number of pertinent nodes of each reduction.  Reductions performed while
+  // it is off are only accounted for all together.  Explanations refer to
+  // positions in GetReductions(), so reductions should be recorded as well.
+  void SetExplainConflicts(bool explain);
+
+  // After a reduction performed while explaining conflicts has failed,
+  // writes to |conflict| the positions in GetReductions(), in increasing
+  // order, of earlier reductions which together with the failed set admit no
+  // frontier.  They are read off the provenance of the nodes the failed
+  // reduction ran into, following each back through the reductions which
+  // produced it, without performing any reductions, so this takes time
+  // linear in the provenance followed.  The set is not necessarily minimal,
+  // but is usually much smaller than the whole history.  Returns false if no
+  // reduction has failed while explaining, or if leaves have been removed.
+  bool ExplainConflict(vector<int>* conflict) const;
+
   // Returns the set of all elements on which a reduction was performed.
   set<int> GetContained();
 };
 
+template <class RandomNumberGenerator>
+void PQTree::SampleFrontier(RandomNumberGenerator& random,
+                            vector<int>* out) const {
+  vector<int> layout;
+  vector<int> stack;
+  SamplingLayout(&layout);
+  out->clear();
+  SampleLayout(layout, random, &stack, out);
+}
+
+template <class RandomNumberGenerator>
+void PQTree::SampleFrontiers(RandomNumberGenerator& random, int count,
+                             vector<vector<int> >* out) const {
+  vector<int> layout;
+  vector<int> stack;
+  SamplingLayout(&layout);
+  out->resize(count);
+  for (int i = 0; i < count; ++i) {
+    (*out)[i].clear();
+    SampleLayout(layout, random, &stack, &(*out)[i]);
+  }
+}
+
+template <class RandomNumberGenerator>
+void PQTree::SampleLayout(const vector<int>& layout,
+                          RandomNumberGenerator& random, vector<int>* stack,
+                          vector<int>* out) {
+  // The children of each node are pushed in a random order, or for a Q-Node
+  // in one of its two orders, and popped off the stack in the reverse order.
+  stack->clear();
+  if (!layout.empty())
+    stack->push_back(0);
+  while (!stack->empty()) {
+    int entry = stack->back();
+    stack->pop_back();
+    if (layout[entry] == PQNode::leaf) {
+      out->push_back(layout[entry + 1]);
+      continue;
+    }
+    int first = stack->size();
+    int child = entry + 3;
+    for (int i = 0; i < layout[entry + 1]; ++i) {
+      stack->push_back(child);
+      child = layout[child + 2];
+    }
+    int count = stack->size() - first;
+    if (layout[entry] == PQNode::pnode) {
+      for (int i = count - 1; i > 0; --i)
+        swap((*stack)[first + i], (*stack)[first + random(i + 1)]);
+    } else if (random(2)) {
+      reverse(stack->begin() + first, stack->end());
+    }
+  }
+}
+
 #endif
@@ -15,6 +15,9 @@
 // You should have received a copy of the GNU General Public License along
 // with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
 
+#ifndef SET_METHODS_H
+#define SET_METHODS_H
+
 #include <algorithm>
 #include <set>
 
@@ -56,3 +59,5 @@ class SetMethods {
     return out;
   }
 };
+
+#endif
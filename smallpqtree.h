@@ -0,0 +1,740 @@
+// A PQ-Tree specialised at compile time for universes of at most N leaves.
+//
+// SmallPQTree<N> admits exactly the same orderings as a PQTree built over the
+// same leaves and reduced by the same sets, but it is laid out for small
+// problems: leaf sets are fixed-width bitmasks, every node lives inline in a
+// fixed array, and a reduction never touches the heap.  Leaves are identified
+// by their integer id in the range [0, N).
+//
+// Rather than bubbling pertinence up from the leaves, each internal node keeps
+// the bitmask of the leaves below it, so the label of a node with respect to a
+// reduction set S (empty, full or partial) is a couple of word-wide AND
+// operations.  A reduction locates the pertinent root by walking up from any
+// leaf of S and then applies the Booth & Lueker templates top-down.
+//
+// Usage:
+//   SmallPQTree<64> tree(10);  // leaves 0 .. 9
+//   SmallPQTree<64>::LeafSet S;
+//   S.Insert(3);
+//   S.Insert(4);
+//   tree.Reduce(S);
+
+// This file is part of the PQ Tree library.
+//
+// The PQ Tree library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The PQ Tree Library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with the PQ Tree Library.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SMALLPQTREE_H
+#define SMALLPQTREE_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <cstdio>
+#include <list>
+#include <set>
+#include <string>
+
+using namespace std;
+
+// A set of leaf ids in the range [0, N) stored as a fixed-width bitmask.
+template <int N>
+class SmallLeafSet {
+ public:
+  enum { kWords = (N + 63) / 64 };
+
+  SmallLeafSet() {
+    Clear();
+  }
+
+  explicit SmallLeafSet(const set<int>& S) {
+    Clear();
+    for (set<int>::const_iterator i = S.begin(); i != S.end(); ++i)
+      Insert(*i);
+  }
+
+  void Clear() {
+    for (int i = 0; i < kWords; ++i)
+      words_[i] = 0;
+  }
+
+  // A |leaf| outside [0, N) has no bit, and is ignored when assertions are
+  // off rather than written past the end of the mask.
+  void Insert(int leaf) {
+    assert(leaf >= 0 && leaf < N);
+    if (leaf >= 0 && leaf < N)
+      words_[leaf >> 6] |= uint64_t(1) << (leaf & 63);
+  }
+
+  void Erase(int leaf) {
+    assert(leaf >= 0 && leaf < N);
+    if (leaf >= 0 && leaf < N)
+      words_[leaf >> 6] &= ~(uint64_t(1) << (leaf & 63));
+  }
+
+  bool Contains(int leaf) const {
+    return (words_[leaf >> 6] >> (leaf & 63)) & 1;
+  }
+
+  // Returns the number of leaves in the set.
+  int Count() const {
+    int count = 0;
+    for (int i = 0; i < kWords; ++i)
+      count += __builtin_popcountll(words_[i]);
+    return count;
+  }
+
+  bool Empty() const {
+    for (int i = 0; i < kWords; ++i)
+      if (words_[i])
+        return false;
+    return true;
+  }
+
+  // Returns the smallest leaf id in the set, or -1 if the set is empty.
+  int First() const {
+    for (int i = 0; i < kWords; ++i)
+      if (words_[i])
+        return i * 64 + __builtin_ctzll(words_[i]);
+    return -1;
+  }
+
+  // Returns true if every leaf in this set is also in |other|.
+  bool SubsetOf(const SmallLeafSet& other) const {
+    uint64_t outside = 0;
+    for (int i = 0; i < kWords; ++i)
+      outside |= words_[i] & ~other.words_[i];
+    return outside == 0;
+  }
+
+  // Returns true if this set and |other| share at least one leaf.
+  bool Intersects(const SmallLeafSet& other) const {
+    uint64_t shared = 0;
+    for (int i = 0; i < kWords; ++i)
+      shared |= words_[i] & other.words_[i];
+    return shared != 0;
+  }
+
+  SmallLeafSet& operator|=(const SmallLeafSet& other) {
+    for (int i = 0; i < kWords; ++i)
+      words_[i] |= other.words_[i];
+    return *this;
+  }
+
+  bool operator==(const SmallLeafSet& other) const {
+    uint64_t diff = 0;
+    for (int i = 0; i < kWords; ++i)
+      diff |= words_[i] ^ other.words_[i];
+    return diff == 0;
+  }
+
+ private:
+  uint64_t words_[kWords];
+};
+
+template <int N>
+class SmallPQTree {
+ public:
+  typedef SmallLeafSet<N> LeafSet;
+
+  // Constructs a tree over the leaves 0 .. |leaf_count| - 1, all children of a
+  // single root P-Node.
+  explicit SmallPQTree(int leaf_count) {
+    assert(leaf_count >= 0 && leaf_count <= N);
+    LeafSet leaves;
+    for (int i = 0; i < leaf_count; ++i)
+      leaves.Insert(i);
+    Init(leaves);
+  }
+
+  // Constructs a tree over the leaves in |leaves|.  Only reductions using
+  // elements of that set will succeed.
+  explicit SmallPQTree(const LeafSet& leaves) {
+    Init(leaves);
+  }
+
+  // Reduces the tree so that the leaves in |S| are consecutive in every
+  // frontier.  Like PQTree::Reduce, the tree becomes invalid if the reduction
+  // fails, making all further reductions fail, and a set with a value which
+  // is not a leaf, including one outside [0, N), fails.
+  bool Reduce(const LeafSet& S);
+  bool Reduce(const set<int>& S) {
+    if (S.size() < 2)
+      return true;
+    if (*S.begin() < 0 || *S.rbegin() >= N) {
+      invalid_ = true;
+      return false;
+    }
+    return Reduce(LeafSet(S));
+  }
+  bool ReduceAll(const list<set<int> >& L) {
+    for (list<set<int> >::const_iterator S = L.begin(); S != L.end(); ++S)
+      if (!Reduce(*S))
+        return false;
+    return true;
+  }
+
+  // Returns 1 possible frontier, or ordering preserving the reductions.
+  list<int> Frontier() const {
+    list<int> out;
+    FindFrontier(root_, &out);
+    return out;
+  }
+
+  // Returns the set of leaves in this tree.
+  const LeafSet& Leaves() const {
+    return leaves_;
+  }
+
+  // Prints the tree in the same format as PQTree::Print().  P-nodes are
+  // represented as ( ), Q-nodes as [ ], and leafs by their integer id.
+  string Print() const {
+    string out;
+    Print(root_, &out);
+    return out;
+  }
+
+ private:
+  enum NodeType {leaf, pnode, qnode};
+  enum NodeLabel {empty, full, partial};
+
+  typedef unsigned short Index;
+  static const Index kNone = 0xffff;
+
+  // Leaves occupy nodes_[0, N) at the index of their value, internal nodes
+  // are allocated from nodes_[N, 3N).  A tree over N leaves never has more
+  // than N - 1 internal nodes, the extra room absorbs the few nodes which a
+  // reduction allocates before it frees the ones they replace.
+  enum { kInternalNodes = 2 * N };
+
+  // Children of both P-Nodes and Q-Nodes are kept in a doubly linked list
+  // threaded through |prev| and |next|.  For Q-Nodes the order of that list
+  // is the order of the children, for P-Nodes it is arbitrary.  Unlike
+  // PQNode, every child keeps a valid |parent|.
+  struct Node {
+    Index parent;
+    Index prev, next;
+    Index first, last;
+    unsigned char type;
+    // Label of this node with respect to the reduction in progress.
+    unsigned char label;
+  };
+
+  // A list of detached sibling nodes, linked through |prev| and |next|.
+  struct ChildList {
+    Index head, tail;
+    int count;
+  };
+
+  void Init(const LeafSet& leaves);
+
+  // Internal node allocation from the free list.
+  Index NewNode(NodeType type);
+  void FreeNode(Index node);
+
+  // Returns the label of |node| with respect to the reduction set |S|.
+  NodeLabel LabelOf(Index node, const LeafSet& S) const;
+
+  // Child list manipulation.
+  void AppendChild(Index parent, Index child);
+  void PrependChild(Index parent, Index child);
+  void Unlink(Index child);
+  void ReplaceChild(Index old_child, Index new_child);
+  void Reverse(Index qnode);
+  void AppendToList(ChildList* list, Index node);
+
+  // Turns |list| into a single node: the node itself if it has one entry, a
+  // new P-Node over all of them otherwise.  Returns kNone for an empty list.
+  // Masks are kept up to date as the templates go, the leaves below a node
+  // only ever change when that node is created or merged into.
+  Index Group(const ChildList& list);
+
+  // Moves the children of |from| into the place of |from| in its parent's
+  // child list, optionally reversing their order, and frees |from|.
+  void SpliceChildren(Index from, bool reversed);
+
+  // Returns true if walking the children of |qnode| from the front (or the
+  // back if |reversed|) reads empty*, at most one partial, then full*.
+  bool MatchesPartialPattern(Index qnode, bool reversed) const;
+
+  // Restructures the partial, non-root node |node| into a Q-Node whose
+  // children run from empty to full and puts it in place of |node|.  Returns
+  // that Q-Node, or kNone if no template matches.
+  Index MakePartial(Index node, const LeafSet& S);
+
+  // Applies the root templates to the pertinent root |node|.  Returns the
+  // node that takes |node|'s place, or kNone if no template matches.
+  Index ReduceRoot(Index node, const LeafSet& S);
+
+  // Adds the leaves below |node| to |mask|.
+  void AddLeaves(LeafSet* mask, Index node) const;
+
+  void FindFrontier(Index node, list<int>* out) const;
+  void Print(Index node, string* out) const;
+
+  Node nodes_[N + kInternalNodes];
+
+  // masks_[i] holds the leaves below internal node N + i.
+  LeafSet masks_[kInternalNodes];
+
+  // Head of the free internal node list, chained through |next|.
+  Index free_list_;
+
+  Index root_;
+
+  // All the leaves of the tree.
+  LeafSet leaves_;
+
+  // true if a reduction has failed, tree is useless.
+  bool invalid_;
+};
+
+template <int N>
+void SmallPQTree<N>::Init(const LeafSet& leaves) {
+  invalid_ = false;
+  free_list_ = kNone;
+  for (int i = N + kInternalNodes - 1; i >= N; --i)
+    FreeNode(i);
+  root_ = NewNode(pnode);
+  nodes_[root_].parent = kNone;
+  for (int i = 0; i < N; ++i) {
+    nodes_[i].type = leaf;
+    nodes_[i].first = nodes_[i].last = kNone;
+    nodes_[i].parent = nodes_[i].prev = nodes_[i].next = kNone;
+    if (leaves.Contains(i))
+      AppendChild(root_, i);
+  }
+  masks_[root_ - N] = leaves;
+  leaves_ = leaves;
+}
+
+template <int N>
+typename SmallPQTree<N>::Index SmallPQTree<N>::NewNode(NodeType type) {
+  assert(free_list_ != kNone);
+  Index node = free_list_;
+  free_list_ = nodes_[node].next;
+  nodes_[node].type = type;
+  nodes_[node].parent = nodes_[node].prev = nodes_[node].next = kNone;
+  nodes_[node].first = nodes_[node].last = kNone;
+  return node;
+}
+
+template <int N>
+void SmallPQTree<N>::FreeNode(Index node) {
+  assert(node >= N);
+  nodes_[node].next = free_list_;
+  free_list_ = node;
+}
+
+template <int N>
+typename SmallPQTree<N>::NodeLabel SmallPQTree<N>::LabelOf(
+    Index node, const LeafSet& S) const {
+  if (nodes_[node].type == leaf)
+    return S.Contains(node) ? full : empty;
+  const LeafSet& leaves = masks_[node - N];
+  if (leaves.SubsetOf(S))
+    return full;
+  return leaves.Intersects(S) ? partial : empty;
+}
+
+template <int N>
+void SmallPQTree<N>::AddLeaves(LeafSet* mask, Index node) const {
+  if (nodes_[node].type == leaf)
+    mask->Insert(node);
+  else
+    *mask |= masks_[node - N];
+}
+
+template <int N>
+void SmallPQTree<N>::AppendChild(Index parent, Index child) {
+  Node& p = nodes_[parent];
+  nodes_[child].parent = parent;
+  nodes_[child].prev = p.last;
+  nodes_[child].next = kNone;
+  if (p.last != kNone)
+    nodes_[p.last].next = child;
+  else
+    p.first = child;
+  p.last = child;
+}
+
+template <int N>
+void SmallPQTree<N>::PrependChild(Index parent, Index child) {
+  Node& p = nodes_[parent];
+  nodes_[child].parent = parent;
+  nodes_[child].next = p.first;
+  nodes_[child].prev = kNone;
+  if (p.first != kNone)
+    nodes_[p.first].prev = child;
+  else
+    p.last = child;
+  p.first = child;
+}
+
+template <int N>
+void SmallPQTree<N>::Unlink(Index child) {
+  Node& c = nodes_[child];
+  Node& p = nodes_[c.parent];
+  if (c.prev != kNone)
+    nodes_[c.prev].next = c.next;
+  else
+    p.first = c.next;
+  if (c.next != kNone)
+    nodes_[c.next].prev = c.prev;
+  else
+    p.last = c.prev;
+  c.parent = c.prev = c.next = kNone;
+}
+
+template <int N>
+void SmallPQTree<N>::ReplaceChild(Index old_child, Index new_child) {
+  Node& o = nodes_[old_child];
+  Node& n = nodes_[new_child];
+  n.parent = o.parent;
+  n.prev = o.prev;
+  n.next = o.next;
+  if (o.parent == kNone) {
+    root_ = new_child;
+  } else {
+    Node& p = nodes_[o.parent];
+    if (o.prev != kNone)
+      nodes_[o.prev].next = new_child;
+    else
+      p.first = new_child;
+    if (o.next != kNone)
+      nodes_[o.next].prev = new_child;
+    else
+      p.last = new_child;
+  }
+  o.parent = o.prev = o.next = kNone;
+}
+
+template <int N>
+void SmallPQTree<N>::Reverse(Index qnode) {
+  Node& q = nodes_[qnode];
+  for (Index c = q.first; c != kNone; c = nodes_[c].prev) {
+    Index next = nodes_[c].next;
+    nodes_[c].next = nodes_[c].prev;
+    nodes_[c].prev = next;
+  }
+  Index first = q.first;
+  q.first = q.last;
+  q.last = first;
+}
+
+template <int N>
+void SmallPQTree<N>::AppendToList(ChildList* list, Index node) {
+  nodes_[node].next = kNone;
+  nodes_[node].prev = list->tail;
+  if (list->tail != kNone)
+    nodes_[list->tail].next = node;
+  else
+    list->head = node;
+  list->tail = node;
+  list->count++;
+}
+
+template <int N>
+typename SmallPQTree<N>::Index SmallPQTree<N>::Group(const ChildList& list) {
+  if (list.count == 0)
+    return kNone;
+  if (list.count == 1)
+    return list.head;
+  Index group = NewNode(pnode);
+  nodes_[group].first = list.head;
+  nodes_[group].last = list.tail;
+  masks_[group - N].Clear();
+  for (Index c = list.head; c != kNone; c = nodes_[c].next) {
+    nodes_[c].parent = group;
+    AddLeaves(&masks_[group - N], c);
+  }
+  return group;
+}
+
+template <int N>
+void SmallPQTree<N>::SpliceChildren(Index from, bool reversed) {
+  Node& f = nodes_[from];
+  Index parent = f.parent;
+  Index before = f.prev;
+  Index after = f.next;
+  Index head = reversed ? f.last : f.first;
+  Index tail = reversed ? f.first : f.last;
+  if (reversed)
+    Reverse(from);
+  for (Index c = head; c != kNone; c = nodes_[c].next)
+    nodes_[c].parent = parent;
+  nodes_[head].prev = before;
+  nodes_[tail].next = after;
+  if (before != kNone)
+    nodes_[before].next = head;
+  else
+    nodes_[parent].first = head;
+  if (after != kNone)
+    nodes_[after].prev = tail;
+  else
+    nodes_[parent].last = tail;
+  FreeNode(from);
+}
+
+template <int N>
+bool SmallPQTree<N>::MatchesPartialPattern(Index qnode, bool reversed) const {
+  // 0: reading empty children, 1: reading full children.
+  int state = 0;
+  const Node& q = nodes_[qnode];
+  for (Index c = reversed ? q.last : q.first; c != kNone;
+       c = reversed ? nodes_[c].prev : nodes_[c].next) {
+    if (nodes_[c].label == empty) {
+      if (state != 0)
+        return false;
+    } else if (nodes_[c].label == partial) {
+      if (state != 0)
+        return false;
+      state = 1;
+    } else {
+      state = 1;
+    }
+  }
+  return true;
+}
+
+template <int N>
+typename SmallPQTree<N>::Index SmallPQTree<N>::MakePartial(
+    Index node, const LeafSet& S) {
+  Node& x = nodes_[node];
+  if (x.type == qnode) {
+    Index partial_child = kNone;
+    for (Index c = x.first; c != kNone; c = nodes_[c].next) {
+      nodes_[c].label = LabelOf(c, S);
+      if (nodes_[c].label == partial) {
+        if (partial_child != kNone)
+          return kNone;
+        partial_child = c;
+      }
+    }
+
+    // Templates Q1/Q2: the pertinent children must sit at one end.
+    if (!MatchesPartialPattern(node, false)) {
+      if (!MatchesPartialPattern(node, true))
+        return kNone;
+      Reverse(node);
+    }
+    if (partial_child != kNone) {
+      Index merged = MakePartial(partial_child, S);
+      if (merged == kNone)
+        return kNone;
+      SpliceChildren(merged, false);
+    }
+    return node;
+  }
+
+  // Templates P3/P5: gather the empty children on one end of a Q-Node and the
+  // full children on the other, merging in the partial child if there is one.
+  ChildList empties = {kNone, kNone, 0};
+  ChildList fulls = {kNone, kNone, 0};
+  Index partial_child = kNone;
+  for (Index c = x.first; c != kNone;) {
+    Index next = nodes_[c].next;
+    nodes_[c].label = LabelOf(c, S);
+    if (nodes_[c].label == empty) {
+      AppendToList(&empties, c);
+    } else if (nodes_[c].label == full) {
+      AppendToList(&fulls, c);
+    } else {
+      if (partial_child != kNone)
+        return kNone;
+      partial_child = c;
+    }
+    c = next;
+  }
+  x.first = x.last = partial_child;
+
+  Index merged;
+  if (partial_child != kNone) {
+    nodes_[partial_child].prev = nodes_[partial_child].next = kNone;
+    merged = MakePartial(partial_child, S);
+    if (merged == kNone)
+      return kNone;
+  } else {
+    merged = NewNode(qnode);
+  }
+  x.first = x.last = kNone;
+  ReplaceChild(node, merged);
+  masks_[merged - N] = masks_[node - N];
+
+  Index empty_group;
+  if (empties.count > 1) {
+    // Reuse |node| as the P-Node holding the empty children.
+    empty_group = node;
+    x.first = empties.head;
+    x.last = empties.tail;
+    masks_[node - N].Clear();
+    for (Index c = empties.head; c != kNone; c = nodes_[c].next) {
+      nodes_[c].parent = node;
+      AddLeaves(&masks_[node - N], c);
+    }
+  } else {
+    empty_group = empties.head;
+    FreeNode(node);
+  }
+  if (empty_group != kNone)
+    PrependChild(merged, empty_group);
+  Index full_group = Group(fulls);
+  if (full_group != kNone)
+    AppendChild(merged, full_group);
+  return merged;
+}
+
+template <int N>
+typename SmallPQTree<N>::Index SmallPQTree<N>::ReduceRoot(
+    Index node, const LeafSet& S) {
+  Node& x = nodes_[node];
+  if (x.type == pnode) {
+    Index partials[2];
+    int partial_count = 0;
+    ChildList fulls = {kNone, kNone, 0};
+    for (Index c = x.first; c != kNone;) {
+      Index next = nodes_[c].next;
+      nodes_[c].label = LabelOf(c, S);
+      if (nodes_[c].label == full) {
+        Unlink(c);
+        AppendToList(&fulls, c);
+      } else if (nodes_[c].label == partial) {
+        if (partial_count == 2)
+          return kNone;
+        partials[partial_count++] = c;
+      }
+      c = next;
+    }
+    for (int i = 0; i < partial_count; ++i) {
+      partials[i] = MakePartial(partials[i], S);
+      if (partials[i] == kNone)
+        return kNone;
+    }
+
+    // Template P2: the full children move into a P-Node of their own.
+    Index full_group = Group(fulls);
+    if (partial_count == 0) {
+      if (full_group != kNone)
+        AppendChild(node, full_group);
+      return node;
+    }
+
+    // Templates P4/P6: the full children go between the full ends of the
+    // partial children, all merged into a single Q-Node.
+    Index merged = partials[0];
+    if (full_group != kNone) {
+      AppendChild(merged, full_group);
+      AddLeaves(&masks_[merged - N], full_group);
+    }
+    if (partial_count == 2) {
+      Unlink(partials[1]);
+      for (Index c = nodes_[partials[1]].last; c != kNone;) {
+        Index prev = nodes_[c].prev;
+        AppendChild(merged, c);
+        c = prev;
+      }
+      masks_[merged - N] |= masks_[partials[1] - N];
+      FreeNode(partials[1]);
+    }
+    if (x.first == x.last) {
+      Unlink(merged);
+      ReplaceChild(node, merged);
+      FreeNode(node);
+      return merged;
+    }
+    return node;
+  }
+
+  // Templates Q1/Q2/Q3: the pertinent children must be consecutive with any
+  // partial children on the ends of that run.
+  Index begin = kNone, end = kNone;
+  for (Index c = x.first; c != kNone; c = nodes_[c].next) {
+    nodes_[c].label = LabelOf(c, S);
+    if (nodes_[c].label != empty) {
+      if (begin == kNone)
+        begin = c;
+      end = c;
+    }
+  }
+  for (Index c = nodes_[begin].next; c != end; c = nodes_[c].next)
+    if (nodes_[c].label != full)
+      return kNone;
+  if (nodes_[begin].label == partial) {
+    Index merged = MakePartial(begin, S);
+    if (merged == kNone)
+      return kNone;
+    SpliceChildren(merged, false);
+  }
+  if (end != begin && nodes_[end].label == partial) {
+    Index merged = MakePartial(end, S);
+    if (merged == kNone)
+      return kNone;
+    SpliceChildren(merged, true);
+  }
+  return node;
+}
+
+template <int N>
+bool SmallPQTree<N>::Reduce(const LeafSet& S) {
+  if (S.Count() < 2)
+    return true;
+  if (invalid_)
+    return false;
+  if (!S.SubsetOf(leaves_)) {
+    invalid_ = true;
+    return false;
+  }
+
+  // The pertinent root is the deepest node whose leaves contain S.
+  Index root = nodes_[S.First()].parent;
+  while (!S.SubsetOf(masks_[root - N]))
+    root = nodes_[root].parent;
+  // A full pertinent root only matches templates L1, P1 and Q1, which leave
+  // the tree untouched.
+  if (masks_[root - N] == S)
+    return true;
+
+  if (ReduceRoot(root, S) == kNone) {
+    invalid_ = true;
+    return false;
+  }
+  return true;
+}
+
+template <int N>
+void SmallPQTree<N>::FindFrontier(Index node, list<int>* out) const {
+  if (nodes_[node].type == leaf) {
+    out->push_back(node);
+    return;
+  }
+  for (Index c = nodes_[node].first; c != kNone; c = nodes_[c].next)
+    FindFrontier(c, out);
+}
+
+template <int N>
+void SmallPQTree<N>::Print(Index node, string* out) const {
+  if (nodes_[node].type == leaf) {
+    char value_str[10];
+    sprintf(value_str, "%d", node);
+    *out += value_str;
+    return;
+  }
+  *out += nodes_[node].type == pnode ? "(" : "[";
+  for (Index c = nodes_[node].first; c != kNone; c = nodes_[c].next) {
+    Print(c, out);
+    if (nodes_[c].next != kNone)
+      *out += " ";
+  }
+  *out += nodes_[node].type == pnode ? ")" : "]";
+}
+
+#endif